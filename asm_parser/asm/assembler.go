@@ -0,0 +1,380 @@
+package asm
+
+import (
+	"fmt"
+	"io"
+	"os"
+	"strings"
+)
+
+type AssemblerConfig struct {
+	verbose				bool
+	optimizationLevel 	int
+	entry 				string    // label the image starts at, see Image
+	raw 				bool      // output is asld -raw, fixed at address 0, see layout
+	log 				io.Writer // where verbose output goes
+
+	// TODO: Remove the comment wehen different versions/arch of the VM is made
+	// targetArch 			string
+}
+
+type Assembler struct {
+	symbolTable *SymbolTable
+	config 		AssemblerConfig
+	units       []unitSpan // set by Link, names the file in layout errors
+	warnings    []*AssemblerError
+}
+
+type AssemblerOption func(*AssemblerConfig)
+
+func WithVerbose(v bool) AssemblerOption {
+    return func(c *AssemblerConfig) {
+        c.verbose = v
+    }
+}
+
+func WithOptimization(level int) AssemblerOption {
+    return func(c *AssemblerConfig) {
+        c.optimizationLevel = level
+    }
+}
+
+// WithEntry sets the entry point of the Image to a label (default: address 0)
+func WithEntry(label string) AssemblerOption {
+    return func(c *AssemblerConfig) {
+        c.entry = label
+    }
+}
+
+// WithRaw says the code is written as the bare stream from address 0 rather
+// than a relocatable image, so label addresses may use the short MOVI
+func WithRaw(raw bool) AssemblerOption {
+    return func(c *AssemblerConfig) {
+        c.raw = raw
+    }
+}
+
+// WithLog sends verbose output to w instead of stderr
+func WithLog(w io.Writer) AssemblerOption {
+    return func(c *AssemblerConfig) {
+        c.log = w
+    }
+}
+
+func NewAssembler(opts ...AssemblerOption) *Assembler {
+	config := AssemblerConfig{
+        verbose:         false,
+        optimizationLevel: 0,
+        log:             os.Stderr,
+    }
+    
+    for _, opt := range opts {
+        opt(&config)
+    }
+    
+    return &Assembler{
+        symbolTable: NewSymbolTable(),
+        config:      config,
+    }
+}
+
+// AssembleImage assembles one source file into a loadable image, what asld
+// writes for a single input
+func (a *Assembler) AssembleImage(source []byte) (*Image, error) {
+    instructions, err := a.AssembleBytes(source)
+    if err != nil {
+        return nil, err
+    }
+    return a.Image(instructions)
+}
+
+// Image encodes instructions from AssembleBytes or Link into an image with
+// this assembler's symbols, starting at the WithEntry label
+func (a *Assembler) Image(instructions []Instruction) (*Image, error) {
+    var entry uint32
+    if a.config.entry != "" {
+        addr, ok := a.symbolTable.Resolve(strings.ToUpper(a.config.entry))
+        if !ok {
+            return nil, newError(StageLinker, 0, "entry label %q is not defined", a.config.entry)
+        }
+        entry = addr
+    }
+
+    code := NewEncoder().EncodeAll(instructions)
+    return NewImage(instructions, code, a.symbolTable.All(), entry), nil
+}
+
+// Symbols returns every label and its address
+func (a *Assembler) Symbols() map[string]uint32 {
+    return a.symbolTable.All()
+}
+
+// Warnings returns the warnings of everything assembled so far
+func (a *Assembler) Warnings() []*AssemblerError {
+    return a.warnings
+}
+
+func (a *Assembler) logf(format string, args ...any) {
+    if a.config.verbose {
+        fmt.Fprintf(a.config.log, format, args...)
+    }
+}
+
+// Assemble performs two-pass assembly, see AssembleBytes for the streaming form
+func (a *Assembler) Assemble(source string) ([]Instruction, error) {
+
+    lexer := NewLexer(source)
+    lines, err := lexer.Tokenize()
+    if err != nil {
+        return nil, wrapError(StageLexer, 0, err)
+    }
+
+    // Pass 1: Build symbol table
+    if err := a.buildSymbolTable(lines); err != nil {
+        return nil, err
+    }
+
+    // Pass 2: Parse and resolve symbols
+    parser := NewParser(a.symbolTable)
+    instructions, err := parser.Parse(lines)
+    a.warnings = append(a.warnings, parser.warnings...)
+    if err != nil {
+        return nil, err
+    }
+
+    return a.finish(instructions)
+}
+
+// fixup is a label operand AssembleBytes saw before the label's definition
+type fixup struct {
+    index int    // into the instruction list
+    text  []byte // the source line, for the error if it never gets defined
+}
+
+// AssembleBytes is Assemble in a single streaming pass: each line is
+// tokenized and parsed as it is scanned, and label operands that refer
+// forward are backpatched once the whole source has been seen. Nothing is
+// kept per source line, so memory follows the instruction count.
+func (a *Assembler) AssembleBytes(source []byte) ([]Instruction, error) {
+    instructions, err := a.parse(source, false)
+    if err != nil {
+        return nil, err
+    }
+    return a.finish(instructions)
+}
+
+// parse is the scanning half of AssembleBytes. With external set, labels
+// that are never defined are left to Link instead of being an error.
+func (a *Assembler) parse(source []byte, external bool) ([]Instruction, error) {
+    scanner := NewScanner(source)
+    parser := NewParser(a.symbolTable)
+
+    // Around 10 bytes per instruction line in practice, append grows it otherwise
+    instructions := make([]Instruction, 0, len(source)/10+1)
+    var fixups []fixup
+
+    for scanner.Scan() {
+        line := scanner.Line()
+
+        if len(line.Tokens) == 1 && line.Tokens[0].Type == TokenLabel {
+            address := uint32(len(instructions) * 2)
+            if err := a.symbolTable.Define(line.Tokens[0].Value, address, line.Number); err != nil {
+                e := wrapError(StageSymbols, line.Number, err)
+                e.Token = line.Tokens[0].Value
+                return nil, e
+            }
+            continue
+        }
+
+        instr, err := parser.ParseDeferred(line)
+        if err != nil {
+            e := wrapError(StageParser, line.Number, err)
+            e.Source = string(scanner.Text())
+            return nil, e
+        }
+
+        if instr.Label != "" {
+            if addr, ok := a.symbolTable.Resolve(instr.Label); ok {
+                instr.Immediate = uint16(addr)
+            } else {
+                fixups = append(fixups, fixup{index: len(instructions), text: scanner.Text()})
+            }
+        }
+        instructions = append(instructions, instr)
+    }
+    a.warnings = append(a.warnings, parser.warnings...)
+
+    for _, f := range fixups {
+        instr := &instructions[f.index]
+        addr, ok := a.symbolTable.Resolve(instr.Label)
+        if !ok && !external {
+            e := newError(StageSymbols, instr.Line, "undefined label: %s", instr.Label)
+            e.Token = instr.Label
+            e.Source = string(f.text)
+            return nil, e
+        }
+        instr.Immediate = uint16(addr)
+    }
+
+    return instructions, nil
+}
+
+// finish runs what follows parsing: the unused label warning, the optimizer and layout
+func (a *Assembler) finish(instructions []Instruction) ([]Instruction, error) {
+    a.markEntry()
+    a.warnUnused()
+    instructions = a.optimize(instructions)
+
+    if err := a.layout(instructions); err != nil {
+        return nil, err
+    }
+
+    return instructions, nil
+}
+
+func (a *Assembler) optimize(instructions []Instruction) []Instruction {
+    if a.config.optimizationLevel > 0 {
+        before := len(instructions)
+        optimizer := NewOptimizer(a.symbolTable, a.config.optimizationLevel)
+        instructions = optimizer.Optimize(instructions)
+
+        a.logf("Optimizer (-O%d): %d → %d instructions\n",
+            a.config.optimizationLevel, before, len(instructions))
+    }
+    return instructions
+}
+
+// markEntry keeps the WithEntry label alive: control enters there from the
+// loader, which no instruction refers to, so it is exported like Compile's labels
+func (a *Assembler) markEntry() {
+    if a.config.entry == "" {
+        return
+    }
+    if sym, ok := a.symbolTable.Get(strings.ToUpper(a.config.entry)); ok {
+        sym.Exported = true
+        sym.Used = true
+    }
+}
+
+// warnUnused adds a warning for every label nothing refers to
+func (a *Assembler) warnUnused() {
+    for _, sym := range a.symbolTable.UnusedSymbols() {
+        w := newWarning(StageSymbols, sym.Line, "unused label: %s", sym.Name)
+        w.File = sym.File
+        w.Token = sym.Name
+        a.warnings = append(a.warnings, w)
+    }
+}
+
+// fitsImm9 reports whether MOVI can hold value in its sign-extended imm9
+func fitsImm9(value uint16) bool {
+    v := int16(value)
+    return v >= -256 && v <= 255
+}
+
+// layout assigns byte addresses. Until here every instruction is counted as
+// 2 bytes, so symbols hold index*2. A PUT that doesn't fit imm9 takes 4 bytes,
+// which can push a label PUT out of range too; widths only grow, so repeating
+// until nothing changes terminates. Unless the output is raw, a label PUT is
+// always the 4-byte MOVIW: its RELOC_WORD literal takes any load address,
+// where an imm9 one would stop fitting as soon as the image moved past 255.
+func (a *Assembler) layout(instructions []Instruction) error {
+    addrs := make([]uint32, len(instructions)+1)
+    addrOf := func(index uint32) uint32 {
+        if idx := int(index / 2); idx < len(addrs) {
+            return addrs[idx]
+        }
+        return index
+    }
+
+    for changed := true; changed; {
+        changed = false
+        for i, instr := range instructions {
+            addrs[i+1] = addrs[i] + instr.Size()
+        }
+
+        for i := range instructions {
+            instr := &instructions[i]
+            if instr.IsExt || instr.IsFused || instr.Opcode != OP_MOVI || instr.IsWide {
+                continue
+            }
+            value := instr.Immediate
+            sym, isLabel := a.symbolTable.Get(instr.Label)
+            if isLabel {
+                value = uint16(addrOf(sym.Address))
+            }
+            if (isLabel && !a.config.raw) || !fitsImm9(value) {
+                instr.IsWide = true
+                changed = true
+            }
+        }
+    }
+
+    a.symbolTable.Relocate(addrOf)
+    for i := range instructions {
+        instr := &instructions[i]
+        instr.Address = addrs[i]
+        if addr, ok := a.symbolTable.Resolve(instr.Label); ok {
+            instr.Immediate = uint16(addr)
+        }
+
+        if !instr.IsExt && !instr.IsFused && instr.IsImm && instr.Opcode != OP_MOVI {
+            if instr.Immediate&1 != 0 {
+                e := newError(StageLayout, instr.Line, "jump to odd address 0x%04X", instr.Immediate)
+                e.File = a.unitName(i)
+                return e
+            }
+            if disp := relDisp(*instr); disp < RelMin || disp > RelMax {
+                e := newError(StageLayout, instr.Line,
+                    "jump to 0x%04X is out of relative range, use a register", instr.Immediate)
+                e.File = a.unitName(i)
+                return e
+            }
+        }
+    }
+
+    return nil
+}
+
+// unitName names the linked file instruction i came from, "" for a single file
+func (a *Assembler) unitName(i int) string {
+    for u := len(a.units) - 1; u >= 0; u-- {
+        if i >= a.units[u].start {
+            return a.units[u].name
+        }
+    }
+    return ""
+}
+
+// relDisp is the word displacement of an immediate jump from the next instruction
+func relDisp(instr Instruction) int {
+    return (int(instr.Immediate) - int(instr.Address+2)) / 2
+}
+
+// buildSymbolTable is Pass 1: collect all label definitions
+func (a *Assembler) buildSymbolTable(lines []Line) error {
+    address := uint32(0)
+
+    for _, line := range lines {
+        if len(line.Tokens) == 0 {
+            continue
+        }
+
+        // Check if this is a label definition
+        if len(line.Tokens) == 1 && line.Tokens[0].Type == TokenLabel {
+            label := line.Tokens[0].Value
+            if err := a.symbolTable.Define(label, address, line.Number); err != nil {
+                e := wrapError(StageSymbols, line.Number, err)
+                e.Token = label
+                return e
+            }
+            // Labels don't consume space
+            continue
+        }
+
+        // Regular instruction - takes 2 bytes (16 bits)
+        address += 2
+    }
+
+    return nil
+}
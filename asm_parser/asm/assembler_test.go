@@ -0,0 +1,84 @@
+package asm
+
+import (
+	"strings"
+	"testing"
+)
+
+// src joins lines into a source file
+func src(lines ...string) []byte {
+	return []byte(strings.Join(lines, "\n") + "\n")
+}
+
+func TestEntryLabelSurvivesOptimization(t *testing.T) {
+	source := src(
+		"HELPER:",
+		"R1, 5 PUT",
+		"RET",
+		"START:",
+		"R0, 7 PUT",
+		"DIE",
+	)
+
+	for level := 0; level <= 2; level++ {
+		a := NewAssembler(WithOptimization(level), WithEntry("start"))
+		img, err := a.AssembleImage(source)
+		if err != nil {
+			t.Fatalf("-O%d: %v", level, err)
+		}
+
+		code := img.Sections[0].Data
+		if img.Entry+2 > uint32(len(code)) {
+			t.Fatalf("-O%d: entry 0x%04X is past the end of %d bytes of code", level, img.Entry, len(code))
+		}
+		want := NewEncoder().Encode(Instruction{Opcode: OP_MOVI, Dst: R0, Immediate: 7, IsImm: true})
+		if got := uint16(code[img.Entry]) | uint16(code[img.Entry+1])<<8; got != want {
+			t.Errorf("-O%d: entry 0x%04X holds 0x%04X, want START's PUT 0x%04X", level, img.Entry, got, want)
+		}
+		for _, w := range a.Warnings() {
+			if w.Token == "START" {
+				t.Errorf("-O%d: %v", level, w)
+			}
+		}
+	}
+}
+
+func TestEntryLabelUndefined(t *testing.T) {
+	a := NewAssembler(WithEntry("MISSING"))
+	if _, err := a.AssembleImage(src("R0, 1 PUT", "DIE")); err == nil {
+		t.Fatal("an undefined entry label assembled")
+	}
+}
+
+func TestLabelPutRelocation(t *testing.T) {
+	source := src(
+		"R0, MSG PUT",
+		"DIE",
+		"MSG:",
+		"DIE",
+	)
+
+	tests := []struct {
+		name string
+		raw  bool
+		size uint32 // of the PUT
+		kind RelocKind
+	}{
+		{"sectioned", false, 4, RELOC_WORD},
+		{"raw", true, 2, RELOC_IMM9},
+	}
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			img, err := NewAssembler(WithRaw(tt.raw)).AssembleImage(source)
+			if err != nil {
+				t.Fatal(err)
+			}
+			if len(img.Relocs) != 1 || img.Relocs[0].Kind != tt.kind {
+				t.Fatalf("relocations %+v, want one of kind %d", img.Relocs, tt.kind)
+			}
+			if msg := img.Symbols["MSG"]; msg != tt.size+2 {
+				t.Errorf("MSG at 0x%04X, want 0x%04X after a %d-byte PUT", msg, tt.size+2, tt.size)
+			}
+		})
+	}
+}
@@ -0,0 +1,134 @@
+package asm
+
+import (
+	"bytes"
+	"crypto/sha256"
+	"encoding/gob"
+	"encoding/hex"
+	"fmt"
+	"os"
+	"path/filepath"
+	"runtime"
+	"sync"
+)
+
+// objectFormat is part of every cache key, bump it when Object or
+// Instruction change shape or meaning so stale objects are never reused
+const objectFormat = "asld-object-2"
+
+// BuildResult is what CompileUnits did: one object per input, in order
+type BuildResult struct {
+	Objects []*Object
+	Cached  int // objects taken from the cache
+}
+
+// CompileUnits assembles every file into an Object concurrently, at most one
+// goroutine per CPU. With cacheDir set, an object is stored under the hash
+// of its source (and optimization level) and reused while the file doesn't
+// change, so a rebuild only assembles what was edited. Errors are reported
+// for the first failing file in input order.
+func CompileUnits(paths []string, optLevel int, cacheDir string) (*BuildResult, error) {
+	if cacheDir != "" {
+		if err := os.MkdirAll(cacheDir, 0755); err != nil {
+			return nil, fmt.Errorf("object cache: %w", err)
+		}
+	}
+
+	objects := make([]*Object, len(paths))
+	cached := make([]bool, len(paths))
+	errs := make([]error, len(paths))
+
+	var wg sync.WaitGroup
+	slots := make(chan struct{}, runtime.NumCPU())
+	for i, path := range paths {
+		wg.Add(1)
+		go func(i int, path string) {
+			defer wg.Done()
+			slots <- struct{}{}
+			defer func() { <-slots }()
+			objects[i], cached[i], errs[i] = compileUnit(path, optLevel, cacheDir)
+		}(i, path)
+	}
+	wg.Wait()
+
+	result := &BuildResult{Objects: objects}
+	for i := range paths {
+		if errs[i] != nil {
+			return nil, errs[i]
+		}
+		if cached[i] {
+			result.Cached++
+		}
+	}
+	return result, nil
+}
+
+func compileUnit(path string, optLevel int, cacheDir string) (*Object, bool, error) {
+	source, err := os.ReadFile(path)
+	if err != nil {
+		return nil, false, err
+	}
+
+	var cachePath string
+	if cacheDir != "" {
+		sum := sha256.New()
+		fmt.Fprintf(sum, "%s -O%d\n", objectFormat, optLevel)
+		sum.Write(source)
+		cachePath = filepath.Join(cacheDir, hex.EncodeToString(sum.Sum(nil))+".o")
+
+		if obj, err := loadObject(cachePath); err == nil {
+			obj.Name = path
+			for _, w := range obj.Warnings {
+				w.File = path
+			}
+			return obj, true, nil
+		}
+	}
+
+	assembler := NewAssembler(WithOptimization(optLevel))
+	obj, err := assembler.Compile(path, source)
+	if err != nil {
+		return nil, false, err
+	}
+
+	// A cache that can't be written only costs the next build time
+	if cachePath != "" {
+		storeObject(cachePath, obj)
+	}
+	return obj, false, nil
+}
+
+func loadObject(path string) (*Object, error) {
+	data, err := os.ReadFile(path)
+	if err != nil {
+		return nil, err
+	}
+	var obj Object
+	if err := gob.NewDecoder(bytes.NewReader(data)).Decode(&obj); err != nil {
+		return nil, err
+	}
+	return &obj, nil
+}
+
+// storeObject writes through a temporary file so concurrent builds never
+// see a half-written object
+func storeObject(path string, obj *Object) error {
+	var buf bytes.Buffer
+	if err := gob.NewEncoder(&buf).Encode(obj); err != nil {
+		return err
+	}
+	tmp, err := os.CreateTemp(filepath.Dir(path), ".tmp-*")
+	if err != nil {
+		return err
+	}
+	if _, err := tmp.Write(buf.Bytes()); err != nil {
+		tmp.Close()
+		os.Remove(tmp.Name())
+		return err
+	}
+	if err := tmp.Close(); err != nil {
+		os.Remove(tmp.Name())
+		return err
+	}
+	return os.Rename(tmp.Name(), path)
+}
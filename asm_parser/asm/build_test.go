@@ -0,0 +1,199 @@
+package asm
+
+import (
+	"os"
+	"path/filepath"
+	"strings"
+	"testing"
+)
+
+// writeUnits writes name/source pairs into dir and returns their paths in order
+func writeUnits(t *testing.T, dir string, units ...string) []string {
+	t.Helper()
+	var paths []string
+	for i := 0; i+1 < len(units); i += 2 {
+		path := filepath.Join(dir, units[i])
+		if err := os.WriteFile(path, []byte(units[i+1]), 0644); err != nil {
+			t.Fatal(err)
+		}
+		paths = append(paths, path)
+	}
+	return paths
+}
+
+func build(t *testing.T, paths []string, cacheDir string) (*BuildResult, []Instruction, *Assembler) {
+	t.Helper()
+	result, err := CompileUnits(paths, 1, cacheDir)
+	if err != nil {
+		t.Fatalf("compile: %v", err)
+	}
+	a := NewAssembler()
+	instructions, err := a.Link(result.Objects)
+	if err != nil {
+		t.Fatalf("link: %v", err)
+	}
+	return result, instructions, a
+}
+
+func TestLinkCrossFileLabel(t *testing.T) {
+	dir := t.TempDir()
+	paths := writeUnits(t, dir,
+		"main.vm", string(src("R6, SUB PUT", "R6 EXEC", "DIE")),
+		"sub.vm", string(src("SUB:", "R0, 42 PUT", "RET")),
+	)
+
+	_, instructions, a := build(t, paths, "")
+	sub, ok := a.symbolTable.Get("SUB")
+	if !ok {
+		t.Fatal("SUB isn't in the linked symbol table")
+	}
+	if sub.File != paths[1] {
+		t.Errorf("SUB defined in %q, want %q", sub.File, paths[1])
+	}
+	// main.vm is the wide PUT, the call and DIE
+	if sub.Address != 8 {
+		t.Errorf("SUB at 0x%04X, want 0x0008", sub.Address)
+	}
+	if instructions[0].Immediate != uint16(sub.Address) {
+		t.Errorf("PUT loads 0x%04X, SUB is 0x%04X", instructions[0].Immediate, sub.Address)
+	}
+}
+
+func TestLinkUndefinedLabel(t *testing.T) {
+	dir := t.TempDir()
+	paths := writeUnits(t, dir, "main.vm", string(src("R6, NOWHERE PUT", "DIE")))
+
+	result, err := CompileUnits(paths, 0, "")
+	if err != nil {
+		t.Fatal(err)
+	}
+	_, err = NewAssembler().Link(result.Objects)
+	if err == nil || !strings.Contains(err.Error(), "NOWHERE") || !strings.Contains(err.Error(), paths[0]) {
+		t.Fatalf("got %v, want an undefined label error naming NOWHERE in %s", err, paths[0])
+	}
+}
+
+func TestLinkDuplicateLabel(t *testing.T) {
+	dir := t.TempDir()
+	paths := writeUnits(t, dir,
+		"a.vm", string(src("DUP:", "DIE")),
+		"b.vm", string(src("R0, 1 PUT", "DUP:", "DIE")),
+	)
+
+	result, err := CompileUnits(paths, 0, "")
+	if err != nil {
+		t.Fatal(err)
+	}
+	_, err = NewAssembler().Link(result.Objects)
+	if err == nil {
+		t.Fatal("a label defined in two files linked")
+	}
+	for _, want := range []string{"DUP", paths[0] + ":1", paths[1] + ":2"} {
+		if !strings.Contains(err.Error(), want) {
+			t.Errorf("%q doesn't name %s", err, want)
+		}
+	}
+}
+
+func TestObjectCache(t *testing.T) {
+	dir := t.TempDir()
+	cache := filepath.Join(dir, "cache")
+	paths := writeUnits(t, dir,
+		"main.vm", string(src("R6, SUB PUT", "R6 EXEC", "DIE")),
+		"sub.vm", string(src("SUB:", "R0, 42 PUT", "RET")),
+	)
+
+	first, want, _ := build(t, paths, cache)
+	if first.Cached != 0 {
+		t.Fatalf("cold build reused %d objects", first.Cached)
+	}
+
+	// Unchanged: both from the cache, and the same program
+	again, got, _ := build(t, paths, cache)
+	if again.Cached != 2 {
+		t.Errorf("unchanged rebuild reused %d of 2 objects", again.Cached)
+	}
+	if listing(got) != listing(want) {
+		t.Errorf("cached build differs:\n%s\nwant:\n%s", listing(got), listing(want))
+	}
+	for i, obj := range again.Objects {
+		if obj.Name != paths[i] {
+			t.Errorf("cached object %d is named %q, want %q", i, obj.Name, paths[i])
+		}
+	}
+
+	// An edit only recompiles that file, and the result has the edit
+	writeUnits(t, dir, "sub.vm", string(src("SUB:", "R0, 43 PUT", "RET")))
+	edited, got, a := build(t, paths, cache)
+	if edited.Cached != 1 {
+		t.Errorf("rebuild after one edit reused %d of 2 objects, want 1", edited.Cached)
+	}
+	sub, _ := a.symbolTable.Get("SUB")
+	loads := -1
+	for _, instr := range got {
+		if instr.Address == sub.Address {
+			loads = int(instr.Immediate)
+		}
+	}
+	if loads != 43 {
+		t.Errorf("SUB loads %d after the edit, want 43", loads)
+	}
+
+	// The optimization level is part of the key
+	if result, err := CompileUnits(paths, 2, cache); err != nil || result.Cached != 0 {
+		t.Errorf("-O2 build reused %d -O1 objects (%v)", result.Cached, err)
+	}
+
+	// No temporary files are left behind by the atomic rename
+	entries, err := os.ReadDir(cache)
+	if err != nil {
+		t.Fatal(err)
+	}
+	for _, e := range entries {
+		if strings.HasPrefix(e.Name(), ".tmp-") {
+			t.Errorf("temporary %s left in the cache", e.Name())
+		}
+	}
+}
+
+func TestObjectCacheCorruptEntry(t *testing.T) {
+	dir := t.TempDir()
+	cache := filepath.Join(dir, "cache")
+	paths := writeUnits(t, dir, "main.vm", string(src("R0, 1 PUT", "DIE")))
+
+	build(t, paths, cache)
+	entries, _ := os.ReadDir(cache)
+	for _, e := range entries {
+		os.WriteFile(filepath.Join(cache, e.Name()), []byte("not gob"), 0644)
+	}
+
+	result, _, _ := build(t, paths, cache)
+	if result.Cached != 0 {
+		t.Errorf("a corrupt object was reused")
+	}
+}
+
+// Many files compile concurrently and still link in input order
+func TestCompileUnitsOrder(t *testing.T) {
+	dir := t.TempDir()
+	var units []string
+	for i := 0; i < 32; i++ {
+		name := string(rune('A'+i%26)) + strings.Repeat("X", i/26)
+		units = append(units, name+".vm", string(src(name+":", "R0, 1 PUT")))
+	}
+	paths := writeUnits(t, dir, units...)
+
+	result, _, a := build(t, paths, "")
+	for i, obj := range result.Objects {
+		if obj.Name != paths[i] {
+			t.Fatalf("object %d is %q, want %q", i, obj.Name, paths[i])
+		}
+	}
+	for i := 1; i < len(paths); i++ {
+		prev, _ := a.symbolTable.Get(strings.TrimSuffix(filepath.Base(paths[i-1]), ".vm"))
+		cur, _ := a.symbolTable.Get(strings.TrimSuffix(filepath.Base(paths[i]), ".vm"))
+		if cur.Address <= prev.Address {
+			t.Fatalf("%s at 0x%04X isn't after %s at 0x%04X", cur.Name, cur.Address, prev.Name, prev.Address)
+		}
+	}
+}
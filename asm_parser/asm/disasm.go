@@ -0,0 +1,57 @@
+package asm
+
+import "fmt"
+
+// Disassemble renders one instruction word the way the VM's own disassembler
+// (--profile, cpu_dump) spells it, so traces and reports read the same
+func Disassemble(word uint16) string {
+	op := Opcode(word >> 12)
+	dst := uint8(word>>9) & 0x7
+	src := uint8(word>>6) & 0x7
+	third := uint8(word>>3) & 0x7
+	imm := int16(word<<7) >> 7 // imm9, sign extended
+
+	switch op {
+	case OP_HALT, OP_NOP:
+		return OpcodeTable[op].Name
+	case OP_MOVI:
+		return fmt.Sprintf("MOVI R%d, %d", dst, imm)
+	case OP_MOV, OP_CMP:
+		return fmt.Sprintf("%s R%d, R%d", OpcodeTable[op].Name, dst, src)
+	case OP_STDOUT, OP_STDIN:
+		return fmt.Sprintf("%s %d, R%d", OpcodeTable[op].Name, dst, src)
+	case OP_EXT:
+		if ExtOpcode(dst) == EXT_RET {
+			return "RET"
+		}
+		return fmt.Sprintf("%s R%d, R%d", ExtOpcodeTable[ExtOpcode(dst)].Name, src, third)
+	case OP_EXT2:
+		name := Ext2OpcodeTable[Ext2Opcode(dst)].Name
+		switch {
+		case Ext2Opcode(dst) == EXT2_BLOCK && BlockOpcode(word&0x7) == BLOCK_SETSEG:
+			return fmt.Sprintf("SETSEG %s, R%d", SegmentNames[third&0x3], src)
+		case Ext2Opcode(dst) == EXT2_BLOCK && BlockOpcode(word&0x7) == BLOCK_GETSEG:
+			return fmt.Sprintf("GETSEG R%d, %s", src, SegmentNames[third&0x3])
+		}
+		if Ext2Opcode(dst) == EXT2_BLOCK {
+			info, ok := BlockOpcodeTable[BlockOpcode(word&0x7)]
+			name = info.Name
+			if !ok {
+				name = fmt.Sprintf("BLOCK_%d", word&0x7)
+			}
+		}
+		return fmt.Sprintf("%s R%d, R%d", name, src, third)
+	case OP_FUSE:
+		name := FuseOpcodeTable[FuseOpcode(dst)].Name
+		switch FuseOpcode(dst) {
+		case FUSE_DJNZ:
+			return fmt.Sprintf("%s R%d, R%d", name, src, third)
+		case FUSE_MOVIW:
+			return fmt.Sprintf("%s R%d", name, src)
+		case FUSE_JMPR, FUSE_JZR, FUSE_JNZR:
+			return fmt.Sprintf("%s %+d", name, imm)
+		}
+		return fmt.Sprintf("%s R%d, R%d, R%d", name, src, third, word&0x7)
+	}
+	return fmt.Sprintf("%s R%d", OpcodeTable[op].Name, dst)
+}
@@ -0,0 +1,117 @@
+package asm
+
+type Encoder struct {}
+
+func NewEncoder() *Encoder {
+	return &Encoder{}
+}
+
+// Encode converts a single instruction to 16-bit binary
+func (e *Encoder) Encode(instr Instruction) uint16 {
+	if instr.IsExt {
+		return e.encodeExtended(instr)
+	}
+
+	if instr.IsExt2 {
+		return e.encodeExt2(instr)
+	}
+
+	if instr.IsFused {
+		return e.encodeFused(instr)
+	}
+
+	if instr.IsWide {
+		return e.encodeWide(instr)
+	}
+
+	if instr.IsImm && instr.Opcode != OP_MOVI {
+		return e.encodeRelative(instr)
+	}
+
+	if instr.IsImm {
+		return e.encodeImmediate(instr)
+	}
+
+	return e.encodeRegister(instr)
+}
+
+// Regular instruction: OPCODE(4) | DST(3) | SRC(3) | UNUSED(6)
+func (e *Encoder) encodeRegister(instr Instruction) uint16{
+	return (uint16(instr.Opcode) << 12) |
+			(uint16(instr.Dst) << 9) |
+			(uint16(instr.Src) << 6)
+
+}
+
+// Immediate instruction: OPCODE(4) | DST(3) | IMM(9)
+func (e *Encoder) encodeImmediate(instr Instruction) uint16{
+	return (uint16(instr.Opcode) << 12) |
+		(uint16(instr.Dst) << 9) |
+		(instr.Immediate & 0x1FF)
+}
+
+// Extended instruction: OP_EXT(4) | EXT_OP(3) | DST(3) | SRC(3) | UNUSED(3)
+func (e *Encoder) encodeExtended(instr Instruction) uint16{
+	return (uint16(OP_EXT) << 12) |
+		(uint16(instr.ExtOpcode) << 9) |
+		(uint16(instr.Dst) << 6) |
+		(uint16(instr.Src) << 3)
+}
+
+// Second extension page: OP_EXT2(4) | EXT2_OP(3) | DST(3) | SRC(3) | BLOCK_OP(3)
+func (e *Encoder) encodeExt2(instr Instruction) uint16{
+	return (uint16(OP_EXT2) << 12) |
+		(uint16(instr.Ext2Opcode) << 9) |
+		(uint16(instr.Dst) << 6) |
+		(uint16(instr.Src) << 3) |
+		uint16(instr.BlockOpcode)
+}
+
+// Fused instruction: OP_FUSE(4) | FUSE_OP(3) | DST(3) | SRC(3) | TARGET(3)
+func (e *Encoder) encodeFused(instr Instruction) uint16{
+	return (uint16(OP_FUSE) << 12) |
+		(uint16(instr.FuseOpcode) << 9) |
+		(uint16(instr.Dst) << 6) |
+		(uint16(instr.Src) << 3) |
+		uint16(instr.Target)
+}
+
+// Wide MOVI: OP_FUSE(4) | FUSE_MOVIW(3) | DST(3) | UNUSED(6), EncodeAll appends the value
+func (e *Encoder) encodeWide(instr Instruction) uint16{
+	return (uint16(OP_FUSE) << 12) |
+		(uint16(FUSE_MOVIW) << 9) |
+		(uint16(instr.Dst) << 6)
+}
+
+// Immediate jump: OP_FUSE(4) | FUSE_JMPR/JZR/JNZR(3) | DISP(9), words from the next instruction
+func (e *Encoder) encodeRelative(instr Instruction) uint16{
+	fuseOp := FUSE_JMPR
+	switch instr.Opcode {
+	case OP_JZ:
+		fuseOp = FUSE_JZR
+	case OP_JNZ:
+		fuseOp = FUSE_JNZR
+	}
+	return (uint16(OP_FUSE) << 12) |
+		(uint16(fuseOp) << 9) |
+		(uint16(relDisp(instr)) & 0x1FF)
+}
+
+func (e *Encoder) EncodeAll(instructions []Instruction) []byte{
+	size := 0
+	for _, instr := range instructions {
+		size += int(instr.Size())
+	}
+	binary := make([]byte, 0, size)
+
+	for _, instr := range instructions {
+		encoded := e.Encode(instr)
+		// Little endian
+		binary = append(binary, byte(encoded & 0xFF), byte((encoded >> 8) & 0xFF))
+		if instr.IsWide {
+			binary = append(binary, byte(instr.Immediate & 0xFF), byte(instr.Immediate >> 8))
+		}
+	}
+
+	return binary
+}
@@ -0,0 +1,117 @@
+package asm
+
+import (
+	"errors"
+	"fmt"
+	"strings"
+)
+
+type AssemblyStage string
+
+const (
+	StageLexer    AssemblyStage = "lexer"
+    StageParser   AssemblyStage = "parser"
+    StageSymbols  AssemblyStage = "symbols"
+    StageLayout   AssemblyStage = "layout"
+    StageLinker   AssemblyStage = "linker"
+    StageEncoder  AssemblyStage = "encoder"
+)
+
+type Severity string
+
+const (
+	SeverityError   Severity = "error"
+	SeverityWarning Severity = "warning"
+)
+
+// AssemblerError is one diagnostic. Every error the assembler returns is an
+// *AssemblerError (use errors.As), warnings are kept in Assembler.Warnings.
+// The JSON form is what asld -json prints, one object per line.
+type AssemblerError struct {
+	Stage 	 AssemblyStage `json:"stage"`
+	Severity Severity      `json:"severity"`
+	File     string        `json:"file,omitempty"`
+	Line	 int           `json:"line,omitempty"`
+	Column   int           `json:"column,omitempty"`
+	Token 	 string        `json:"token,omitempty"`
+	Message	 string        `json:"message"`
+	Source   string        `json:"source,omitempty"` // the offending source line
+	Cause 	 error         `json:"-"`
+}
+
+func (e *AssemblerError) Error() string {
+	var sb strings.Builder
+	severity := e.Severity
+	if severity == "" {
+		severity = SeverityError
+	}
+	fmt.Fprintf(&sb, "%s %s: ", e.Stage, severity)
+
+	switch {
+	case e.File != "" && e.Line > 0:
+		fmt.Fprintf(&sb, "%s:%d: ", e.File, e.Line)
+	case e.File != "":
+		fmt.Fprintf(&sb, "%s: ", e.File)
+	case e.Line > 0:
+		fmt.Fprintf(&sb, "line %d: ", e.Line)
+	}
+	if e.Column > 0 {
+		fmt.Fprintf(&sb, "col %d: %s: ", e.Column, e.Token)
+	}
+
+	sb.WriteString(e.Message)
+	if e.Source != "" {
+		fmt.Fprintf(&sb, "\n  → %s", e.Source)
+	}
+	return sb.String()
+}
+
+func (e *AssemblerError) Unwrap() error {
+    return e.Cause
+}
+
+func NewLexerError(line, col int, token, msg string) *AssemblerError {
+    return &AssemblerError{
+        Stage:    StageLexer,
+        Severity: SeverityError,
+        Line:     line,
+        Column:   col,
+        Token:    token,
+        Message:  msg,
+    }
+}
+
+func NewParserError(line int, msg string) *AssemblerError {
+    return &AssemblerError{
+        Stage:    StageParser,
+        Severity: SeverityError,
+        Line:     line,
+        Message:  msg,
+    }
+}
+
+func newError(stage AssemblyStage, line int, format string, args ...any) *AssemblerError {
+    return &AssemblerError{
+        Stage:    stage,
+        Severity: SeverityError,
+        Line:     line,
+        Message:  fmt.Sprintf(format, args...),
+    }
+}
+
+func newWarning(stage AssemblyStage, line int, format string, args ...any) *AssemblerError {
+    e := newError(stage, line, format, args...)
+    e.Severity = SeverityWarning
+    return e
+}
+
+// wrapError makes err a diagnostic of stage, unless it already is one
+func wrapError(stage AssemblyStage, line int, err error) *AssemblerError {
+    var ae *AssemblerError
+    if errors.As(err, &ae) {
+        return ae
+    }
+    e := newError(stage, line, "%s", err.Error())
+    e.Cause = err
+    return e
+}
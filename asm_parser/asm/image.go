@@ -0,0 +1,178 @@
+package asm
+
+import (
+	"encoding/binary"
+	"sort"
+)
+
+// Sectioned image, the VM's default input format (see cpu_load_image in
+// main.c). All fields are little-endian:
+//
+//	header   "VMIM", u16 version, u16 nsections, u32 entry,
+//	         u32 symbol table offset, u32 relocation table offset (0 = none)
+//	sections nsections x {u8 type, 3 pad, u32 addr, u32 size, u32 file offset}
+//	symbols  u32 count, count x {u32 addr, u8 length, name}
+//	relocs   u32 count, count x u32 (addr | kind << 28)
+//
+// Section contents follow the tables, page aligned once they are a page or
+// more. BSS sections take no space in the file.
+const (
+	ImageMagic       = "VMIM"
+	ImageVersion     = 1
+	imageHeaderSize  = 20
+	imageSectionSize = 16
+	imagePageSize    = 4096 // sections this big start on a page so the VM can map them
+)
+
+type SectionType uint8
+
+const (
+	SECTION_CODE SectionType = 1
+	SECTION_DATA SectionType = 2
+	SECTION_BSS  SectionType = 3
+)
+
+type RelocKind uint8
+
+const (
+	RELOC_WORD RelocKind = 0 // 16-bit absolute address, the MOVIW literal
+	RELOC_IMM9 RelocKind = 1 // imm9 field of a MOVI
+)
+
+type Section struct {
+	Type SectionType
+	Addr uint32
+	Data []byte // BSS: nil, Size gives the length
+	Size uint32
+}
+
+type Reloc struct {
+	Addr uint32
+	Kind RelocKind
+}
+
+type Image struct {
+	Entry    uint32
+	Sections []Section
+	Symbols  map[string]uint32
+	Relocs   []Reloc
+}
+
+// NewImage wraps assembled code in a single CODE section at address 0, with a
+// relocation for every MOVI that loads a label's address, so the VM can load
+// it anywhere (--load). Assembler.layout makes those the wide MOVIW, whose
+// RELOC_WORD fits any 16-bit address; an imm9 RELOC_IMM9 (from WithRaw code)
+// only loads where every label still lands below 256. Jumps are PC-relative
+// and need none.
+func NewImage(instructions []Instruction, code []byte, symbols map[string]uint32, entry uint32) *Image {
+	img := &Image{
+		Entry:    entry,
+		Sections: []Section{{Type: SECTION_CODE, Data: code, Size: uint32(len(code))}},
+		Symbols:  symbols,
+	}
+
+	for _, instr := range instructions {
+		if instr.Label == "" || instr.IsExt || instr.IsFused || instr.Opcode != OP_MOVI {
+			continue
+		}
+		if instr.IsWide {
+			img.Relocs = append(img.Relocs, Reloc{Addr: instr.Address + 2, Kind: RELOC_WORD})
+		} else {
+			img.Relocs = append(img.Relocs, Reloc{Addr: instr.Address, Kind: RELOC_IMM9})
+		}
+	}
+
+	return img
+}
+
+// Raw returns the memory image the CODE and DATA sections make up from
+// address 0, the bare stream asld -raw writes
+func (img *Image) Raw() []byte {
+	size := uint32(0)
+	for _, s := range img.Sections {
+		if s.Type != SECTION_BSS && s.Addr+uint32(len(s.Data)) > size {
+			size = s.Addr + uint32(len(s.Data))
+		}
+	}
+	raw := make([]byte, size)
+	for _, s := range img.Sections {
+		if s.Type != SECTION_BSS {
+			copy(raw[s.Addr:], s.Data)
+		}
+	}
+	return raw
+}
+
+// Bytes serializes the image, symbols sorted by address like WriteSymbols
+func (img *Image) Bytes() []byte {
+	le := binary.LittleEndian
+
+	names := make([]string, 0, len(img.Symbols))
+	for name := range img.Symbols {
+		if len(name) <= 255 {
+			names = append(names, name)
+		}
+	}
+	sort.Slice(names, func(i, j int) bool {
+		if img.Symbols[names[i]] != img.Symbols[names[j]] {
+			return img.Symbols[names[i]] < img.Symbols[names[j]]
+		}
+		return names[i] < names[j]
+	})
+
+	var symtab []byte
+	symtab = le.AppendUint32(symtab, uint32(len(names)))
+	for _, name := range names {
+		symtab = le.AppendUint32(symtab, img.Symbols[name])
+		symtab = append(symtab, byte(len(name)))
+		symtab = append(symtab, name...)
+	}
+
+	var reltab []byte
+	reltab = le.AppendUint32(reltab, uint32(len(img.Relocs)))
+	for _, r := range img.Relocs {
+		reltab = le.AppendUint32(reltab, r.Addr|uint32(r.Kind)<<28)
+	}
+
+	symOff := uint32(imageHeaderSize + imageSectionSize*len(img.Sections))
+	relOff := symOff + uint32(len(symtab))
+	dataOff := relOff + uint32(len(reltab))
+
+	out := make([]byte, 0, dataOff)
+	out = append(out, ImageMagic...)
+	out = le.AppendUint16(out, ImageVersion)
+	out = le.AppendUint16(out, uint16(len(img.Sections)))
+	out = le.AppendUint32(out, img.Entry)
+	out = le.AppendUint32(out, symOff)
+	out = le.AppendUint32(out, relOff)
+
+	offsets := make([]uint32, len(img.Sections))
+	off := dataOff
+	for i, s := range img.Sections {
+		if s.Type == SECTION_BSS {
+			continue
+		}
+		if len(s.Data) >= imagePageSize {
+			off = (off + imagePageSize - 1) &^ (imagePageSize - 1)
+		}
+		offsets[i] = off
+		off += uint32(len(s.Data))
+	}
+
+	for i, s := range img.Sections {
+		out = append(out, byte(s.Type), 0, 0, 0)
+		out = le.AppendUint32(out, s.Addr)
+		out = le.AppendUint32(out, s.Size)
+		out = le.AppendUint32(out, offsets[i])
+	}
+
+	out = append(out, symtab...)
+	out = append(out, reltab...)
+	for i, s := range img.Sections {
+		if s.Type != SECTION_BSS {
+			out = append(out, make([]byte, int(offsets[i])-len(out))...)
+			out = append(out, s.Data...)
+		}
+	}
+	return out
+}
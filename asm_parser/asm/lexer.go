@@ -1,6 +1,7 @@
-package main
+package asm
 
 import (
+	"bytes"
 	"strings"
 )
 
@@ -82,10 +83,29 @@ func (l *Lexer) tokenizeLine(rawLine string, lineNo int) *Line {
 	return parsedLine
 }
 
+// internUpper interns the upper-cased field, only allocating the first time
+// a spelling is seen
+func (l *Lexer) internUpper(field []byte, scratch []byte) (string, []byte) {
+	scratch = append(scratch[:0], field...)
+	for i, c := range scratch {
+		if c >= 'a' && c <= 'z' {
+			scratch[i] = c - 'a' + 'A'
+		}
+	}
+	if interned, ok := l.internPool[string(scratch)]; ok {
+		return interned, scratch
+	}
+	s := string(scratch)
+	l.internPool[s] = s
+	return s, scratch
+}
+
 func (l *Lexer) identifyToken(field string, line, col int) Token {
-	field = strings.ToUpper(field)
-	field = l.intern(field)
+	return l.classify(l.intern(strings.ToUpper(field)), line, col)
+}
 
+// classify types an upper-cased, interned field
+func (l *Lexer) classify(field string, line, col int) Token {
 	token := Token {
 		Value: field,
 		Line: line,
@@ -117,6 +137,18 @@ func (l *Lexer) identifyToken(field string, line, col int) Token {
 		return token
 	}
 
+	// Check if it's on the second extension page
+	if IsExt2Opcode(field) {
+		token.Type = TokenExt2Opcode
+		return token
+	}
+
+	// Check if it's a fused opcode
+	if _, ok := FuseOpcodeMap[field]; ok {
+		token.Type = TokenFuseOpcode
+		return token
+	}
+
 	// Check if it's a regular opcode
 	if _, ok := OpcodeMap[field]; ok {
 		token.Type = TokenOpcode
@@ -172,3 +204,87 @@ func isHexDigit(c rune) bool {
 	return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F')
 }
 
+
+// Scanner is the streaming form of Lexer.Tokenize: it walks the source once,
+// a line at a time, and hands out each line's tokens in a buffer that the
+// next Scan overwrites. Token values are interned, so only the first
+// occurrence of a spelling allocates. Line.Original is left empty, Text has
+// the line as it appears in the source.
+type Scanner struct {
+	lexer   *Lexer
+	src     []byte
+	pos     int
+	lineNo  int
+	text    []byte
+	line    Line
+	scratch []byte
+}
+
+func NewScanner(src []byte) *Scanner {
+	return &Scanner{
+		lexer: &Lexer{internPool: make(map[string]string, 64)},
+		src:   src,
+		line:  Line{Tokens: make([]Token, 0, 8)},
+	}
+}
+
+// Scan advances to the next line that has tokens, false at the end of the source
+func (s *Scanner) Scan() bool {
+	for s.pos < len(s.src) {
+		rest := s.src[s.pos:]
+		end := bytes.IndexByte(rest, '\n')
+		if end < 0 {
+			end = len(rest)
+			s.pos = len(s.src)
+		} else {
+			s.pos += end + 1
+		}
+		s.lineNo++
+		s.text = rest[:end]
+
+		code := s.text
+		if idx := bytes.IndexAny(code, ";#"); idx >= 0 {
+			code = code[:idx]
+		}
+
+		s.line.Number = s.lineNo
+		s.line.Tokens = s.line.Tokens[:0]
+		for i := 0; i < len(code); {
+			if isSeparator(code[i]) {
+				i++
+				continue
+			}
+			start := i
+			for i < len(code) && !isSeparator(code[i]) {
+				i++
+			}
+			var value string
+			value, s.scratch = s.lexer.internUpper(code[start:i], s.scratch)
+			s.line.Tokens = append(s.line.Tokens, s.lexer.classify(value, s.lineNo, len(s.line.Tokens)))
+		}
+
+		if len(s.line.Tokens) > 0 {
+			return true
+		}
+	}
+	return false
+}
+
+// Line returns the current line, valid until the next Scan
+func (s *Scanner) Line() Line {
+	return s.line
+}
+
+// Text returns the current line's source, without the newline
+func (s *Scanner) Text() []byte {
+	return s.text
+}
+
+// isSeparator matches what tokenizeLine splits on: commas and ASCII whitespace
+func isSeparator(c byte) bool {
+	switch c {
+	case ' ', '\t', '\r', '\v', '\f', ',':
+		return true
+	}
+	return false
+}
@@ -0,0 +1,113 @@
+package asm
+
+import "sort"
+
+// Object is one assembled source file of a multi-file program: its
+// (optimized) instructions and the labels it defines, with addresses still
+// index*2 from the start of the unit. Labels it uses but doesn't define are
+// left in Instruction.Label for Link.
+type Object struct {
+	Name         string
+	Instructions []Instruction
+	Symbols      []ObjectSymbol // sorted by address
+	Warnings     []*AssemblerError
+}
+
+type ObjectSymbol struct {
+	Name    string
+	Address uint32
+	Line    int
+}
+
+// unitSpan is where an object's instructions start in the linked program
+type unitSpan struct {
+	start int
+	name  string
+}
+
+// Compile assembles one unit into an Object. Any label may be the target of
+// a jump from another unit, so all of them are exported: the optimizer keeps
+// every label as an entry point and unused labels are only reported by Link.
+func (a *Assembler) Compile(name string, source []byte) (*Object, error) {
+	instructions, err := a.parse(source, true)
+	for _, w := range a.warnings {
+		w.File = name
+	}
+	if err != nil {
+		e := wrapError(StageParser, 0, err)
+		e.File = name
+		return nil, e
+	}
+
+	for _, sym := range a.symbolTable.AllSymbols() {
+		sym.Exported = true
+		sym.Used = true
+	}
+	instructions = a.optimize(instructions)
+
+	obj := &Object{Name: name, Instructions: instructions, Warnings: a.warnings}
+	for _, sym := range a.symbolTable.AllSymbols() {
+		obj.Symbols = append(obj.Symbols, ObjectSymbol{Name: sym.Name, Address: sym.Address, Line: sym.Line})
+	}
+	sort.Slice(obj.Symbols, func(i, j int) bool {
+		if obj.Symbols[i].Address != obj.Symbols[j].Address {
+			return obj.Symbols[i].Address < obj.Symbols[j].Address
+		}
+		return obj.Symbols[i].Name < obj.Symbols[j].Name
+	})
+
+	return obj, nil
+}
+
+// Link places the objects one after another in the given order, resolves
+// every label across them and lays out the result, the same as Assemble
+// does after parsing a single file. The assembler's symbol table ends up
+// holding every label at its final address.
+func (a *Assembler) Link(objects []*Object) ([]Instruction, error) {
+	total := 0
+	for _, obj := range objects {
+		total += len(obj.Instructions)
+	}
+	instructions := make([]Instruction, 0, total)
+	a.units = a.units[:0]
+
+	for _, obj := range objects {
+		base := uint32(len(instructions) * 2)
+		for _, sym := range obj.Symbols {
+			if err := a.symbolTable.Define(sym.Name, base+sym.Address, sym.Line); err != nil {
+				prev, _ := a.symbolTable.Get(sym.Name)
+				e := newError(StageLinker, sym.Line, "label '%s' already defined in %s:%d",
+					sym.Name, prev.File, prev.Line)
+				e.File, e.Token = obj.Name, sym.Name
+				return nil, e
+			}
+			defined, _ := a.symbolTable.Get(sym.Name)
+			defined.File = obj.Name
+		}
+		a.units = append(a.units, unitSpan{start: len(instructions), name: obj.Name})
+		a.warnings = append(a.warnings, obj.Warnings...)
+		instructions = append(instructions, obj.Instructions...)
+	}
+
+	for i := range instructions {
+		instr := &instructions[i]
+		if instr.Label == "" {
+			continue
+		}
+		addr, ok := a.symbolTable.Resolve(instr.Label)
+		if !ok {
+			e := newError(StageLinker, instr.Line, "undefined label: %s", instr.Label)
+			e.File, e.Token = a.unitName(i), instr.Label
+			return nil, e
+		}
+		instr.Immediate = uint16(addr)
+	}
+
+	a.markEntry()
+	a.warnUnused()
+	if err := a.layout(instructions); err != nil {
+		return nil, err
+	}
+
+	return instructions, nil
+}
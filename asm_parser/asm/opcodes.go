@@ -0,0 +1,355 @@
+package asm
+
+// Opcode represents a VM instruction
+type Opcode uint8
+
+const (
+	OP_HALT   Opcode = 0x0
+	OP_NOP    Opcode = 0x1
+	OP_MOV    Opcode = 0x2
+	OP_MOVI   Opcode = 0x3
+	OP_CMP    Opcode = 0x4
+	OP_JMP    Opcode = 0x5
+	OP_JZ     Opcode = 0x6
+	OP_JNZ    Opcode = 0x7
+	OP_PUSH   Opcode = 0x8
+	OP_POP    Opcode = 0x9
+	OP_CALL   Opcode = 0xA
+	OP_STDOUT Opcode = 0xB
+	OP_STDIN  Opcode = 0xC
+	OP_EXT    Opcode = 0xD
+	OP_EXT2   Opcode = 0xE
+	OP_FUSE   Opcode = 0xF
+)
+
+// ExtOpcode represents extended opcodes (when OP_EXT is used)
+type ExtOpcode uint8
+
+const (
+	EXT_RET   ExtOpcode = 0x0
+	EXT_LOAD  ExtOpcode = 0x1
+	EXT_STORE ExtOpcode = 0x2
+	EXT_ADD   ExtOpcode = 0x3
+	EXT_SUB   ExtOpcode = 0x4
+	EXT_AND   ExtOpcode = 0x5
+	EXT_OR    ExtOpcode = 0x6
+	EXT_XOR   ExtOpcode = 0x7
+)
+
+// Ext2Opcode represents the multiply/divide/shift page (when OP_EXT2 is used).
+// Unsigned except SAR; x / 0 gives 0xFFFF and x % 0 gives x; shifts use Src & 15.
+type Ext2Opcode uint8
+
+const (
+	EXT2_MUL   Ext2Opcode = 0x0 // Dst = low 16 bits of Dst * Src
+	EXT2_MULH  Ext2Opcode = 0x1 // Dst = high 16 bits of Dst * Src
+	EXT2_DIV   Ext2Opcode = 0x2
+	EXT2_MOD   Ext2Opcode = 0x3
+	EXT2_SHL   Ext2Opcode = 0x4
+	EXT2_SHR   Ext2Opcode = 0x5
+	EXT2_SAR   Ext2Opcode = 0x6
+	EXT2_BLOCK Ext2Opcode = 0x7 // block memory op, see BlockOpcode
+)
+
+// BlockOpcode is the low 3 bits of EXT2_BLOCK. The byte count is always in R7, and
+// COPY/FILL leave flags alone; MATCH sets them like CHECK on the first differing bytes.
+type BlockOpcode uint8
+
+const (
+	BLOCK_COPY   BlockOpcode = 0x0 // [Dst] = [Src], overlap safe
+	BLOCK_FILL   BlockOpcode = 0x1 // [Dst] = low byte of Src
+	BLOCK_CMP    BlockOpcode = 0x2 // compare [Dst] with [Src]
+	BLOCK_STRLEN BlockOpcode = 0x3 // Dst = length of the string at [Src]
+	BLOCK_SETSEG BlockOpcode = 0x4 // segment Src = Dst (DS, R1 SETSEG)
+	BLOCK_GETSEG BlockOpcode = 0x5 // Dst = segment Src (R1, DS GETSEG)
+)
+
+// Segment is a segment register: the VM adds it << 4 (with the default 1 MiB
+// of memory) to 16-bit addresses, CS for register jumps, DS for data and ES
+// for block op destinations. Writing SS moves the stack to the top of that
+// segment.
+type Segment uint8
+
+const (
+	SEG_CS Segment = 0
+	SEG_DS Segment = 1
+	SEG_SS Segment = 2
+	SEG_ES Segment = 3
+)
+
+// FuseOpcode represents fused superinstructions (when OP_FUSE is used)
+type FuseOpcode uint8
+
+const (
+	FUSE_DJNZ FuseOpcode = 0x0 // Dst -= 1; JNZ Src
+	FUSE_SJNZ FuseOpcode = 0x1 // SUB Dst, Src; JNZ Target
+	FUSE_CJZ  FuseOpcode = 0x2 // CMP Dst, Src; JZ Target
+	FUSE_CJNZ FuseOpcode = 0x3 // CMP Dst, Src; JNZ Target
+
+	// Picked by the encoder for immediate jumps and wide PUTs, no mnemonics
+	FUSE_JMPR  FuseOpcode = 0x4 // JMP PC + DISP*2
+	FUSE_JZR   FuseOpcode = 0x5 // JZ PC + DISP*2
+	FUSE_JNZR  FuseOpcode = 0x6 // JNZ PC + DISP*2
+	FUSE_MOVIW FuseOpcode = 0x7 // MOVI Dst, next word
+)
+
+// Word displacement range of FUSE_JMPR/JZR/JNZR, relative to the next instruction
+const (
+	RelMin = -256
+	RelMax = 255
+)
+
+// Register represents a VM register
+type Register uint8
+
+const (
+	R0 Register = 0
+	R1 Register = 1
+	R2 Register = 2
+	R3 Register = 3
+	R4 Register = 4
+	R5 Register = 5
+	R6 Register = 6
+	R7 Register = 7
+)
+
+// OpcodeMap maps assembly mnemonics to opcodes
+var OpcodeMap = map[string]Opcode{
+	// Full names
+	"DIE":      OP_HALT,
+	"IDLE":     OP_NOP,
+	"SET":      OP_MOV,
+	"PUT":      OP_MOVI,
+	"CHECK":    OP_CMP,
+	"TELEPORT": OP_JMP,
+	"IFZ":      OP_JZ,
+	"IFNZ":     OP_JNZ,
+	"DEPOSIT":  OP_PUSH,
+	"WITHDRAW": OP_POP,
+	"EXEC":     OP_CALL,
+	"PRINT":    OP_STDOUT,
+	"READ":     OP_STDIN,
+
+	// Shorthand
+	"X":  OP_HALT,
+	"M":  OP_MOV,
+	"I":  OP_MOVI,
+	"?":  OP_CMP,
+	"@":  OP_JMP,
+	">":  OP_PUSH,
+	"<":  OP_POP,
+	"P":  OP_STDOUT,
+	"IN": OP_STDIN,
+}
+
+// ExtOpcodeMap maps assembly mnemonics to extended opcodes
+var ExtOpcodeMap = map[string]ExtOpcode{
+	// Full names
+	"RETURN": EXT_RET,
+	"FETCH":  EXT_LOAD,
+	"SAVE":   EXT_STORE,
+	"SUM":    EXT_ADD,
+	"DIF":    EXT_SUB,
+	"BAND":   EXT_AND,
+	"BOR":    EXT_OR,
+	"BXOR":   EXT_XOR,
+
+	// Shorthand
+	"RET": EXT_RET,
+	"+":   EXT_ADD,
+	"-":   EXT_SUB,
+	"&":   EXT_AND,
+	"|":   EXT_OR,
+	"^":   EXT_XOR,
+}
+
+// Ext2OpcodeMap maps assembly mnemonics to the second extension page
+var Ext2OpcodeMap = map[string]Ext2Opcode{
+	// Full names
+	"PRODUCT":   EXT2_MUL,
+	"HIPRODUCT": EXT2_MULH,
+	"QUOTIENT":  EXT2_DIV,
+	"REMAINDER": EXT2_MOD,
+	"LSHIFT":    EXT2_SHL,
+	"RSHIFT":    EXT2_SHR,
+	"ASHIFT":    EXT2_SAR,
+
+	// Shorthand
+	"MUL":  EXT2_MUL,
+	"MULH": EXT2_MULH,
+	"DIV":  EXT2_DIV,
+	"MOD":  EXT2_MOD,
+	"SHL":  EXT2_SHL,
+	"SHR":  EXT2_SHR,
+	"SAR":  EXT2_SAR,
+	"*":    EXT2_MUL,
+	"/":    EXT2_DIV,
+	"%":    EXT2_MOD,
+	"<<":   EXT2_SHL,
+	">>":   EXT2_SHR,
+}
+
+// BlockOpcodeMap maps assembly mnemonics to block memory ops, R7 holds the count
+var BlockOpcodeMap = map[string]BlockOpcode{
+	// Full names
+	"CLONE":   BLOCK_COPY,
+	"FLOOD":   BLOCK_FILL,
+	"MATCH":   BLOCK_CMP,
+	"MEASURE": BLOCK_STRLEN,
+	"ANCHOR":  BLOCK_SETSEG,
+	"LOCATE":  BLOCK_GETSEG,
+
+	// Shorthand
+	"MEMCPY": BLOCK_COPY,
+	"MEMSET": BLOCK_FILL,
+	"MEMCMP": BLOCK_CMP,
+	"STRLEN": BLOCK_STRLEN,
+	"SETSEG": BLOCK_SETSEG,
+	"GETSEG": BLOCK_GETSEG,
+}
+
+// FuseOpcodeMap maps assembly mnemonics to fused opcodes
+var FuseOpcodeMap = map[string]FuseOpcode{
+	"COUNTDOWN": FUSE_DJNZ, // R1 R4 COUNTDOWN
+	"DIFNZ":     FUSE_SJNZ, // R1 R2 R4 DIFNZ
+	"IFEQ":      FUSE_CJZ,  // R1 R2 R4 IFEQ
+	"IFNE":      FUSE_CJNZ, // R1 R2 R4 IFNE
+}
+
+// SegmentMap maps segment register names to their numbers
+var SegmentMap = map[string]Segment{
+	"CS": SEG_CS,
+	"DS": SEG_DS,
+	"SS": SEG_SS,
+	"ES": SEG_ES,
+}
+
+// RegisterMap maps register names to register numbers
+var RegisterMap = map[string]Register{
+	"R0": R0,
+	"R1": R1,
+	"R2": R2,
+	"R3": R3,
+	"R4": R4,
+	"R5": R5,
+	"R6": R6,
+	"R7": R7,
+}
+
+// InstructionType defines how many operands an instruction needs
+type InstructionType int
+
+const (
+	TypeNone      InstructionType = iota // No operands (HALT, NOP)
+	TypeOneReg                            // One register (PUSH, POP, JMP, etc.)
+	TypeTwoReg                            // Two registers (MOV, ADD, SUB, etc.)
+	TypeRegImm                            // Register + immediate (MOVI)
+	TypeExtended                          // Extended opcode instruction
+	TypeThreeReg                          // Three registers (fused SUB/CMP + branch)
+)
+
+// OpcodeInfo holds metadata about an opcode
+type OpcodeInfo struct {
+	Type InstructionType
+	Name string
+}
+
+// OpcodeTable maps opcodes to their metadata
+var OpcodeTable = map[Opcode]OpcodeInfo{
+	OP_HALT:   {TypeNone, "HALT"},
+	OP_NOP:    {TypeNone, "NOP"},
+	OP_MOV:    {TypeTwoReg, "MOV"},
+	OP_MOVI:   {TypeRegImm, "MOVI"},
+	OP_CMP:    {TypeTwoReg, "CMP"},
+	OP_JMP:    {TypeOneReg, "JMP"},
+	OP_JZ:     {TypeOneReg, "JZ"},
+	OP_JNZ:    {TypeOneReg, "JNZ"},
+	OP_PUSH:   {TypeOneReg, "PUSH"},
+	OP_POP:    {TypeOneReg, "POP"},
+	OP_CALL:   {TypeOneReg, "CALL"},
+	OP_STDOUT: {TypeOneReg, "STDOUT"},
+	OP_STDIN:  {TypeOneReg, "STDIN"},
+	OP_EXT:    {TypeExtended, "EXT"},
+	OP_EXT2:   {TypeExtended, "EXT2"},
+	OP_FUSE:   {TypeExtended, "FUSE"},
+}
+
+// ExtOpcodeInfo holds metadata about extended opcodes
+type ExtOpcodeInfo struct {
+	Type InstructionType
+	Name string
+}
+
+// ExtOpcodeTable maps extended opcodes to their metadata
+var ExtOpcodeTable = map[ExtOpcode]ExtOpcodeInfo{
+	EXT_RET:   {TypeNone, "RET"},
+	EXT_LOAD:  {TypeTwoReg, "LOAD"},
+	EXT_STORE: {TypeTwoReg, "STORE"},
+	EXT_ADD:   {TypeTwoReg, "ADD"},
+	EXT_SUB:   {TypeTwoReg, "SUB"},
+	EXT_AND:   {TypeTwoReg, "AND"},
+	EXT_OR:    {TypeTwoReg, "OR"},
+	EXT_XOR:   {TypeTwoReg, "XOR"},
+}
+
+// IsExtendedOpcode checks if a mnemonic is an extended opcode
+func IsExtendedOpcode(mnemonic string) bool {
+	_, ok := ExtOpcodeMap[mnemonic]
+	return ok
+}
+
+// Ext2OpcodeTable maps second-page opcodes to their metadata
+var Ext2OpcodeTable = map[Ext2Opcode]ExtOpcodeInfo{
+	EXT2_MUL:   {TypeTwoReg, "MUL"},
+	EXT2_MULH:  {TypeTwoReg, "MULH"},
+	EXT2_DIV:   {TypeTwoReg, "DIV"},
+	EXT2_MOD:   {TypeTwoReg, "MOD"},
+	EXT2_SHL:   {TypeTwoReg, "SHL"},
+	EXT2_SHR:   {TypeTwoReg, "SHR"},
+	EXT2_SAR:   {TypeTwoReg, "SAR"},
+	EXT2_BLOCK: {TypeTwoReg, "BLOCK"},
+}
+
+// IsExt2Opcode checks if a mnemonic is on the second extension page
+func IsExt2Opcode(mnemonic string) bool {
+	_, ok := Ext2OpcodeMap[mnemonic]
+	_, block := BlockOpcodeMap[mnemonic]
+	return ok || block
+}
+
+// BlockOpcodeTable maps block memory ops to their metadata
+var BlockOpcodeTable = map[BlockOpcode]ExtOpcodeInfo{
+	BLOCK_COPY:   {TypeTwoReg, "COPY"},
+	BLOCK_FILL:   {TypeTwoReg, "FILL"},
+	BLOCK_CMP:    {TypeTwoReg, "BCMP"},
+	BLOCK_STRLEN: {TypeTwoReg, "STRLEN"},
+	BLOCK_SETSEG: {TypeTwoReg, "SETSEG"},
+	BLOCK_GETSEG: {TypeTwoReg, "GETSEG"},
+}
+
+// SegmentNames gives the name of each Segment
+var SegmentNames = [4]string{"CS", "DS", "SS", "ES"}
+
+// FuseOpcodeInfo holds metadata about fused opcodes
+type FuseOpcodeInfo struct {
+	Type InstructionType
+	Name string
+}
+
+// FuseOpcodeTable maps fused opcodes to their metadata
+var FuseOpcodeTable = map[FuseOpcode]FuseOpcodeInfo{
+	FUSE_DJNZ:  {TypeTwoReg, "DJNZ"},
+	FUSE_SJNZ:  {TypeThreeReg, "SJNZ"},
+	FUSE_CJZ:   {TypeThreeReg, "CJZ"},
+	FUSE_CJNZ:  {TypeThreeReg, "CJNZ"},
+	FUSE_JMPR:  {TypeNone, "JMPR"},
+	FUSE_JZR:   {TypeNone, "JZR"},
+	FUSE_JNZR:  {TypeNone, "JNZR"},
+	FUSE_MOVIW: {TypeRegImm, "MOVIW"},
+}
+
+// IsFusedOpcode checks if a mnemonic is a fused opcode
+func IsFusedOpcode(mnemonic string) bool {
+	_, ok := FuseOpcodeMap[mnemonic]
+	return ok
+}
@@ -0,0 +1,345 @@
+package asm
+
+// Optimizer runs peephole passes between Parser.Parse and Encoder.EncodeAll.
+//
+//	level 1: drop NOPs, fold back-to-back MOVI to one register, drop ops that
+//	         only set flags (CMP, R0 R0 SET, ...) when the flags are
+//	         overwritten before anything reads them, fuse SUB/CMP with the
+//	         register JZ/JNZ that follows into one OP_FUSE instruction
+//	level 2: also thread jumps to jumps and remove unreachable code
+//
+// Used labels are the only places control can enter from elsewhere, every
+// removal relocates the symbol table and the label-derived immediates.
+// Addresses are still index*2 here, Assembler.layout sizes the code afterwards.
+type Optimizer struct {
+	symbolTable *SymbolTable
+	level       int
+	leaders     []bool // instruction index is a used label's target
+}
+
+// Flags written or read by an instruction, only Z/S are tested by branches
+const (
+	flagsZS   uint8 = 1 << 0
+	flagsCO   uint8 = 1 << 1
+	flagsNone uint8 = 0
+	flagsAll        = flagsZS | flagsCO
+)
+
+func NewOptimizer(symbolTable *SymbolTable, level int) *Optimizer {
+	return &Optimizer{
+		symbolTable: symbolTable,
+		level:       level,
+	}
+}
+
+// Optimize returns the rewritten instruction list, repeating until nothing changes
+func (o *Optimizer) Optimize(instructions []Instruction) []Instruction {
+	if o.level <= 0 {
+		return instructions
+	}
+
+	for {
+		o.markLeaders(instructions)
+		keep := make([]bool, len(instructions))
+		for i := range keep {
+			keep[i] = true
+		}
+
+		changed := o.peephole(instructions, keep)
+		changed = o.fuseBranches(instructions, keep) || changed
+		if o.level >= 2 {
+			changed = o.threadJumps(instructions) || changed
+			o.refreshUsed(instructions)
+			o.markLeaders(instructions)
+			changed = o.removeUnreachable(instructions, keep) || changed
+		}
+
+		if !changed {
+			return instructions
+		}
+		instructions = o.compact(instructions, keep)
+	}
+}
+
+func (o *Optimizer) markLeaders(instructions []Instruction) {
+	o.leaders = make([]bool, len(instructions)+1)
+	o.leaders[0] = true
+	for _, sym := range o.symbolTable.AllSymbols() {
+		if idx := int(sym.Address / 2); sym.Used && idx < len(o.leaders) {
+			o.leaders[idx] = true
+		}
+	}
+}
+
+// refreshUsed recomputes the Used bits after jumps stopped referencing labels
+func (o *Optimizer) refreshUsed(instructions []Instruction) {
+	for _, sym := range o.symbolTable.AllSymbols() {
+		sym.Used = sym.Exported
+	}
+	for _, instr := range instructions {
+		if sym, ok := o.symbolTable.Get(instr.Label); ok {
+			sym.Used = true
+		}
+	}
+}
+
+func (o *Optimizer) peephole(instructions []Instruction, keep []bool) bool {
+	changed := false
+
+	for i, instr := range instructions {
+		remove := false
+
+		switch {
+		case !instr.IsExt && instr.Opcode == OP_NOP:
+			remove = true
+		case !instr.IsExt && instr.Opcode == OP_MOVI && i+1 < len(instructions):
+			next := instructions[i+1]
+			remove = !next.IsExt && next.Opcode == OP_MOVI && next.Dst == instr.Dst
+		case flagsOnly(instr):
+			remove = o.flagsDead(instructions, keep, i)
+		}
+
+		if remove {
+			keep[i] = false
+			changed = true
+		}
+	}
+
+	return changed
+}
+
+// fuseBranches turns SUB+JNZ into SJNZ and CMP+JZ/JNZ into CJZ/CJNZ, as long
+// as nothing jumps to the branch on its own
+func (o *Optimizer) fuseBranches(instructions []Instruction, keep []bool) bool {
+	changed := false
+
+	for i := 0; i+1 < len(instructions); i++ {
+		instr, next := instructions[i], instructions[i+1]
+		if !keep[i] || !keep[i+1] || o.leaders[i+1] || next.IsExt || next.IsFused || next.IsImm {
+			continue
+		}
+		if next.Opcode != OP_JZ && next.Opcode != OP_JNZ {
+			continue
+		}
+
+		var fuseOp FuseOpcode
+		switch {
+		case instr.IsExt && instr.ExtOpcode == EXT_SUB && next.Opcode == OP_JNZ:
+			fuseOp = FUSE_SJNZ
+		case !instr.IsExt && !instr.IsFused && instr.Opcode == OP_CMP && next.Opcode == OP_JZ:
+			fuseOp = FUSE_CJZ
+		case !instr.IsExt && !instr.IsFused && instr.Opcode == OP_CMP && next.Opcode == OP_JNZ:
+			fuseOp = FUSE_CJNZ
+		default:
+			continue
+		}
+
+		instructions[i] = Instruction{
+			Line:       instr.Line,
+			Opcode:     OP_FUSE,
+			FuseOpcode: fuseOp,
+			Dst:        instr.Dst,
+			Src:        instr.Src,
+			Target:     next.Dst,
+			IsFused:    true,
+		}
+		keep[i+1] = false
+		changed = true
+	}
+
+	return changed
+}
+
+// flagsOnly reports ops whose only effect is on the flags
+func flagsOnly(instr Instruction) bool {
+	if instr.IsFused {
+		return false
+	}
+	if instr.IsExt {
+		return (instr.ExtOpcode == EXT_AND || instr.ExtOpcode == EXT_OR) && instr.Dst == instr.Src
+	}
+	return instr.Opcode == OP_CMP || (instr.Opcode == OP_MOV && instr.Dst == instr.Src)
+}
+
+func flagWrites(instr Instruction) uint8 {
+	if instr.IsFused {
+		return flagsAll
+	}
+	if instr.IsExt {
+		switch instr.ExtOpcode {
+		case EXT_ADD, EXT_SUB:
+			return flagsAll
+		case EXT_AND, EXT_OR, EXT_XOR, EXT_LOAD:
+			return flagsZS
+		}
+		return flagsNone
+	}
+
+	if instr.IsExt2 && instr.Ext2Opcode == EXT2_BLOCK {
+		switch instr.BlockOpcode {
+		case BLOCK_CMP:
+			return flagsAll
+		case BLOCK_STRLEN:
+			return flagsZS
+		}
+		return flagsNone
+	}
+
+	switch instr.Opcode {
+	case OP_CMP, OP_EXT2:
+		return flagsAll
+	case OP_MOV, OP_MOVI, OP_POP:
+		return flagsZS
+	}
+	// OP_STDIN only sets flags when a number was read
+	return flagsNone
+}
+
+// endsBlock reports instructions after which the flags may be read elsewhere
+func endsBlock(instr Instruction) bool {
+	if instr.IsFused {
+		return true
+	}
+	if instr.IsExt {
+		return instr.ExtOpcode == EXT_RET
+	}
+	switch instr.Opcode {
+	case OP_HALT, OP_JMP, OP_JZ, OP_JNZ, OP_CALL:
+		return true
+	}
+	return false
+}
+
+// flagsDead reports whether everything instructions[i] writes to the flags is
+// overwritten, within its basic block, before a branch could test it
+func (o *Optimizer) flagsDead(instructions []Instruction, keep []bool, i int) bool {
+	pending := flagWrites(instructions[i])
+
+	for j := i + 1; j < len(instructions); j++ {
+		if o.leaders[j] {
+			return false
+		}
+		if !keep[j] {
+			continue
+		}
+
+		next := instructions[j]
+		if endsBlock(next) {
+			return false
+		}
+		pending &^= flagWrites(next)
+		if pending == 0 {
+			return true
+		}
+	}
+
+	return false
+}
+
+func isDirectJump(instr Instruction) bool {
+	if instr.IsExt || instr.IsFused || !instr.IsImm || instr.Label == "" {
+		return false
+	}
+	switch instr.Opcode {
+	case OP_JMP, OP_JZ, OP_JNZ, OP_CALL:
+		return true
+	}
+	return false
+}
+
+// threadJumps points a jump straight at the final target of a jump chain.
+// A conditional jump can skip an identical one since jumps don't touch flags.
+// Jumps to labels of another unit (see Compile) aren't known yet and stay.
+func (o *Optimizer) threadJumps(instructions []Instruction) bool {
+	changed := false
+
+	for i := range instructions {
+		instr := &instructions[i]
+		if !isDirectJump(*instr) || !o.symbolTable.Exists(instr.Label) {
+			continue
+		}
+
+		for hops := 0; hops < len(instructions); hops++ {
+			target := int(instr.Immediate / 2)
+			if target >= len(instructions) || target == i {
+				break
+			}
+
+			next := instructions[target]
+			if !isDirectJump(next) || next.Opcode == OP_CALL || !o.symbolTable.Exists(next.Label) {
+				break
+			}
+			if next.Opcode != OP_JMP && (next.Opcode != instr.Opcode || instr.Opcode == OP_CALL) {
+				break
+			}
+			if next.Immediate == instr.Immediate {
+				break
+			}
+
+			instr.Immediate = next.Immediate
+			instr.Label = next.Label
+			changed = true
+		}
+	}
+
+	return changed
+}
+
+// removeUnreachable drops code after JMP, HALT or RET up to the next used label
+func (o *Optimizer) removeUnreachable(instructions []Instruction, keep []bool) bool {
+	changed := false
+	reachable := true
+
+	for i, instr := range instructions {
+		if o.leaders[i] {
+			reachable = true
+		}
+		if !reachable {
+			if keep[i] {
+				keep[i] = false
+				changed = true
+			}
+			continue
+		}
+
+		if instr.IsFused {
+			reachable = true
+		} else if instr.IsExt {
+			reachable = instr.ExtOpcode != EXT_RET
+		} else {
+			reachable = instr.Opcode != OP_JMP && instr.Opcode != OP_HALT
+		}
+	}
+
+	return changed
+}
+
+// compact drops the instructions not kept and relocates labels and immediates
+func (o *Optimizer) compact(instructions []Instruction, keep []bool) []Instruction {
+	// newAddr[i] is the address instruction i (or what follows it) moves to
+	newAddr := make([]uint32, len(instructions)+1)
+	result := make([]Instruction, 0, len(instructions))
+
+	for i, instr := range instructions {
+		newAddr[i] = uint32(len(result) * 2)
+		if keep[i] {
+			result = append(result, instr)
+		}
+	}
+	newAddr[len(instructions)] = uint32(len(result) * 2)
+
+	o.symbolTable.Relocate(func(addr uint32) uint32 {
+		if idx := int(addr / 2); idx < len(newAddr) {
+			return newAddr[idx]
+		}
+		return addr
+	})
+
+	for i := range result {
+		if addr, ok := o.symbolTable.Resolve(result[i].Label); ok {
+			result[i].Immediate = uint16(addr)
+		}
+	}
+
+	return result
+}
@@ -0,0 +1,234 @@
+package asm
+
+import (
+	"fmt"
+	"strings"
+	"testing"
+)
+
+// listing renders laid out instructions one per line, the way a diff of two
+// programs is easiest to read
+func listing(instructions []Instruction) string {
+	var b strings.Builder
+	enc := NewEncoder()
+	for _, instr := range instructions {
+		fmt.Fprintf(&b, "%04X %s", instr.Address, Disassemble(enc.Encode(instr)))
+		if instr.IsWide {
+			fmt.Fprintf(&b, ", 0x%04X", instr.Immediate)
+		}
+		b.WriteByte('\n')
+	}
+	return b.String()
+}
+
+func assembleAt(t *testing.T, source []byte, opts ...AssemblerOption) ([]Instruction, *Assembler) {
+	t.Helper()
+	a := NewAssembler(opts...)
+	instructions, err := a.AssembleBytes(source)
+	if err != nil {
+		t.Fatalf("assemble: %v", err)
+	}
+	return instructions, a
+}
+
+// Each case is optimized at its level and has to come out as want does unoptimized
+func TestOptimizerPasses(t *testing.T) {
+	tests := []struct {
+		name  string
+		level int
+		in    []string
+		want  []string
+	}{
+		{
+			name:  "NOP dropped",
+			level: 1,
+			in:    []string{"IDLE", "R0, 1 PUT", "IDLE", "DIE"},
+			want:  []string{"R0, 1 PUT", "DIE"},
+		},
+		{
+			name:  "overwritten PUT dropped",
+			level: 1,
+			in:    []string{"R0, 1 PUT", "R0, 2 PUT", "R1 PRINT", "DIE"},
+			want:  []string{"R0, 2 PUT", "R1 PRINT", "DIE"},
+		},
+		{
+			name:  "PUTs to different registers kept",
+			level: 1,
+			in:    []string{"R0, 1 PUT", "R1, 2 PUT", "DIE"},
+			want:  []string{"R0, 1 PUT", "R1, 2 PUT", "DIE"},
+		},
+		{
+			name:  "dead CHECK dropped",
+			level: 1,
+			in:    []string{"R1, R2 CHECK", "R1, R2 SUM", "DIE"},
+			want:  []string{"R1, R2 SUM", "DIE"},
+		},
+		{
+			name:  "CHECK whose C/O survive a PUT kept",
+			level: 1,
+			in:    []string{"R1, R2 CHECK", "R3, 1 PUT", "DIE"},
+			want:  []string{"R1, R2 CHECK", "R3, 1 PUT", "DIE"},
+		},
+		{
+			name:  "CHECK tested by a label jump kept",
+			level: 1,
+			in:    []string{"R1, R2 CHECK", "DONE IFZ", "DIE", "DONE:", "DIE"},
+			want:  []string{"R1, R2 CHECK", "DONE IFZ", "DIE", "DONE:", "DIE"},
+		},
+		{
+			name:  "dead flags op before a used label kept",
+			level: 1,
+			in:    []string{"R5, L PUT", "R1, R2 CHECK", "L:", "R1, R2 SUM", "R5 IFZ"},
+			want:  []string{"R5, L PUT", "R1, R2 CHECK", "L:", "R1, R2 SUM", "R5 IFZ"},
+		},
+		{
+			name:  "dead flags op before an unused label dropped",
+			level: 1,
+			in:    []string{"R1, R2 CHECK", "L:", "R1, R2 SUM", "DIE"},
+			want:  []string{"R1, R2 SUM", "DIE"},
+		},
+		{
+			name:  "CHECK + IFZ fused",
+			level: 1,
+			in:    []string{"R1, R2 CHECK", "R4 IFZ", "DIE"},
+			want:  []string{"R1, R2, R4 IFEQ", "DIE"},
+		},
+		{
+			name:  "CHECK + IFNZ fused",
+			level: 1,
+			in:    []string{"R1, R2 CHECK", "R4 IFNZ", "DIE"},
+			want:  []string{"R1, R2, R4 IFNE", "DIE"},
+		},
+		{
+			name:  "DIF + IFNZ fused",
+			level: 1,
+			in:    []string{"R1, R2 DIF", "R4 IFNZ", "DIE"},
+			want:  []string{"R1, R2, R4 DIFNZ", "DIE"},
+		},
+		{
+			name:  "branch that is a jump target not fused",
+			level: 1,
+			in:    []string{"R5, B PUT", "R1, R2 CHECK", "B:", "R4 IFZ", "R5 TELEPORT"},
+			want:  []string{"R5, B PUT", "R1, R2 CHECK", "B:", "R4 IFZ", "R5 TELEPORT"},
+		},
+		{
+			name:  "level 1 keeps unreachable code",
+			level: 1,
+			in:    []string{"DIE", "R0, 1 PUT", "DIE"},
+			want:  []string{"DIE", "R0, 1 PUT", "DIE"},
+		},
+		{
+			name:  "jump chain threaded, the hop removed",
+			level: 2,
+			in:    []string{"A TELEPORT", "DIE", "A:", "B TELEPORT", "B:", "DIE"},
+			want:  []string{"B TELEPORT", "B:", "DIE"},
+		},
+		{
+			name:  "conditional jump threaded through the same condition",
+			level: 2,
+			in:    []string{"R0, R1 CHECK", "A IFZ", "DIE", "A:", "B IFZ", "DIE", "B:", "DIE"},
+			want:  []string{"R0, R1 CHECK", "B IFZ", "DIE", "B:", "DIE"},
+		},
+		{
+			name:  "unreachable code dropped up to a used label",
+			level: 2,
+			in:    []string{"R4, L PUT", "R4 TELEPORT", "R0, 1 PUT", "R1 PRINT", "L:", "DIE"},
+			want:  []string{"R4, L PUT", "R4 TELEPORT", "L:", "DIE"},
+		},
+		{
+			name:  "label of a removed instruction moves to the next one",
+			level: 1,
+			in:    []string{"R4, L PUT", "R4 TELEPORT", "L:", "IDLE", "R1 PRINT", "DIE"},
+			want:  []string{"R4, L PUT", "R4 TELEPORT", "L:", "R1 PRINT", "DIE"},
+		},
+	}
+
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			got, _ := assembleAt(t, src(tt.in...), WithOptimization(tt.level))
+			want, _ := assembleAt(t, src(tt.want...))
+			if g, w := listing(got), listing(want); g != w {
+				t.Errorf("-O%d:\n%s\nwant:\n%s", tt.level, g, w)
+			}
+		})
+	}
+}
+
+// The label's address and the PUT loading it both follow the instruction that moved
+func TestOptimizerRelocatesLabels(t *testing.T) {
+	got, a := assembleAt(t, src("IDLE", "R4, L PUT", "R4 TELEPORT", "IDLE", "L:", "IDLE", "DIE"),
+		WithOptimization(1))
+
+	l, _ := a.symbolTable.Get("L")
+	if len(got) != 3 {
+		t.Fatalf("got\n%s", listing(got))
+	}
+	if l.Address != got[2].Address {
+		t.Errorf("L at 0x%04X, DIE at 0x%04X", l.Address, got[2].Address)
+	}
+	if got[0].Immediate != uint16(l.Address) {
+		t.Errorf("PUT loads 0x%04X, L is 0x%04X", got[0].Immediate, l.Address)
+	}
+}
+
+// Cycles of jumps must neither hang the optimizer nor lose the loop
+func TestOptimizerThreadingCycles(t *testing.T) {
+	tests := []struct {
+		name string
+		in   []string
+	}{
+		{"self", []string{"A:", "A TELEPORT"}},
+		{"two", []string{"A:", "B TELEPORT", "B:", "A TELEPORT"}},
+		{"three", []string{"A:", "B TELEPORT", "B:", "C TELEPORT", "C:", "A TELEPORT"}},
+		{"conditional", []string{"R0, R1 CHECK", "A:", "B IFZ", "B:", "A IFZ", "DIE"}},
+	}
+
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			got, _ := assembleAt(t, src(tt.in...), WithOptimization(2))
+			if len(got) == 0 {
+				t.Fatal("everything was removed")
+			}
+			end := got[len(got)-1].Address + got[len(got)-1].Size()
+			for _, instr := range got {
+				if isDirectJump(instr) && uint32(instr.Immediate) >= end {
+					t.Errorf("jump to 0x%04X past the end of the code:\n%s", instr.Immediate, listing(got))
+				}
+			}
+			if got[0].Opcode == OP_HALT {
+				t.Errorf("the loop became a HALT:\n%s", listing(got))
+			}
+		})
+	}
+}
+
+// Code only reachable from outside the file survives -O2 when its label is
+// the entry point or exported from an object, and is removed otherwise
+func TestOptimizerKeepsEntryAndExports(t *testing.T) {
+	source := src("DIE", "F:", "R0, 1 PUT", "RET")
+
+	t.Run("unexported", func(t *testing.T) {
+		got, _ := assembleAt(t, source, WithOptimization(2))
+		if len(got) != 1 {
+			t.Errorf("F's code should be gone:\n%s", listing(got))
+		}
+	})
+	t.Run("entry", func(t *testing.T) {
+		got, a := assembleAt(t, source, WithOptimization(2), WithEntry("F"))
+		if len(got) != 3 {
+			t.Errorf("F's code was removed:\n%s", listing(got))
+		}
+		if f, _ := a.symbolTable.Get("F"); !f.Used || !f.Exported {
+			t.Errorf("entry label %+v isn't marked used and exported", f)
+		}
+	})
+	t.Run("object", func(t *testing.T) {
+		obj, err := NewAssembler(WithOptimization(2)).Compile("f.vm", source)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if len(obj.Instructions) != 3 {
+			t.Errorf("F's code was removed from the object:\n%s", listing(obj.Instructions))
+		}
+	})
+}
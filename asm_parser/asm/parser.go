@@ -1,4 +1,4 @@
-package main
+package asm
 
 import (
 	"fmt"
@@ -9,6 +9,9 @@ import (
 // Parser converts tokens into instructions
 type Parser struct {
 	symbolTable *SymbolTable
+	deferred    bool    // labels may be defined later, see ParseDeferred
+	resolved    []Token // reused by resolveLabels
+	warnings    []*AssemblerError
 }
 
 func NewParser(symbolTable *SymbolTable) *Parser {
@@ -33,7 +36,9 @@ func (p *Parser) Parse(lines []Line) ([]Instruction, error) {
 
 		instr, err := p.ParseLine(line)
 		if err != nil {
-			return nil, fmt.Errorf("line %d: %w\n  → %s", line.Number, err, line.Original)
+			e := wrapError(StageParser, line.Number, err)
+			e.Source = line.Original
+			return nil, e
 		}
 
 		instructions = append(instructions, instr)
@@ -60,29 +65,66 @@ func (p *Parser) ParseLine(line Line) (Instruction, error) {
 		return p.ParseExtended(line)
 	}
 
+	if lastToken.Type == TokenExt2Opcode {
+		return p.ParseExt2(line)
+	}
+
+	if lastToken.Type == TokenFuseOpcode {
+		return p.ParseFused(line)
+	}
+
 	if lastToken.Type != TokenOpcode {
 		return Instruction{}, fmt.Errorf("expected opcode, got %s", lastToken.Value)
 	}
 
-	return p.ParseRegular(line, tokens)
+	instr, err := p.ParseRegular(line, tokens)
+	if err != nil {
+		return Instruction{}, err
+	}
+
+	// Remember where the immediate came from so the optimizer can relocate it
+	for _, token := range line.Tokens {
+		if token.Type == TokenLabel {
+			instr.Label = token.Value
+		}
+	}
+
+	return instr, nil
+}
+
+// ParseDeferred parses a line whose labels don't have to be defined yet, for
+// the single-pass AssembleBytes. A label operand parses as 0 (but keeps its
+// name for error messages); the caller fills in Immediate from instr.Label
+// once the label's address is known.
+func (p *Parser) ParseDeferred(line Line) (Instruction, error) {
+	p.deferred = true
+	defer func() { p.deferred = false }()
+	return p.ParseLine(line)
 }
 
 func (p *Parser) resolveLabels(tokens []Token, lineNo int) ([]Token, error) {
-	resolved := make([]Token, len(tokens))
-	copy(resolved, tokens)
+	p.resolved = append(p.resolved[:0], tokens...)
+	resolved := p.resolved
 
 	for i, token := range resolved {
-		if token.Type == TokenLabel {
+		// The last token is the opcode, a label there is an error either way
+		if token.Type == TokenLabel && p.deferred && i < len(resolved)-1 {
+			resolved[i].Type = TokenNumber
+		} else if token.Type == TokenLabel {
 			// Symbol Table lookup
 			addr, ok := p.symbolTable.Resolve(token.Value)
 			if !ok {
-				return nil, fmt.Errorf("undefined label: %s", token.Value)
+				e := newError(StageSymbols, lineNo, "undefined label: %s", token.Value)
+				e.Token = token.Value
+				return nil, e
 			}
 			resolved[i].Type = TokenNumber
 			resolved[i].Value = fmt.Sprintf("%d", addr)
 		}
 		if token.Type == TokenUndefined {
-			fmt.Printf("Undefined token: \"%v\"\nLine: %v:%v\n", token.Value, token.Line, token.Col)
+			w := newWarning(StageParser, token.Line, "undefined token")
+			w.Column, w.Token = token.Col+1, token.Value
+			p.warnings = append(p.warnings, w)
 		}
 	}
 
@@ -111,10 +153,13 @@ func (p *Parser) ParseRegular(line Line, tokens []Token) (Instruction, error) {
 			return Instruction{}, fmt.Errorf("%s needs 1 operand", opToken.Value)
 		}
 
-		// For jumps, allow immediate values (resolved labels)
+		// For jumps, allow immediate values (resolved labels), encoded PC-relative
 		if op == OP_JMP || op == OP_JZ || op == OP_JNZ || op == OP_CALL {
 			if tokens[0].Type == TokenNumber {
-				imm, err := parseNumber(tokens[0].Value)
+				if op == OP_CALL {
+					return Instruction{}, fmt.Errorf("%s has no relative form, PUT the address in a register", opToken.Value)
+				}
+				imm, err := p.number(tokens[0])
 				if err != nil {
 					return Instruction{}, err
 				}
@@ -159,7 +204,7 @@ func (p *Parser) ParseRegular(line Line, tokens []Token) (Instruction, error) {
 		}
 
 		instr.Dst = RegisterMap[tokens[0].Value]
-		imm, err := parseNumber(tokens[1].Value)
+		imm, err := p.number(tokens[1])
 		if err != nil {
 			return Instruction{}, err
 		}
@@ -211,6 +256,103 @@ func (p *Parser) ParseExtended(line Line) (Instruction, error) {
 	return instr, nil
 }
 
+func (p *Parser) ParseExt2(line Line) (Instruction, error) {
+	tokens := line.Tokens
+	ext2Token := tokens[len(tokens)-1]
+
+	if len(tokens) != 3 {
+		return Instruction{}, fmt.Errorf("%s needs 2 registers", ext2Token.Value)
+	}
+	if blockOp := BlockOpcodeMap[ext2Token.Value]; blockOp == BLOCK_SETSEG || blockOp == BLOCK_GETSEG {
+		return p.parseSegmentOp(line, blockOp)
+	}
+	if tokens[0].Type != TokenRegister || tokens[1].Type != TokenRegister {
+		return Instruction{}, fmt.Errorf("expected 2 registers")
+	}
+
+	instr := Instruction{
+		Opcode:     OP_EXT2,
+		Ext2Opcode: Ext2OpcodeMap[ext2Token.Value],
+		Dst:        RegisterMap[tokens[0].Value],
+		Src:        RegisterMap[tokens[1].Value],
+		IsExt2:     true,
+		Line:       line.Number,
+	}
+	if blockOp, ok := BlockOpcodeMap[ext2Token.Value]; ok {
+		instr.Ext2Opcode = EXT2_BLOCK
+		instr.BlockOpcode = blockOp
+	}
+
+	return instr, nil
+}
+
+// parseSegmentOp handles "DS, R1 SETSEG" and "R1, DS GETSEG": the register
+// is encoded as Dst and the segment number as Src either way. Segment names
+// are only special in this slot, everywhere else CS/DS/SS/ES are plain labels
+func (p *Parser) parseSegmentOp(line Line, blockOp BlockOpcode) (Instruction, error) {
+	reg, seg := line.Tokens[1], line.Tokens[0]
+	if blockOp == BLOCK_GETSEG {
+		reg, seg = seg, reg
+	}
+	if _, ok := SegmentMap[seg.Value]; !ok || seg.Type != TokenLabel || reg.Type != TokenRegister {
+		if blockOp == BLOCK_SETSEG {
+			return Instruction{}, fmt.Errorf("expected segment register and register (DS, R1 SETSEG)")
+		}
+		return Instruction{}, fmt.Errorf("expected register and segment register (R1, DS GETSEG)")
+	}
+
+	return Instruction{
+		Opcode:      OP_EXT2,
+		Ext2Opcode:  EXT2_BLOCK,
+		BlockOpcode: blockOp,
+		Dst:         RegisterMap[reg.Value],
+		Src:         Register(SegmentMap[seg.Value]),
+		IsExt2:      true,
+		Line:        line.Number,
+	}, nil
+}
+
+func (p *Parser) ParseFused(line Line) (Instruction, error) {
+	tokens := line.Tokens
+	fuseToken := tokens[len(tokens)-1]
+	fuseOp := FuseOpcodeMap[fuseToken.Value]
+
+	instr := Instruction{
+		Opcode:     OP_FUSE,
+		FuseOpcode: fuseOp,
+		IsFused:    true,
+		Line:       line.Number,
+	}
+
+	want := 3
+	if fuseOp == FUSE_DJNZ {
+		want = 2
+	}
+	if len(tokens) != want+1 {
+		return Instruction{}, fmt.Errorf("%s needs %d registers", fuseToken.Value, want)
+	}
+	for _, token := range tokens[:want] {
+		if token.Type != TokenRegister {
+			return Instruction{}, fmt.Errorf("expected register, got %s", token.Value)
+		}
+	}
+
+	instr.Dst = RegisterMap[tokens[0].Value]
+	instr.Src = RegisterMap[tokens[1].Value]
+	if want == 3 {
+		instr.Target = RegisterMap[tokens[2].Value]
+	}
+
+	return instr, nil
+}
+
+// number parses a numeric operand, a label stubbed by ParseDeferred is 0
+func (p *Parser) number(token Token) (uint16, error) {
+	if p.deferred && !isNumber(token.Value) {
+		return 0, nil
+	}
+	return parseNumber(token.Value)
+}
 
 func parseNumber(s string) (uint16, error) {
 	s = strings.ToUpper(strings.TrimSpace(s))
@@ -1,12 +1,17 @@
-package main
+package asm
 
-import "fmt"
+import (
+	"fmt"
+	"sort"
+)
 
 type Symbol struct {
 	Name		string
 	Address		uint32
 	Line		int
 	Used		bool		// for dead code elimination and compiler warnings.
+	Exported	bool		// may be referenced from another unit, always counts as used
+	File		string		// defining file once linked
 }
 
 // SymbolTable manages labels and their addresses
@@ -86,6 +91,30 @@ func (st *SymbolTable) UnusedLabels() []string {
 	return unused
 }
 
+// UnusedSymbols is UnusedLabels as symbols, in file and line order
+func (st *SymbolTable) UnusedSymbols() []*Symbol {
+	var unused []*Symbol
+	for _, sym := range st.symbols {
+		if !sym.Used {
+			unused = append(unused, sym)
+		}
+	}
+	sort.Slice(unused, func(i, j int) bool {
+		if unused[i].File != unused[j].File {
+			return unused[i].File < unused[j].File
+		}
+		return unused[i].Line < unused[j].Line
+	})
+	return unused
+}
+
+// Relocate moves every symbol to relocate(old address)
+func (st *SymbolTable) Relocate(relocate func(uint32) uint32) {
+	for _, sym := range st.symbols {
+		sym.Address = relocate(sym.Address)
+	}
+}
+
 // Exists checks if a label is defined
 func (st *SymbolTable) Exists(label string) bool {
 	_, ok := st.symbols[label]
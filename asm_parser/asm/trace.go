@@ -0,0 +1,163 @@
+package asm
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"sort"
+)
+
+// Execution trace written by vm --trace=FILE (see EXECUTION TRACE in main.c):
+//
+//	header  "VMTR", u32 version, u32 block size, u32 blocks,
+//	        u64 blocks started, u32 guest memory size
+//	block   u64 seq, u32 pc, u16 regs[8], u8 flags, u8 pad, u16 used, records
+//
+// Each block header holds the state before its first record and every record
+// is a delta against the previous one, so blocks decode independently and the
+// ones the ring overwrote are simply gone.
+const (
+	TraceMagic       = "VMTR"
+	TraceVersion     = 1
+	traceBlockHeader = 32
+)
+
+// Record tag bits, the low 3 bits name the register for TRACE_REG
+const (
+	TRACE_JUMP  = 0x80
+	TRACE_FLAGS = 0x40
+	TRACE_REGS  = 0x20
+	TRACE_REG   = 0x10
+)
+
+// Flag bits as cpu_get_flags() packs them
+const (
+	FlagZero     = 1 << 0
+	FlagSign     = 1 << 1
+	FlagCarry    = 1 << 2
+	FlagOverflow = 1 << 3
+)
+
+// TraceRecord is one executed instruction and the state right after it
+type TraceRecord struct {
+	Seq     uint64 // instructions executed before this one
+	PC      uint32
+	Instr   uint16
+	Regs    [8]uint16
+	Flags   uint8
+	Changed uint8 // mask of the registers the instruction wrote
+}
+
+// DecodeTrace calls fn for every record still in the ring, oldest first.
+// A non-nil error from fn stops the walk and is returned.
+func DecodeTrace(data []byte, fn func(*TraceRecord) error) error {
+	if len(data) < 28 || string(data[:4]) != TraceMagic {
+		return errors.New("not a trace file")
+	}
+	if v := binary.LittleEndian.Uint32(data[4:]); v != TraceVersion {
+		return fmt.Errorf("trace version %d, expected %d", v, TraceVersion)
+	}
+	blockSize := int(binary.LittleEndian.Uint32(data[8:]))
+	nblocks := uint64(binary.LittleEndian.Uint32(data[12:]))
+	started := binary.LittleEndian.Uint64(data[16:])
+	memSize := binary.LittleEndian.Uint32(data[24:])
+	if blockSize < traceBlockHeader || nblocks == 0 || memSize == 0 || memSize&(memSize-1) != 0 ||
+		uint64(len(data)) < (nblocks+1)*uint64(blockSize) {
+		return errors.New("trace header is corrupt")
+	}
+
+	var blocks [][]byte
+	for i := uint64(0); i < nblocks && i < started; i++ {
+		off := (1 + (started-1-i)%nblocks) * uint64(blockSize)
+		blocks = append(blocks, data[off:off+uint64(blockSize)])
+	}
+	sort.Slice(blocks, func(i, j int) bool {
+		return binary.LittleEndian.Uint64(blocks[i]) < binary.LittleEndian.Uint64(blocks[j])
+	})
+
+	for _, b := range blocks {
+		if err := decodeTraceBlock(b, memSize-1, fn); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+func decodeTraceBlock(b []byte, mask uint32, fn func(*TraceRecord) error) error {
+	var rec TraceRecord
+	seq := binary.LittleEndian.Uint64(b)
+	pc := binary.LittleEndian.Uint32(b[8:])
+	for i := range rec.Regs {
+		rec.Regs[i] = binary.LittleEndian.Uint16(b[12+i*2:])
+	}
+	rec.Flags = b[28]
+
+	used := int(binary.LittleEndian.Uint16(b[30:]))
+	if used > len(b) {
+		return fmt.Errorf("trace block %d is corrupt", seq)
+	}
+	r := traceReader{buf: b[:used], pos: traceBlockHeader}
+
+	for ; r.pos < used; seq++ {
+		tag := r.byte()
+		pc += 2
+		if tag&TRACE_JUMP != 0 {
+			pc += uint32(r.varint())
+		}
+		rec.Seq, rec.PC = seq, pc&mask
+		rec.Instr = uint16(r.byte()) | uint16(r.byte())<<8
+		if tag&TRACE_FLAGS != 0 {
+			rec.Flags = r.byte()
+		}
+
+		switch {
+		case tag&TRACE_REGS != 0:
+			rec.Changed = r.byte()
+		case tag&TRACE_REG != 0:
+			rec.Changed = 1 << (tag & 0x7)
+		default:
+			rec.Changed = 0
+		}
+		for i := range rec.Regs {
+			if rec.Changed&(1<<i) != 0 {
+				rec.Regs[i] += uint16(r.varint())
+			}
+		}
+
+		if r.err {
+			return fmt.Errorf("trace block %d: record %d is truncated", binary.LittleEndian.Uint64(b), seq)
+		}
+		if err := fn(&rec); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+type traceReader struct {
+	buf []byte
+	pos int
+	err bool
+}
+
+func (r *traceReader) byte() uint8 {
+	if r.pos >= len(r.buf) {
+		r.err = true
+		return 0
+	}
+	r.pos++
+	return r.buf[r.pos-1]
+}
+
+// varint reads a zigzag LEB128 value
+func (r *traceReader) varint() int32 {
+	var z uint32
+	for shift := 0; shift < 35; shift += 7 {
+		c := r.byte()
+		z |= uint32(c&0x7F) << shift
+		if c < 0x80 {
+			break
+		}
+	}
+	return int32(z>>1) ^ -int32(z&1)
+}
@@ -1,4 +1,4 @@
-package main
+package asm
 
 // TokenType represents different kinds of tokens
 type TokenType int
@@ -9,6 +9,8 @@ const (
 	TokenNumber
 	TokenOpcode
 	TokenExtOpcode
+	TokenExt2Opcode
+	TokenFuseOpcode
 	TokenComment
 	TokenLabel
 	TokenUndefined
@@ -31,14 +33,31 @@ type Line struct {
 
 // Instruction represents a parsed instruction before encoding
 type Instruction struct {
+	Label     string    // 16 bytes, label Immediate was resolved from (for relocation)
 	Line      int       // 8 bytes (align first for best packing)
+	Address   uint32    // 4 bytes, byte offset assigned by Assembler.layout
 	Immediate uint16    // 2 bytes
 	Opcode    Opcode    // 1 byte  
 	ExtOpcode ExtOpcode // 1 byte
+	Ext2Opcode Ext2Opcode // 1 byte
+	BlockOpcode BlockOpcode // 1 byte, sub-op of EXT2_BLOCK
+	FuseOpcode FuseOpcode // 1 byte
 	Dst       Register  // 1 byte
 	Src       Register  // 1 byte
+	Target    Register  // 1 byte, branch register of three-register fused ops
 	IsExt     bool      // 1 byte
+	IsExt2    bool      // 1 byte
 	IsImm     bool      // 1 byte
+	IsFused   bool      // 1 byte
+	IsWide    bool      // 1 byte, MOVI needs the two-word FUSE_MOVIW form
+}
+
+// Size returns the number of bytes the encoded instruction takes
+func (i Instruction) Size() uint32 {
+	if i.IsWide {
+		return 4
+	}
+	return 2
 }
 
 // TODO: Extend this with more values in the future
@@ -54,6 +73,10 @@ func (t TokenType) String() string {
 		return "OPCODE"
 	case TokenExtOpcode:
 		return "EXT_OPCODE"
+	case TokenExt2Opcode:
+		return "EXT2_OPCODE"
+	case TokenFuseOpcode:
+		return "FUSE_OPCODE"
 	case TokenComment:
 		return "COMMENT"
 	case TokenLabel:
@@ -0,0 +1,120 @@
+package main
+
+import (
+	"bufio"
+	"fmt"
+	"os"
+	"strconv"
+	"strings"
+
+	"asld/asm"
+)
+
+// vmtrace prints a vm --trace=FILE recording, one executed instruction per line:
+// sequence number, PC, disassembly, the registers it wrote and the flags after it
+func main() {
+	// -last=N prints only the final N records (what led up to a crash),
+	// -sym=FILE (asld's symbol map) marks where each label is entered
+	last := uint64(0)
+	symbolFile := ""
+	var args []string
+	bad := false
+	for _, arg := range os.Args[1:] {
+		switch {
+		case strings.HasPrefix(arg, "-last="):
+			n, err := strconv.ParseUint(strings.TrimPrefix(arg, "-last="), 10, 64)
+			last, bad = n, bad || err != nil
+		case strings.HasPrefix(arg, "-sym="):
+			symbolFile = strings.TrimPrefix(arg, "-sym=")
+		default:
+			args = append(args, arg)
+		}
+	}
+	if bad || len(args) != 1 {
+		fmt.Fprintf(os.Stderr, "Usage: %s [-last=N] [-sym=FILE] <trace>\n", os.Args[0])
+		os.Exit(1)
+	}
+
+	data, err := os.ReadFile(args[0])
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "Error: %v\n", err)
+		os.Exit(1)
+	}
+	labels := map[uint32]string{}
+	if symbolFile != "" {
+		if labels, err = readSymbols(symbolFile); err != nil {
+			fmt.Fprintf(os.Stderr, "Error: %v\n", err)
+			os.Exit(1)
+		}
+	}
+
+	// -last needs the total first, which one cheap extra pass gives
+	skip := uint64(0)
+	if last > 0 {
+		total := uint64(0)
+		asm.DecodeTrace(data, func(*asm.TraceRecord) error { total++; return nil })
+		if total > last {
+			skip = total - last
+		}
+	}
+
+	out := bufio.NewWriterSize(os.Stdout, 1<<16)
+	defer out.Flush()
+
+	var line []byte
+	err = asm.DecodeTrace(data, func(rec *asm.TraceRecord) error {
+		if skip > 0 {
+			skip--
+			return nil
+		}
+		if name, ok := labels[rec.PC]; ok {
+			fmt.Fprintf(out, "%s:\n", name)
+		}
+
+		line = fmt.Appendf(line[:0], "%10d  0x%05X  %-20s", rec.Seq, rec.PC, asm.Disassemble(rec.Instr))
+		for i := range rec.Regs {
+			if rec.Changed&(1<<i) != 0 {
+				line = fmt.Appendf(line, " R%d=0x%04X", i, rec.Regs[i])
+			}
+		}
+		line = append(line, "  "...)
+		for i, c := range "ZSCO" {
+			if rec.Flags&(1<<i) != 0 {
+				line = append(line, byte(c))
+			} else {
+				line = append(line, '.')
+			}
+		}
+		line = append(line, '\n')
+		_, err := out.Write(line)
+		return err
+	})
+	if err != nil {
+		out.Flush()
+		fmt.Fprintf(os.Stderr, "Error: %v\n", err)
+		os.Exit(1)
+	}
+}
+
+// readSymbols loads the "LABEL 0xADDR" lines asld -sym writes
+func readSymbols(filename string) (map[uint32]string, error) {
+	data, err := os.ReadFile(filename)
+	if err != nil {
+		return nil, err
+	}
+	labels := map[uint32]string{}
+	for _, l := range strings.Split(string(data), "\n") {
+		fields := strings.Fields(l)
+		if len(fields) != 2 {
+			continue
+		}
+		addr, err := strconv.ParseUint(fields[1], 0, 32)
+		if err != nil {
+			return nil, fmt.Errorf("%s: bad address %q", filename, fields[1])
+		}
+		if _, taken := labels[uint32(addr)]; !taken {
+			labels[uint32(addr)] = fields[0]
+		}
+	}
+	return labels, nil
+}
@@ -1,51 +1,162 @@
 package main
 
 import (
+	"encoding/json"
+	"errors"
 	"fmt"
 	"os"
+	"strings"
+
+	"asld/asm"
 )
 
 func main() {
-	if len(os.Args) != 3 {
-		fmt.Fprintf(os.Stderr, "Usage: %s <input.vm> <output.bin>\n", os.Args[0])
-		os.Exit(1)
+	// -O0 (default), -O1 or -O2 may appear anywhere, see asm/optimizer.go.
+	// -raw writes the bare instruction stream instead of a sectioned image,
+	// -entry=LABEL sets the image's entry point (default: address 0, and
+	// the only one -raw has). Images hold a single CODE section for now,
+	// there are no data or bss directives.
+	// -o=FILE links any number of input files into FILE (-sym=FILE for the
+	// symbol map), reusing unchanged objects from -cache=DIR ("" disables).
+	// -v lists the instructions and symbols, -q prints nothing but errors,
+	// -json prints warnings and errors as one JSON object per line on stderr.
+	optLevel := 0
+	raw, verbose, quiet, jsonOut := false, false, false, false
+	entryLabel := ""
+	outputFile, symbolFile := "", ""
+	cacheDir := ".asld-cache"
+	var args []string
+	for _, arg := range os.Args[1:] {
+		switch {
+		case len(arg) == 3 && strings.HasPrefix(arg, "-O") && arg[2] >= '0' && arg[2] <= '2':
+			optLevel = int(arg[2] - '0')
+		case arg == "-raw":
+			raw = true
+		case arg == "-v":
+			verbose = true
+		case arg == "-q":
+			quiet = true
+		case arg == "-json":
+			jsonOut = true
+		case strings.HasPrefix(arg, "-entry="):
+			entryLabel = strings.TrimPrefix(arg, "-entry=")
+		case strings.HasPrefix(arg, "-o="):
+			outputFile = strings.TrimPrefix(arg, "-o=")
+		case strings.HasPrefix(arg, "-sym="):
+			symbolFile = strings.TrimPrefix(arg, "-sym=")
+		case strings.HasPrefix(arg, "-cache="):
+			cacheDir = strings.TrimPrefix(arg, "-cache=")
+		default:
+			args = append(args, arg)
+		}
 	}
 
-	inputFile 	:= os.Args[1]
-	outputFile 	:= os.Args[2]
+	if outputFile == "" && len(args) != 2 && len(args) != 3 || outputFile != "" && len(args) == 0 {
+		fmt.Fprintf(os.Stderr, "Usage: %s [-O0|-O1|-O2] [-raw] [-entry=LABEL] [-v|-q] [-json] <input.vm> <output.bin> [output.sym]\n", os.Args[0])
+		fmt.Fprintf(os.Stderr, "       %s [-O0|-O1|-O2] [-raw] [-entry=LABEL] [-v|-q] [-json] [-cache=DIR] -o=output.bin [-sym=output.sym] <input.vm>...\n", os.Args[0])
+		os.Exit(1)
+	}
 
-	source, err := os.ReadFile(inputFile)
-	if err != nil {
-		fmt.Fprintf(os.Stderr, "Error reading file: %v\n", err)
+	if raw && entryLabel != "" {
+		fmt.Fprintf(os.Stderr, "-raw has no entry point, it starts at the load address: drop -entry=%s\n", entryLabel)
 		os.Exit(1)
 	}
 
-	assembler := NewAssembler()
-	instructions, err := assembler.Assemble(string(source))
-	if err != nil {
-		fmt.Fprintf(os.Stderr, "Error: %v\n", err)
+	report := func(diag *asm.AssemblerError) {
+		if jsonOut {
+			line, _ := json.Marshal(diag)
+			fmt.Fprintf(os.Stderr, "%s\n", line)
+		} else if diag.Severity == asm.SeverityError || !quiet {
+			fmt.Fprintf(os.Stderr, "%v\n", diag)
+		}
+	}
+	fail := func(err error) {
+		var diag *asm.AssemblerError
+		if !errors.As(err, &diag) {
+			diag = &asm.AssemblerError{Severity: asm.SeverityError, Message: err.Error()}
+		}
+		report(diag)
 		os.Exit(1)
 	}
 
-	fmt.Println("=== Instructions ===")
-	for i, instr := range instructions {
-		fmt.Printf("[%04X] %v\n", i*2, instr)
+	assembler := asm.NewAssembler(
+		asm.WithOptimization(optLevel),
+		asm.WithVerbose(verbose),
+		asm.WithEntry(entryLabel),
+		asm.WithRaw(raw),
+	)
+	var instructions []asm.Instruction
+	cached := -1
+
+	if outputFile != "" {
+		build, err := asm.CompileUnits(args, optLevel, cacheDir)
+		if err != nil {
+			fail(err)
+		}
+		cached = build.Cached
+		instructions, err = assembler.Link(build.Objects)
+		if err != nil {
+			fail(err)
+		}
+	} else {
+		outputFile = args[1]
+		if len(args) == 3 {
+			symbolFile = args[2]
+		}
+
+		source, err := os.ReadFile(args[0])
+		if err != nil {
+			fail(err)
+		}
+
+		instructions, err = assembler.AssembleBytes(source)
+		if err != nil {
+			fail(err)
+		}
 	}
 
-	fmt.Println("\n=== Symbol Table ===")
-	for label, addr := range assembler.symbolTable.All() {
-		fmt.Printf("%s → 0x%04X\n", label, addr)
+	for _, w := range assembler.Warnings() {
+		report(w)
 	}
 
-	encoder := NewEncoder()
-	bytecode := encoder.EncodeAll(instructions)
+	if verbose {
+		fmt.Println("=== Instructions ===")
+		for _, instr := range instructions {
+			fmt.Printf("[%04X] %v\n", instr.Address, instr)
+		}
+
+		fmt.Println("\n=== Symbol Table ===")
+		for label, addr := range assembler.Symbols() {
+			fmt.Printf("%s → 0x%04X\n", label, addr)
+		}
+	}
+
+	image, err := assembler.Image(instructions)
+	if err != nil {
+		fail(err)
+	}
 
 	writer := NewWriter()
+	bytecode := image.Bytes()
+	if raw {
+		bytecode = image.Raw()
+	}
 	if err := writer.WriteBinary(outputFile, bytecode); err != nil {
-		fmt.Fprintf(os.Stderr, "Write error: %v\n", err)
-		os.Exit(1)
+		fail(err)
+	}
+
+	if symbolFile != "" {
+		if err := writer.WriteSymbols(symbolFile, assembler.Symbols()); err != nil {
+			fail(err)
+		}
 	}
 
-	fmt.Printf("\n✓ Successfully assembled %d instructions (%d bytes) to %s\n",
+	if quiet || jsonOut {
+		return
+	}
+	fmt.Printf("✓ Successfully assembled %d instructions (%d bytes) to %s\n",
 		len(instructions), len(bytecode), outputFile)
+	if cached >= 0 && cacheDir != "" {
+		fmt.Printf("  %d of %d objects reused from %s\n", cached, len(args), cacheDir)
+	}
 }
@@ -1,6 +1,11 @@
 package main
 
-import "os"
+import (
+	"fmt"
+	"os"
+	"sort"
+	"strings"
+)
 
 // Writer handles file output
 type Writer struct{}
@@ -13,3 +18,24 @@ func NewWriter() *Writer {
 func (w *Writer) WriteBinary(filename string, data []byte) error {
 	return os.WriteFile(filename, data, 0644)
 }
+
+// WriteSymbols writes one "LABEL 0xADDR" line per symbol, sorted by address,
+// in the format the VM's --profile=SYMBOLS option reads
+func (w *Writer) WriteSymbols(filename string, symbols map[string]uint32) error {
+	names := make([]string, 0, len(symbols))
+	for name := range symbols {
+		names = append(names, name)
+	}
+	sort.Slice(names, func(i, j int) bool {
+		if symbols[names[i]] != symbols[names[j]] {
+			return symbols[names[i]] < symbols[names[j]]
+		}
+		return names[i] < names[j]
+	})
+
+	var sb strings.Builder
+	for _, name := range names {
+		fmt.Fprintf(&sb, "%s 0x%04X\n", name, symbols[name])
+	}
+	return os.WriteFile(filename, []byte(sb.String()), 0644)
+}
@@ -2,17 +2,61 @@
   Instruction format (16-bit instructions)
   Format 1: OPCODE(4) | DST_REG(3) | SRC_REG(3) | UNUSED(6)
   Format 2: OPCODE(4) | REG(3) | IMMEDIATE(9)
+  Format 3: OP_EXT(4) | EXT_OP(3) | REG1(3) | REG2(3) | UNUSED(3)
+            OP_EXT2(4) | EXT2_OP(3) | REG1(3) | REG2(3) | UNUSED(3)
+            OP_EXT2(4) | EXT2_BLOCK(3) | REG1(3) | REG2(3) | BLOCK_OP(3)
+  Format 4: OP_FUSE(4) | FUSE_OP(3) | REG1(3) | REG2(3) | REG3(3)
+  Format 5: OP_FUSE(4) | FUSE_OP(3) | DISP(9)   PC-relative branch
+  Format 6: OP_FUSE(4) | FUSE_MOVIW(3) | REG(3) | UNUSED(6), then a 16-bit literal
 */
 
+// MAP_ANONYMOUS and memfd_create() aren't visible under plain -std=c23
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // __rdtsc() for --bench
+#endif
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(VM_NO_JIT)
+#define VM_HAS_JIT 1
+#else
+#define VM_HAS_JIT 0
+#endif
+
+// Guest address bits, override with -DVM_MEMORY_BITS=24 for a 16 MiB guest
+#ifndef VM_MEMORY_BITS
+#define VM_MEMORY_BITS 20
+#endif
+_Static_assert(VM_MEMORY_BITS >= 17 && VM_MEMORY_BITS <= 28, "VM_MEMORY_BITS must be 17..28");
 
-#define MEMORY_SIZE (1 << 20) // 1 MiB
-#define ADDR_MASK 0xFFFFF     // 20-bit mask
+#define MEMORY_SIZE (1 << VM_MEMORY_BITS) // 1 MiB by default
+#define ADDR_MASK (MEMORY_SIZE - 1)
+
+// A segment register holds an address >> SEG_SHIFT, so 16-bit segments cover all of memory
+#define SEG_SHIFT (VM_MEMORY_BITS - 16)
+
+#define OUTPUT_BUFFER_SIZE 4096  // default per-VM output buffer, see cpu_set_output_buffer()
+#define STDIN_LINE_MAX 255       // longest OP_STDIN string, the guest buffer needs one more byte
+#define STDOUT_STRING_MAX 0xFFFF // longest OP_STDOUT string, the rest of one without a NUL is dropped
 
 #define TYPE_STRING 0
 #define TYPE_NUMBER 1
@@ -23,6 +67,30 @@
 #define FLAG_CARRY (1 << 2)
 #define FLAG_OVERFLOW (1 << 3)
 
+// Multi-byte guest accesses are a single host load/store when the byte order matches
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define VM_LITTLE_ENDIAN 1
+#else
+#define VM_LITTLE_ENDIAN 0
+#endif
+
+// Computed-goto dispatch needs the GNU "labels as values" extension
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_HAS_COMPUTED_GOTO 1
+#else
+#define VM_HAS_COMPUTED_GOTO 0
+#endif
+
+// Execution engine used when none is given on the command line,
+// override with -DVM_DEFAULT_ENGINE=ENGINE_SWITCH
+#ifndef VM_DEFAULT_ENGINE
+#if VM_HAS_COMPUTED_GOTO
+#define VM_DEFAULT_ENGINE ENGINE_THREADED
+#else
+#define VM_DEFAULT_ENGINE ENGINE_SWITCH
+#endif
+#endif
+
 typedef enum {
     R0 = 0,
     R1,
@@ -50,6 +118,8 @@ typedef enum {
     OP_STDOUT = 0xB,
     OP_STDIN = 0xC,
     OP_EXT = 0xD,
+    OP_EXT2 = 0xE, // multiply/divide/shift, see Ext2Opcode
+    OP_FUSE = 0xF, // fused compare/arith + branch, see FuseOpcode
 } Opcode;
 
 typedef enum {
@@ -63,19 +133,277 @@ typedef enum {
     EXT_XOR = 0x7,
 } ExtOpcode;
 
+/*
+    Second extension page, REG1 = REG1 op REG2 with everything unsigned except
+    SAR. All of them set Z/S from REG1. MUL/MULH set C and O when the 32-bit
+    product doesn't fit 16 bits; DIV/MOD clear them and never trap (x / 0 is
+    0xFFFF, x % 0 is x); shifts use REG2 & 15 and leave the last bit shifted
+    out in C (0 for a zero count) with O clear.
+*/
+typedef enum {
+    EXT2_MUL = 0x0,
+    EXT2_MULH = 0x1, // high half of the product
+    EXT2_DIV = 0x2,
+    EXT2_MOD = 0x3,
+    EXT2_SHL = 0x4,
+    EXT2_SHR = 0x5,
+    EXT2_SAR = 0x6,
+    EXT2_BLOCK = 0x7, // block memory op in the low 3 bits, see BlockOpcode
+} Ext2Opcode;
+
+/*
+    Byte-granular block ops over guest memory, the byte count is in
+    BLOCK_COUNT_REG. Ranges wrap at MEMORY_SIZE like every other access.
+    COPY and FILL leave registers and flags alone, COPY behaves like memmove.
+*/
+#define BLOCK_COUNT_REG R7
+
+typedef enum {
+    BLOCK_COPY = 0x0,   // [REG1] = [REG2]
+    BLOCK_FILL = 0x1,   // [REG1] = low byte of REG2
+    BLOCK_CMP = 0x2,    // flags of CMP on the first differing bytes (Z if none)
+    BLOCK_STRLEN = 0x3, // REG1 = length of the string at [REG2] (max 0xFFFF), sets Z/S
+    BLOCK_SETSEG = 0x4, // SR[REG2 & 3] = REG1, see Segment
+    BLOCK_GETSEG = 0x5, // REG1 = SR[REG2 & 3]
+} BlockOpcode;
+
+/*
+    Segment registers, real-mode style: an address is a 16-bit offset plus
+    SR << SEG_SHIFT, wrapping at MEMORY_SIZE. CS applies to register jump
+    and call targets (relative jumps, fall-through and RET work on the full
+    pc), DS to LOAD/STORE, string I/O and the source of block ops, ES to the
+    destination of block ops. Writing SS starts an empty stack at the top of
+    that 64 KiB segment, sp itself is a full address. All but SS start at 0,
+    which is plain 16-bit addressing; SS starts at the top segment, where
+    the stack has always been.
+*/
+typedef enum {
+    SEG_CS = 0,
+    SEG_DS = 1,
+    SEG_SS = 2,
+    SEG_ES = 3,
+} Segment;
+
+#define SEG_SS_INITIAL ((MEMORY_SIZE - 0x10000) >> SEG_SHIFT)
+
+/*
+    Superinstructions for the usual loop tails. The branch target register
+    is read after the arithmetic, exactly as in the unfused sequence, and the
+    flags end up the same too. The rest fold the target load into the branch
+    (DISP counts instructions from the next one) or the literal into the MOVI.
+*/
+typedef enum {
+    FUSE_DJNZ = 0x0,  // REG1 -= 1; JNZ REG2
+    FUSE_SJNZ = 0x1,  // SUB REG1, REG2; JNZ REG3
+    FUSE_CJZ = 0x2,   // CMP REG1, REG2; JZ REG3
+    FUSE_CJNZ = 0x3,  // CMP REG1, REG2; JNZ REG3
+    FUSE_JMPR = 0x4,  // pc += DISP * 2
+    FUSE_JZR = 0x5,   // if Z: pc += DISP * 2
+    FUSE_JNZR = 0x6,  // if !Z: pc += DISP * 2
+    FUSE_MOVIW = 0x7, // REG = next word, sets Z/S like MOVI
+} FuseOpcode;
+
+/*
+    Flags are computed lazily: every flag-setting op stores its 16-bit result
+    (Z and S come straight from it), and ADD/SUB/CMP record their operands so
+    C and O are only worked out when something reads them.
+*/
+typedef enum {
+    FLAGOP_NONE = 0, // C and O are already in cpu->flags
+    FLAGOP_ADD,      // C, O from flag_a + flag_b
+    FLAGOP_SUB,      // C, O from flag_a - flag_b
+    FLAGOP_CMP,      // C from flag_a - flag_b, O from cpu->flags
+} FlagOp;
+
+typedef enum {
+    ENGINE_SWITCH = 0, // cpu_step() in a loop
+    ENGINE_THREADED,   // computed-goto dispatch, see cpu_run_threaded()
+    ENGINE_JIT,        // threaded fallback + native hot blocks, see cpu_run_jit()
+} Engine;
+
+typedef enum {
+    RUN_HALTED = 0, // HALT, or an unknown opcode (cpu->faulted)
+    RUN_BUDGET,     // the instruction budget ran out
+    RUN_WAITING,    // parked on OP_STDIN until input arrives, see cpu_set_input_poll()
+} RunStatus;
+
+/*
+    One pre-decoded 2-byte slot of guest memory, see cpu_run_threaded().
+    handler == 0 means "not decoded yet", so a zero-filled cache is empty.
+*/
+typedef struct {
+    uint16_t imm;    // sign-extended imm9 (REG3 / byte displacement for OP_FUSE)
+    uint8_t handler; // H_* index into the threaded engine's label table
+    uint8_t a;       // dst (or reg1 for EXT)
+    uint8_t b;       // src (or reg2 for EXT)
+} DecodedInstr;
+
+typedef struct JitState JitState;
+typedef struct Verified Verified;
+typedef struct Profile Profile;
+typedef struct DeviceBus DeviceBus;
+
+// Receives flushed guest output, see cpu_set_output_sink()
+typedef void (*OutputSink)(void *ctx, const char *data, size_t len);
+
+// Everything the guest has printed, see cpu_digest_output()
+typedef struct {
+    uint64_t bytes;
+    uint64_t hash; // FNV-1a
+} OutputDigest;
+
+/*
+    Guest work, for billing and capacity planning, see cpu_get_counters().
+    Always on and meant to stay cheap: instructions come from the budget the
+    engines already charge per basic block, the threaded engine tallies the
+    rest in locals until it leaves, and a JIT block adds its loads once on
+    entry. Memory bytes are explicit data accesses (LOAD/STORE and block
+    ops), not stack traffic. I/O bytes are what the guest printed or read
+    through OP_STDOUT/OP_STDIN and the console device, a number read counts
+    as its 2 bytes.
+*/
+typedef struct {
+    uint64_t instructions; // retired
+    uint64_t branches;     // taken jumps and branches, CALL/RET not included
+    uint64_t calls;
+    uint64_t returns;
+    uint64_t bytes_loaded;
+    uint64_t bytes_stored;
+    uint64_t io_in;
+    uint64_t io_out;
+} GuestCounters;
+
+typedef struct {
+    char *buf;         // allocated on first write
+    size_t len;
+    size_t cap;        // flush threshold
+    OutputSink sink;   // if set, gets the output instead of fd
+    void *ctx;
+    int fd;
+    bool digesting;    // keep digest up to date as output is flushed
+    OutputDigest digest;
+} OutputChannel;
+
+typedef struct {
+    FILE *stream;     // read through stdio while data is NULL
+    bool poll;        // check stream for input before reading, see cpu_set_input_poll()
+    const char *data; // preloaded input, see cpu_set_input_file()
+    size_t len;
+    size_t pos;
+    void *owned;      // mapping or heap copy behind data, NULL if borrowed
+    size_t owned_len; // length of the mapping, 0 for a heap copy
+    FILE *record;     // log of everything read, see cpu_record_input()
+} InputChannel;
+
+#define CACHE_LINE 64
+
+/*
+    The first cache line is everything an engine touches per instruction,
+    the rest is only reached from I/O, the JIT's entry and exit and setup.
+    Keep it that way: the static_assert below catches a hot field pushing
+    the line over.
+*/
 typedef struct CPU {
-    uint16_t regs[NUMS_R];
+    alignas(CACHE_LINE) uint16_t regs[NUMS_R];
     uint32_t pc;
     uint32_t sp;
-    uint16_t SR[4]; // optional segment regs: CS, DS, SS, ES (16-bit)
-    uint8_t flags;
-    uint8_t *mem; // Dynamic memory
+    uint16_t flag_res;      // last flag-setting result, gives Z and S
+    uint16_t flag_a;        // operands of flag_op
+    uint16_t flag_b;
+    uint8_t flags;          // C/O when flag_op == FLAGOP_NONE, see cpu_get_flags()
+    uint8_t flag_op;        // FlagOp producing C/O
+    uint8_t *mem;           // Dynamic memory
+    uint16_t SR[4];         // segment registers, indexed by Segment
+    int64_t budget;         // instructions left in this cpu_run_for() slice
+    uint32_t mmio_size;     // EXT_LOAD/EXT_STORE in [mmio_base, mmio_base + mmio_size)
+    uint16_t mmio_base;     // go through the bus, 0 = none
     bool halted;
+    bool waiting;           // parked on OP_STDIN until input is ready
+
+    // cold
+    DecodedInstr *icache;   // MEMORY_SIZE / 2 slots, allocated on first threaded run
+    JitState *jit;          // allocated on first JIT run
+    Verified *verified;     // what cpu_verify() proved about the code, NULL if nothing
+    bool verify_pending;    // loaded code the first switch run verifies, see cpu_run_for()
+    bool faulted;           // halted on an unknown opcode rather than OP_HALT
+    uint32_t code_lo;       // the loaded code, [code_lo, code_hi), see cpu_verify()
+    uint32_t code_hi;
+    OutputChannel out;      // guest OP_STDOUT, see cpu_flush_output()
+    InputChannel in;        // guest OP_STDIN
+    DeviceBus *bus;         // NULL unless devices are attached, see cpu_attach_device()
+#ifdef VM_PROFILE
+    Profile *profile; // NULL unless profiling, see profile_create()
+#endif
+    struct Trace *trace;    // NULL unless tracing, see trace_open()
+    GuestCounters counters; // see cpu_get_counters()
+    int64_t budget_start;   // budget when counters.instructions was last brought up to date
+    size_t mapping;         // bytes cpu_create() mapped at mem, 0 inside a CpuArena
 } CPU;
 
+_Static_assert(offsetof(CPU, icache) <= CACHE_LINE, "hot CPU state must fit one cache line");
+
+// Address of offset in segment seg
+static inline uint32_t seg_addr(const CPU *cpu, Segment seg, uint16_t offset)
+{
+    return (((uint32_t)cpu->SR[seg] << SEG_SHIFT) + offset) & ADDR_MASK;
+}
+
+// Whether CS or DS moved off 0, the only layout the JIT compiles for
+static inline bool cpu_segmented(const CPU *cpu)
+{
+    return (cpu->SR[SEG_CS] | cpu->SR[SEG_DS]) != 0;
+}
+
+/*
+    What cpu_verify() proved about the code in [lo, hi): starts has a bit
+    for every instruction the walk reached, each of them decodes to a known
+    operation and falls through or jumps relative only to another one. The
+    bitmap covers all of guest memory, one bit per byte, so looking up a
+    jump target is one load; only the pages over the code are ever touched.
+    Shared, like the memory it describes, between a snapshot and its clones.
+*/
+struct Verified {
+    _Atomic uint32_t refs;
+    uint32_t lo;
+    uint32_t hi;
+    uint8_t starts[MEMORY_SIZE / 8]; // bit pc
+};
+
+// Whether pc (below MEMORY_SIZE) is an instruction the verifier reached
+static inline bool verified_start(const Verified *v, uint32_t pc)
+{
+    return (v->starts[pc >> 3] >> (pc & 7)) & 1;
+}
+
+static inline Verified *verified_retain(Verified *v)
+{
+    if (v)
+        atomic_fetch_add_explicit(&v->refs, 1, memory_order_relaxed);
+    return v;
+}
+
+static inline void verified_release(Verified *v)
+{
+    if (v && atomic_fetch_sub_explicit(&v->refs, 1, memory_order_acq_rel) == 1)
+        free(v);
+}
+
+static inline void counters_add(GuestCounters *to, const GuestCounters *c)
+{
+    to->instructions += c->instructions;
+    to->branches += c->branches;
+    to->calls += c->calls;
+    to->returns += c->returns;
+    to->bytes_loaded += c->bytes_loaded;
+    to->bytes_stored += c->bytes_stored;
+    to->io_in += c->io_in;
+    to->io_out += c->io_out;
+}
+
 typedef struct {
     CPU *cpu;
     uint32_t addr;
+    bool failed; // a branch didn't fit, the program is unusable
 } ProgramBuilder;
 
 /*
@@ -89,6 +417,7 @@ ProgramBuilder *pb_init(CPU *cpu)
     ProgramBuilder *pb = malloc(sizeof(ProgramBuilder));
     pb->cpu = cpu;
     pb->addr = 0;
+    pb->failed = false;
 
     return pb;
 }
@@ -103,8 +432,21 @@ static inline void mem_w8(CPU *cpu, uint32_t addr, uint8_t value)
     cpu->mem[addr & ADDR_MASK] = value;
 }
 
+/*
+    Guest memory is little-endian. Away from the ADDR_MASK wrap a word is one
+    (possibly unaligned) host access; memcpy keeps that free of aliasing and
+    alignment UB and compiles to a plain mov.
+*/
 static inline uint16_t mem_r16(CPU *cpu, uint32_t addr)
 {
+#if VM_LITTLE_ENDIAN
+    addr &= ADDR_MASK;
+    if (addr != ADDR_MASK) {
+        uint16_t value;
+        memcpy(&value, cpu->mem + addr, sizeof(value));
+        return value;
+    }
+#endif
     uint8_t low = mem_r8(cpu, addr);
     uint8_t high = mem_r8(cpu, addr + 1);
     return (uint16_t)(low | (high << 8));
@@ -112,12 +454,83 @@ static inline uint16_t mem_r16(CPU *cpu, uint32_t addr)
 
 static inline void mem_w16(CPU *cpu, uint32_t addr, uint16_t value)
 {
+#if VM_LITTLE_ENDIAN
+    addr &= ADDR_MASK;
+    if (addr != ADDR_MASK) {
+        memcpy(cpu->mem + addr, &value, sizeof(value));
+        return;
+    }
+#endif
     mem_w8(cpu, addr, value & 0xFF);
     mem_w8(cpu, addr + 1, (value >> 8) & 0xFF);
 }
 
+static void jit_invalidate(JitState *jit, uint32_t addr, uint32_t len);
+static void jit_reset(JitState *jit);
+static void jit_destroy(JitState *jit);
+static void bus_destroy(DeviceBus *bus);
+
+#define ICACHE_SIZE ((size_t)(MEMORY_SIZE / 2) * sizeof(DecodedInstr))
+
+// Zero-filled anonymous allocation: pages are only committed once touched
+static void *vm_zalloc(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void vm_zfree(void *p, size_t size)
+{
+    if (p)
+        munmap(p, size);
+}
+
+// Hand the pages back to the kernel, the next touch reads zeros again
+static void vm_zreset(void *p, size_t size)
+{
+    if (p)
+        madvise(p, size, MADV_DONTNEED);
+}
+
+// Drop decoded slots and compiled blocks covering [addr, addr + len) after a guest write
+static inline void icache_invalidate(CPU *cpu, uint32_t addr, uint32_t len)
+{
+    // The proof is about the bytes that were there, a write into the code ends it
+    Verified *v = cpu->verified;
+    if (v) {
+        uint32_t at = addr & ADDR_MASK, end = at + len; // past MEMORY_SIZE if it wraps
+        if ((at < v->hi && end > v->lo) || (end > MEMORY_SIZE && end - MEMORY_SIZE > v->lo)) {
+            verified_release(v);
+            cpu->verified = NULL;
+        }
+    }
+    if (cpu->jit)
+        jit_invalidate(cpu->jit, addr, len);
+    if (!cpu->icache)
+        return;
+    uint32_t first = (addr & ADDR_MASK) >> 1;
+    uint32_t count = ((addr & 1) + len + 1) >> 1;
+    for (uint32_t i = 0; i < count; i++)
+        cpu->icache[(first + i) & (ADDR_MASK >> 1)].handler = 0;
+}
+
+// Guest-visible 16-bit store: keeps the decoded-instruction cache coherent
+static inline void cpu_store16(CPU *cpu, uint32_t addr, uint16_t value)
+{
+    mem_w16(cpu, addr, value);
+    icache_invalidate(cpu, addr, 2);
+}
+
 static inline uint32_t mem_r20(CPU *cpu, uint32_t addr)
 {
+#if VM_LITTLE_ENDIAN
+    addr &= ADDR_MASK;
+    if (addr < ADDR_MASK - 1) {
+        uint32_t value = 0;
+        memcpy(&value, cpu->mem + addr, 3);
+        return value & ADDR_MASK;
+    }
+#endif
     uint8_t b0 = mem_r8(cpu, addr);
     uint8_t b1 = mem_r8(cpu, addr + 1);
     uint8_t b2 = mem_r8(cpu, addr + 2);
@@ -139,12 +552,46 @@ static inline uint16_t make_ext_instr(uint8_t ext_op, uint8_t reg1, uint8_t reg2
     return (OP_EXT << 12) | (ext_op << 9) | (reg1 << 6) | (reg2 << 3);
 }
 
+static inline uint16_t make_ext2_instr(uint8_t ext2_op, uint8_t reg1, uint8_t reg2)
+{
+    return (OP_EXT2 << 12) | (ext2_op << 9) | (reg1 << 6) | (reg2 << 3);
+}
+
+static inline void pb_emit(ProgramBuilder *pb, uint16_t instr)
+{
+    mem_w16(pb->cpu, pb->addr, instr);
+    pb->addr += 2;
+}
+
 static inline void pb_movi(ProgramBuilder *pb, Register reg, uint16_t imm)
 {
     mem_w16(pb->cpu, pb->addr, make_instr_imm(OP_MOVI, reg, imm));
     pb->addr += 2;
 }
 
+// Full 16-bit constant: plain MOVI when it fits the sign-extended imm9, MOVIW otherwise
+static void pb_load16(ProgramBuilder *pb, Register reg, uint16_t value)
+{
+    int16_t v = (int16_t)value;
+    if (v >= -256 && v <= 255) {
+        pb_movi(pb, reg, value);
+        return;
+    }
+    pb_emit(pb, (OP_FUSE << 12) | (FUSE_MOVIW << 9) | (reg << 6));
+    pb_emit(pb, value);
+}
+
+// Always-MOVIW load of a value that isn't known yet; returns the literal's address for pb_patch16
+static uint32_t pb_load16_fwd(ProgramBuilder *pb, Register reg)
+{
+    pb_emit(pb, (OP_FUSE << 12) | (FUSE_MOVIW << 9) | (reg << 6));
+    uint32_t literal = pb->addr;
+    pb_emit(pb, 0);
+    return literal;
+}
+
+static inline void pb_patch16(ProgramBuilder *pb, uint32_t literal, uint16_t value) { mem_w16(pb->cpu, literal, value); }
+
 static inline void pb_stdout_str(ProgramBuilder *pb, const char *str)
 {
     mem_w16(pb->cpu, pb->addr, make_instr(OP_STDOUT, 0, 0));
@@ -169,7 +616,7 @@ static inline void pb_stdin_num(ProgramBuilder *pb, Register reg)
 
 static inline void pb_stdin_str(ProgramBuilder *pb, Register reg, uint32_t buffer_addr)
 {
-    pb->cpu->regs[reg] = buffer_addr;
+    pb_load16(pb, reg, (uint16_t)buffer_addr);
     mem_w16(pb->cpu, pb->addr, make_instr(OP_STDIN, 0, reg));
     pb->addr += 2;
 }
@@ -186,352 +633,5461 @@ static inline void pb_add(ProgramBuilder *pb, Register dst, Register src)
     pb->addr += 2;
 }
 
-/*
-    load a full 16-bit value into a register
-    Strategy: Load High Byte -> Shift Left 8 times -> OR Low Byte
-*/
-// TODO: Add a proper loading command
-static void pb_load16(ProgramBuilder *pb, Register reg, uint16_t value)
+// Decrement reg and jump to the address in target while it's non-zero
+static inline void pb_djnz(ProgramBuilder *pb, Register reg, Register target)
 {
+    mem_w16(pb->cpu, pb->addr, (OP_FUSE << 12) | (FUSE_DJNZ << 9) | (reg << 6) | (target << 3));
+    pb->addr += 2;
+}
 
-    pb->cpu->regs[reg] = value;
-    // uint8_t high = (value >> 8) & 0xFF;
-    // uint8_t low = value & 0xFF;
-    //
-    // // 1. Load High Byte (0-255 fits in MOVI)
-    // pb_movi(pb, reg, high);
-    //
-    // // 2. Shift Left 8 times (using ADD reg, reg)
-    // // We need to do this only if there is a high byte,
-    // // but for simplicity, we can do it always or optimize.
-    // if (high > 0) {
-    //     for (int i = 0; i < 8; i++) {
-    //         // EXT_ADD dst, src (here dst=reg, src=reg)
-    //         mem_w16(pb->cpu, pb->addr, make_ext_instr(EXT_ADD, reg, reg));
-    //         pb->addr += 2;
-    //     }
-    // }
-    //
-    // // 3. Load Low Byte into a temporary register (using R7 as temp scratch)
-    // // Then OR it into the destination.
-    // // If high byte was 0, we can just MOVI the low byte directly.
-    // if (high > 0) {
-    //     Register temp = R7;
-    //     pb_movi(pb, temp, low);
-    //     // OR reg, temp
-    //     mem_w16(pb->cpu, pb->addr, make_ext_instr(EXT_OR, reg, temp));
-    //     pb->addr += 2;
-    // } else {
-    //     pb_movi(pb, reg, low);
-    // }
+// PC-relative JMPR/JZR/JNZR to target, which must be within 256 instructions. A target that
+// doesn't fit marks the builder failed and emits a HALT rather than a wrapped displacement
+static void pb_branch(ProgramBuilder *pb, FuseOpcode op, uint32_t target)
+{
+    int32_t disp = ((int32_t)target - (int32_t)(pb->addr + 2)) / 2;
+    if (disp < -256 || disp > 255 || (target & 1)) {
+        fprintf(stderr, "pb_branch: 0x%05X is out of range from 0x%05X\n", target, pb->addr);
+        pb->failed = true;
+        pb_halt(pb);
+        return;
+    }
+    pb_emit(pb, (OP_FUSE << 12) | (op << 9) | ((uint16_t)disp & 0x1FF));
 }
+
+static inline void pb_jmp(ProgramBuilder *pb, uint32_t target) { pb_branch(pb, FUSE_JMPR, target); }
+static inline void pb_jz(ProgramBuilder *pb, uint32_t target) { pb_branch(pb, FUSE_JZR, target); }
+static inline void pb_jnz(ProgramBuilder *pb, uint32_t target) { pb_branch(pb, FUSE_JNZR, target); }
+
 /*
  * ========================
  */
 
-CPU *cpu_create(void)
+/*
+ * =====================================
+ *           OUTPUT CHANNEL
+ * =====================================
+ */
+
+/*
+    Guest output is collected in a per-VM buffer and handed over in one go,
+    either to an embedder-supplied sink or with writev() on a file
+    descriptor. It is flushed when the buffer fills up, on HALT, before
+    OP_STDIN blocks on input, on cpu_destroy() and on cpu_flush_output().
+*/
+
+static void out_hash(OutputDigest *d, const char *data, size_t len)
 {
-    CPU *cpu = calloc(1, sizeof(CPU));
-    if (!cpu)
-        return NULL;
+    uint64_t h = d->hash;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)data[i]) * 0x100000001B3ull;
+    d->hash = h;
+    d->bytes += len;
+}
 
-    cpu->mem = malloc(MEMORY_SIZE);
-    if (!cpu->mem) {
-        free(cpu);
-        return NULL;
+static void out_emit(OutputChannel *o, const char *data, size_t len)
+{
+    if (o->digesting) {
+        out_hash(&o->digest, o->buf, o->len);
+        out_hash(&o->digest, data, len);
     }
 
-    memset(cpu->mem, 0, MEMORY_SIZE);
-    cpu->pc = 0x0000;
-    cpu->sp = MEMORY_SIZE - 2; // Top of memory, aligned for 16-bit
-    cpu->flags = 0;
-    cpu->halted = false;
+    if (o->sink) {
+        if (o->len)
+            o->sink(o->ctx, o->buf, o->len);
+        if (len)
+            o->sink(o->ctx, data, len);
+        o->len = 0;
+        return;
+    }
 
-    return cpu;
+    // Keep anything printf'd by the host (demo banners, cpu_dump) in order
+    if (o->fd == STDOUT_FILENO)
+        fflush(stdout);
+
+    struct iovec iov[2] = {
+        {o->buf, o->len},
+        {(void *)data, len},
+    };
+    int idx = o->len ? 0 : 1;
+    while (idx < 2) {
+        ssize_t n = writev(o->fd, iov + idx, 2 - idx);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break; // nowhere to report it; drop the output like stdio would
+        }
+        for (; idx < 2 && (size_t)n >= iov[idx].iov_len; idx++)
+            n -= (ssize_t)iov[idx].iov_len;
+        if (idx < 2) {
+            iov[idx].iov_base = (char *)iov[idx].iov_base + n;
+            iov[idx].iov_len -= (size_t)n;
+        }
+    }
+    o->len = 0;
 }
 
-void cpu_destroy(CPU *cpu)
+void cpu_flush_output(CPU *cpu)
 {
-    if (cpu) {
-        free(cpu->mem);
-        free(cpu);
+    if (cpu->out.len)
+        out_emit(&cpu->out, NULL, 0);
+}
+
+static void out_write(OutputChannel *o, const char *data, size_t len)
+{
+    if (!o->buf && (o->buf = malloc(o->cap)) == NULL) {
+        out_emit(o, data, len); // unbuffered rather than lost
+        return;
+    }
+    if (o->len + len > o->cap) {
+        if (len > o->cap) {
+            // Too big to buffer: send it along with what's pending
+            out_emit(o, data, len);
+            return;
+        }
+        out_emit(o, NULL, 0);
     }
+    memcpy(o->buf + o->len, data, len);
+    o->len += len;
 }
 
-void stack_push16(CPU *cpu, uint16_t value)
+static inline void out_char(OutputChannel *o, char c)
 {
-    cpu->sp -= 2;
-    mem_w16(cpu, cpu->sp, value);
+    if (o->buf && o->len < o->cap)
+        o->buf[o->len++] = c;
+    else
+        out_write(o, &c, 1);
 }
 
-uint16_t stack_pop16(CPU *cpu)
+// Returns the number of characters written
+static size_t out_int16(OutputChannel *o, int16_t value)
 {
-    uint16_t value = mem_r16(cpu, cpu->sp);
-    cpu->sp += 2;
-    return value;
+    char tmp[6];
+    char *p = tmp + sizeof(tmp);
+    uint16_t u = value < 0 ? (uint16_t)-(int32_t)value : (uint16_t)value;
+
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (value < 0)
+        *--p = '-';
+    size_t len = (size_t)(tmp + sizeof(tmp) - p);
+    out_write(o, p, len);
+    return len;
 }
 
-void set_flag(CPU *cpu, uint8_t flag, bool value)
+// printf-style output for the VM's own messages (HALT, unknown opcodes)
+static void out_printf(OutputChannel *o, const char *fmt, ...)
 {
-    if (value) {
-        cpu->flags |= flag;
-    } else {
-        cpu->flags &= ~flag;
-    }
+    char msg[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        out_write(o, msg, (size_t)n < sizeof(msg) ? (size_t)n : sizeof(msg) - 1);
 }
 
-bool get_flag(CPU *cpu, uint8_t flag)
+// Start hashing guest output from here on, cpu->out.digest after a flush
+void cpu_digest_output(CPU *cpu)
 {
-    return (cpu->flags & flag) != 0;
+    cpu_flush_output(cpu);
+    cpu->out.digesting = true;
+    cpu->out.digest = (OutputDigest){0, 0xCBF29CE484222325ull};
 }
 
-void update_flags(CPU *cpu, uint16_t result)
+void cpu_set_output_fd(CPU *cpu, int fd)
 {
-    set_flag(cpu, FLAG_ZERO, result == 0);
-    set_flag(cpu, FLAG_SIGN, (result & 0x8000) != 0);
+    cpu_flush_output(cpu);
+    cpu->out.fd = fd;
+    cpu->out.sink = NULL;
+    cpu->out.ctx = NULL;
 }
 
-uint16_t fetch_instruction(CPU *cpu)
+void cpu_set_output_sink(CPU *cpu, OutputSink sink, void *ctx)
 {
-    uint16_t instr = mem_r16(cpu, cpu->pc);
-    cpu->pc += 2;
-    return instr;
+    cpu_flush_output(cpu);
+    cpu->out.sink = sink;
+    cpu->out.ctx = ctx;
 }
 
-void cpu_step(CPU *cpu)
+// Buffer size, i.e. how much output is held back before a flush
+void cpu_set_output_buffer(CPU *cpu, size_t size)
 {
-    if (cpu->halted)
-        return;
+    cpu_flush_output(cpu);
+    free(cpu->out.buf);
+    cpu->out.buf = NULL;
+    cpu->out.cap = size ? size : 1;
+}
 
-    uint16_t instr = fetch_instruction(cpu);
-    uint8_t opcode = (instr >> 12) & 0xF;
-    uint8_t dst = (instr >> 9) & 0x7;
-    uint8_t src = (instr >> 6) & 0x7;
-    uint16_t imm9 = instr & 0x1FF;
+/*
+ * =====================================
+ *            INPUT CHANNEL
+ * =====================================
+ */
 
-    switch (opcode) {
-        case OP_HALT:
-            cpu->halted = true;
-            printf("CPU Stopped at PC: 0x%05X\n", cpu->pc - 2);
-            break;
+/*
+    Guest input comes from a stdio stream (stdin by default) or from a
+    buffer preloaded up front: a file mapped read-only, everything read from
+    a pipe, or an embedder's own bytes. OP_STDIN parses a preloaded buffer in
+    place, without stdio locking or a bounce buffer, and never has to flush
+    output first since it cannot block.
+*/
 
-        case OP_NOP:
-            break;
+static void in_release(InputChannel *in)
+{
+    if (in->owned_len)
+        munmap(in->owned, in->owned_len);
+    else
+        free(in->owned);
+    in->owned = NULL;
+    in->owned_len = 0;
+    in->data = NULL;
+    in->len = 0;
+    in->pos = 0;
+}
 
-        case OP_MOV:
-            cpu->regs[dst] = cpu->regs[src];
-            update_flags(cpu, cpu->regs[dst]);
-            break;
+// Read from stream as it comes, dropping any preloaded input
+void cpu_set_input_stream(CPU *cpu, FILE *stream)
+{
+    in_release(&cpu->in);
+    cpu->in.stream = stream;
+    cpu->in.poll = false;
+}
 
-        case OP_MOVI:
-            // Sign-extend 9-bit immediate
-            cpu->regs[dst] = (imm9 & 0x100) ? (imm9 | 0xFE00) : imm9;
-            update_flags(cpu, cpu->regs[dst]);
-            break;
+/*
+    With poll set, OP_STDIN on a stream that has nothing to read yet parks
+    the guest instead of blocking the thread (cpu_run_for() returns
+    RUN_WAITING). The stream is made unbuffered so that poll() sees all of
+    it, so this has to be set before anything is read from it. A partial
+    line still waits for the rest, and console device reads always block.
+*/
+void cpu_set_input_poll(CPU *cpu, bool on)
+{
+    cpu->in.poll = on;
+    if (on && cpu->in.stream)
+        setvbuf(cpu->in.stream, NULL, _IONBF, 0);
+}
 
-        case OP_CMP: {
-            // Compare: SUB but don't store result
-            uint32_t result = (uint32_t)cpu->regs[dst] - (uint32_t)cpu->regs[src];
-            set_flag(cpu, FLAG_CARRY, cpu->regs[dst] < cpu->regs[src]);
-            update_flags(cpu, result & 0xFFFF);
-            break;
-        }
+// False only for a polled stream with nothing to read yet
+static bool in_ready(const InputChannel *in)
+{
+    if (in->data || !in->poll)
+        return true;
+    struct pollfd p = {.fd = fileno(in->stream), .events = POLLIN};
+    return poll(&p, 1, 0) != 0; // data, EOF and errors are for the read to find
+}
 
-        case OP_JMP:
-            // Jump to address in register
-            cpu->pc = cpu->regs[dst] & ADDR_MASK;
-            break;
+// Borrowed: data has to stay valid until the input is replaced or the CPU destroyed
+void cpu_set_input_buffer(CPU *cpu, const void *data, size_t len)
+{
+    in_release(&cpu->in);
+    cpu->in.data = data ? data : "";
+    cpu->in.len = data ? len : 0;
+}
 
-        case OP_JZ:
-            // Jump if zero flag is set
-            if (get_flag(cpu, FLAG_ZERO)) {
-                cpu->pc = cpu->regs[dst] & ADDR_MASK;
-            }
-            break;
+// Preload all of path ("-" for stdin): regular files are mapped, anything else is read in
+bool cpu_set_input_file(CPU *cpu, const char *path)
+{
+    int fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open input %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
 
-        case OP_JNZ:
-            // Jump if NOT zero
-            if (!get_flag(cpu, FLAG_ZERO)) {
-                cpu->pc = cpu->regs[dst] & ADDR_MASK;
+    in_release(&cpu->in);
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            close(fd);
+            cpu->in.owned = p;
+            cpu->in.owned_len = (size_t)st.st_size;
+            cpu->in.data = p;
+            cpu->in.len = (size_t)st.st_size;
+            return true;
+        }
+    }
+
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    for (;;) {
+        if (len == cap) {
+            char *grown = realloc(buf, cap ? cap * 2 : 65536);
+            if (!grown)
+                break;
+            buf = grown;
+            cap = cap ? cap * 2 : 65536;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0) {
+                close(fd);
+                cpu->in.owned = buf;
+                cpu->in.data = buf ? buf : "";
+                cpu->in.len = len;
+                return true;
             }
             break;
+        }
+        len += (size_t)n;
+    }
 
-        case OP_PUSH:
-            stack_push16(cpu, cpu->regs[dst]);
-            break;
+    fprintf(stderr, "Failed to read input %s: %s\n", path, strerror(errno));
+    free(buf);
+    close(fd);
+    return false;
+}
 
-        case OP_POP:
-            cpu->regs[dst] = stack_pop16(cpu);
-            update_flags(cpu, cpu->regs[dst]);
-            break;
+// Append what the guest just consumed to the --record log
+static inline void in_log(InputChannel *in, const void *data, size_t len)
+{
+    if (in->record && len)
+        fwrite(data, 1, len, in->record);
+}
 
-        case OP_CALL:
-            // Push return address (next instruction)
-            stack_push16(cpu, cpu->pc & 0xFFFF);      // Low 16 bits
-            stack_push16(cpu, (cpu->pc >> 16) & 0xF); // High 16 bits
-            cpu->pc = cpu->regs[dst] & ADDR_MASK;
+static int in_getc(InputChannel *in)
+{
+    int c;
+    if (!in->data)
+        c = getc(in->stream);
+    else
+        c = in->pos < in->len ? (unsigned char)in->data[in->pos++] : EOF;
+    if (in->record && c != EOF)
+        putc(c, in->record);
+    return c;
+}
+
+// Up to n bytes into dst, fewer at EOF
+static size_t in_read(InputChannel *in, void *dst, size_t n)
+{
+    if (!in->data) {
+        n = fread(dst, 1, n, in->stream);
+    } else {
+        size_t left = in->len - in->pos;
+        if (n > left)
+            n = left;
+        memcpy(dst, in->data + in->pos, n);
+        in->pos += n;
+    }
+    in_log(in, dst, n);
+    return n;
+}
+
+/*
+    The next line the way fgets() on a STDIN_LINE_MAX + 1 byte buffer sees
+    it: through the newline, but at most STDIN_LINE_MAX bytes, leaving the
+    rest of a longer line for the next read. Preloaded input is returned in
+    place, tmp only backs a stream. False at EOF.
+*/
+static bool in_line(InputChannel *in, char *tmp, const char **line, size_t *len)
+{
+    if (!in->data) {
+        if (!fgets(tmp, STDIN_LINE_MAX + 1, in->stream))
+            return false;
+        *line = tmp;
+        *len = strlen(tmp);
+        in_log(in, tmp, *len);
+        return true;
+    }
+
+    size_t left = in->len - in->pos;
+    if (left == 0)
+        return false;
+    if (left > STDIN_LINE_MAX)
+        left = STDIN_LINE_MAX;
+    const char *p = in->data + in->pos;
+    const char *nl = memchr(p, '\n', left);
+    *line = p;
+    *len = nl ? (size_t)(nl - p) + 1 : left;
+    in->pos += *len;
+    in_log(in, p, *len);
+    return true;
+}
+
+static inline bool in_space(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// As fscanf("%d") followed by dropping the rest of the line; false if there was no number
+static bool in_number_read(InputChannel *in, uint16_t *value, bool *eof)
+{
+    if (!in->data) {
+        int n;
+        int got = fscanf(in->stream, "%d", &n);
+        if (got == 1)
+            *value = (uint16_t)n;
+        int c;
+        while ((c = getc(in->stream)) != '\n' && c != EOF)
+            ;
+        *eof = got == EOF;
+        return got == 1;
+    }
+
+    const char *p = in->data + in->pos;
+    const char *end = in->data + in->len;
+    while (p < end && in_space(*p))
+        p++;
+    *eof = p == end;
+    bool neg = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+        p++;
+
+    const char *digits = p;
+    uint16_t n = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        n = (uint16_t)(n * 10 + (*p++ - '0'));
+    bool ok = p > digits;
+    if (ok)
+        *value = neg ? (uint16_t)-n : n;
+
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    in->pos = nl ? (size_t)(nl + 1 - in->data) : in->len;
+    return ok;
+}
+
+/*
+    The log gets a line that reads back the same way rather than the text
+    fscanf() went through, which stdio doesn't hand back: the value, or a
+    non-number for a failed read. Nothing is logged at EOF.
+*/
+static bool in_number(InputChannel *in, uint16_t *value)
+{
+    bool eof;
+    bool ok = in_number_read(in, value, &eof);
+    if (in->record) {
+        if (ok)
+            fprintf(in->record, "%u\n", *value);
+        else if (!eof)
+            fputs("?\n", in->record);
+    }
+    return ok;
+}
+
+/*
+ * =====================================
+ *          INPUT RECORD/REPLAY
+ * =====================================
+ */
+
+/*
+    --record=LOG saves everything the guest reads, in the order it reads it,
+    behind a one-line header with the length and FNV-1a hash of everything
+    it printed:
+
+        VMIO 1 <output bytes, 16 hex digits> <hash, 16 hex digits>\n
+        <input>
+
+    Since OP_STDIN parses a preloaded buffer exactly like the stream (see
+    in_number()), --replay=LOG maps the input back in and the run reads
+    nothing and prints nothing; only the output digest is kept, to check it
+    against the recorded one. That makes a replay a deterministic, I/O-free
+    workload to benchmark, diffable across engines. The header is written
+    last, so a recording cut short has no digest to check.
+*/
+
+#define IOLOG_MAGIC "VMIO"
+#define IOLOG_VERSION 1
+#define IOLOG_HEADER 41 // "VMIO 1 " + 16 + ' ' + 16 + '\n'
+
+// Flush pending output and fill in the log's header; false if the log couldn't be written
+bool cpu_record_finish(CPU *cpu)
+{
+    FILE *f = cpu->in.record;
+    if (!f)
+        return true;
+
+    cpu_flush_output(cpu);
+    cpu->in.record = NULL;
+    bool ok = fseek(f, 0, SEEK_SET) == 0 &&
+              fprintf(f, "%s %d %016llx %016llx\n", IOLOG_MAGIC, IOLOG_VERSION,
+                      (unsigned long long)cpu->out.digest.bytes,
+                      (unsigned long long)cpu->out.digest.hash) == IOLOG_HEADER;
+    ok &= !ferror(f);
+    ok &= fclose(f) == 0;
+    return ok;
+}
+
+// Log guest input to path and start digesting output, until cpu_record_finish()
+bool cpu_record_input(CPU *cpu, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to open record log %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    fprintf(f, "%s %d ---------------- ----------------\n", IOLOG_MAGIC, IOLOG_VERSION);
+
+    cpu_record_finish(cpu);
+    cpu->in.record = f;
+    cpu_digest_output(cpu);
+    return true;
+}
+
+static void replay_discard(void *ctx, const char *data, size_t len)
+{
+    (void)ctx;
+    (void)data;
+    (void)len;
+}
+
+/*
+    Serve input from a --record log and drop output, keeping only its
+    digest. recorded gets the log's digest, or bytes = UINT64_MAX if the
+    recording never finished.
+*/
+bool cpu_replay_input(CPU *cpu, const char *path, OutputDigest *recorded)
+{
+    if (!cpu_set_input_file(cpu, path))
+        return false;
+
+    InputChannel *in = &cpu->in;
+    char header[IOLOG_HEADER + 1] = {0};
+    unsigned long long bytes, hash;
+    int version;
+    memcpy(header, in->data, in->len < IOLOG_HEADER ? in->len : IOLOG_HEADER);
+    if (in->len < IOLOG_HEADER || strncmp(header, IOLOG_MAGIC " ", 5) != 0 ||
+        header[IOLOG_HEADER - 1] != '\n' || sscanf(header + 5, "%d", &version) != 1) {
+        fprintf(stderr, "%s: not a --record log\n", path);
+        in_release(in);
+        return false;
+    }
+    if (version != IOLOG_VERSION) {
+        fprintf(stderr, "%s: record log version %d, expected %d\n", path, version, IOLOG_VERSION);
+        in_release(in);
+        return false;
+    }
+
+    if (sscanf(header + 7, "%16llx %16llx", &bytes, &hash) == 2)
+        *recorded = (OutputDigest){bytes, hash};
+    else
+        *recorded = (OutputDigest){UINT64_MAX, 0};
+    in->pos = IOLOG_HEADER;
+
+    cpu_set_output_sink(cpu, replay_discard, NULL);
+    cpu_digest_output(cpu);
+    return true;
+}
+
+#ifdef VM_PROFILE
+
+/*
+ * =====================================
+ *             DISASSEMBLER
+ * =====================================
+ */
+
+static const char *const op_names[16] = {
+    "HALT", "NOP", "MOV", "MOVI", "CMP", "JMP", "JZ", "JNZ",
+    "PUSH", "POP", "CALL", "STDOUT", "STDIN", "EXT", "EXT2", "FUSE",
+};
+
+static const char *const ext_names[8] = {
+    "RET", "LOAD", "STORE", "ADD", "SUB", "AND", "OR", "XOR",
+};
+
+static const char *const ext2_names[8] = {
+    "MUL", "MULH", "DIV", "MOD", "SHL", "SHR", "SAR", "BLOCK",
+};
+
+static const char *const block_names[8] = {
+    "COPY", "FILL", "BCMP", "STRLEN", "SETSEG", "GETSEG", "BLOCK_6", "BLOCK_7",
+};
+
+static const char *const fuse_names[8] = {
+    "DJNZ", "SJNZ", "CJZ", "CJNZ", "JMPR", "JZR", "JNZR", "MOVIW",
+};
+
+static const char *const seg_names[4] = {"CS", "DS", "SS", "ES"};
+
+// One instruction in the same spelling as the OpcodeTable/ExtOpcodeTable names
+static void disasm(uint16_t instr, char *buf, size_t size)
+{
+    uint8_t opcode = (instr >> 12) & 0xF;
+    uint8_t dst = (instr >> 9) & 0x7;
+    uint8_t src = (instr >> 6) & 0x7;
+    uint16_t imm9 = instr & 0x1FF;
+
+    switch (opcode) {
+        case OP_HALT:
+        case OP_NOP:
+            snprintf(buf, size, "%s", op_names[opcode]);
+            break;
+        case OP_MOVI:
+            snprintf(buf, size, "MOVI R%u, %d", dst, (int16_t)((imm9 & 0x100) ? (imm9 | 0xFE00) : imm9));
+            break;
+        case OP_MOV:
+        case OP_CMP:
+            snprintf(buf, size, "%s R%u, R%u", op_names[opcode], dst, src);
+            break;
+        case OP_STDOUT:
+        case OP_STDIN:
+            snprintf(buf, size, "%s %u, R%u", op_names[opcode], dst, src);
+            break;
+        case OP_EXT:
+            if (dst == EXT_RET)
+                snprintf(buf, size, "RET");
+            else
+                snprintf(buf, size, "%s R%u, R%u", ext_names[dst], src, (instr >> 3) & 0x7);
+            break;
+        case OP_EXT2:
+            if (dst == EXT2_BLOCK && (instr & 0x7) == BLOCK_SETSEG)
+                snprintf(buf, size, "SETSEG %s, R%u", seg_names[(instr >> 3) & 0x3], src);
+            else if (dst == EXT2_BLOCK && (instr & 0x7) == BLOCK_GETSEG)
+                snprintf(buf, size, "GETSEG R%u, %s", src, seg_names[(instr >> 3) & 0x3]);
+            else if (dst == EXT2_BLOCK)
+                snprintf(buf, size, "%s R%u, R%u", block_names[instr & 0x7], src, (instr >> 3) & 0x7);
+            else
+                snprintf(buf, size, "%s R%u, R%u", ext2_names[dst], src, (instr >> 3) & 0x7);
+            break;
+        case OP_FUSE:
+            if (dst == FUSE_DJNZ)
+                snprintf(buf, size, "DJNZ R%u, R%u", src, (instr >> 3) & 0x7);
+            else if (dst == FUSE_MOVIW)
+                snprintf(buf, size, "MOVIW R%u", src);
+            else if (dst >= FUSE_JMPR)
+                snprintf(buf, size, "%s %+d", fuse_names[dst], (int16_t)((imm9 & 0x100) ? (imm9 | 0xFE00) : imm9));
+            else
+                snprintf(buf, size, "%s R%u, R%u, R%u", fuse_names[dst], src, (instr >> 3) & 0x7, instr & 0x7);
+            break;
+        default:
+            if (opcode > OP_EXT)
+                snprintf(buf, size, "??? 0x%04X", instr);
+            else
+                snprintf(buf, size, "%s R%u", op_names[opcode], dst);
+            break;
+    }
+}
+
+/*
+ * =====================================
+ *              PROFILER
+ * =====================================
+ */
+
+/*
+    Opt-in with -DVM_PROFILE, then --profile at startup. Every hook in
+    cpu_step() goes through PROFILE(), which compiles to nothing otherwise.
+    Profiled runs use the switch engine so every instruction is counted.
+*/
+
+#define PROFILE_TABLE_SIZE ((size_t)(MEMORY_SIZE / 2) * sizeof(uint64_t))
+#define PROFILE_TOP 20
+
+typedef struct {
+    uint32_t addr;
+    char *name;
+} ProfileSymbol;
+
+typedef struct Profile {
+    uint64_t *pc_count; // per 2-byte slot
+    uint64_t *taken;    // JZ/JNZ taken count, per slot of the branch
+    uint64_t *calls;    // CALL count, per slot of the target
+    uint64_t op_count[16];
+    uint64_t ext_count[8];
+    uint64_t ext2_count[8];
+    ProfileSymbol *symbols; // sorted by address
+    size_t nsymbols;
+    size_t cap;
+} Profile;
+
+#define PROFILE(stmt)          \
+    do {                       \
+        if (cpu->profile) {    \
+            stmt;              \
+        }                      \
+    } while (0)
+
+static inline void profile_instr(Profile *p, uint32_t pc, uint16_t instr)
+{
+    p->pc_count[(pc & ADDR_MASK) >> 1]++;
+    p->op_count[instr >> 12]++;
+    if ((instr >> 12) == OP_EXT)
+        p->ext_count[(instr >> 9) & 0x7]++;
+    else if ((instr >> 12) == OP_EXT2)
+        p->ext2_count[(instr >> 9) & 0x7]++;
+}
+
+Profile *profile_create(void)
+{
+    Profile *p = calloc(1, sizeof(Profile));
+    if (!p)
+        return NULL;
+    p->pc_count = vm_zalloc(PROFILE_TABLE_SIZE);
+    p->taken = vm_zalloc(PROFILE_TABLE_SIZE);
+    p->calls = vm_zalloc(PROFILE_TABLE_SIZE);
+    if (!p->pc_count || !p->taken || !p->calls) {
+        vm_zfree(p->pc_count, PROFILE_TABLE_SIZE);
+        vm_zfree(p->taken, PROFILE_TABLE_SIZE);
+        vm_zfree(p->calls, PROFILE_TABLE_SIZE);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+void profile_destroy(Profile *p)
+{
+    if (p) {
+        vm_zfree(p->pc_count, PROFILE_TABLE_SIZE);
+        vm_zfree(p->taken, PROFILE_TABLE_SIZE);
+        vm_zfree(p->calls, PROFILE_TABLE_SIZE);
+        for (size_t i = 0; i < p->nsymbols; i++)
+            free(p->symbols[i].name);
+        free(p->symbols);
+        free(p);
+    }
+}
+
+static int symbol_cmp(const void *a, const void *b)
+{
+    const ProfileSymbol *x = a, *y = b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+// Unsorted until profile_sort_symbols()
+static bool profile_add_symbol(Profile *p, const char *name, uint32_t addr)
+{
+    if (p->nsymbols == p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 32;
+        ProfileSymbol *grown = realloc(p->symbols, cap * sizeof(ProfileSymbol));
+        if (!grown)
+            return false;
+        p->symbols = grown;
+        p->cap = cap;
+    }
+    char *copy = strdup(name);
+    if (!copy)
+        return false;
+    p->symbols[p->nsymbols++] = (ProfileSymbol){addr & ADDR_MASK, copy};
+    return true;
+}
+
+static void profile_sort_symbols(Profile *p)
+{
+    qsort(p->symbols, p->nsymbols, sizeof(ProfileSymbol), symbol_cmp);
+}
+
+/*
+    Symbol map as written by the assembler (asld in.vm out.bin out.sym):
+    one "LABEL 0xADDR" per line.
+*/
+bool profile_load_symbols(Profile *p, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char name[256];
+    unsigned long addr;
+    while (fscanf(f, "%255s %lx", name, &addr) == 2 && profile_add_symbol(p, name, (uint32_t)addr))
+        ;
+    fclose(f);
+
+    profile_sort_symbols(p);
+    return true;
+}
+
+// "LABEL+off" for the closest label at or below addr, "" without one
+static void profile_label(const Profile *p, uint32_t addr, char *buf, size_t size)
+{
+    const ProfileSymbol *best = NULL;
+    size_t lo = 0, hi = p->nsymbols;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (p->symbols[mid].addr <= addr) {
+            best = &p->symbols[mid];
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (!best)
+        buf[0] = '\0';
+    else if (best->addr == addr)
+        snprintf(buf, size, "%s", best->name);
+    else
+        snprintf(buf, size, "%s+%u", best->name, addr - best->addr);
+}
+
+static int count_desc(const void *a, const void *b)
+{
+    const uint64_t *x = a, *y = b; // {count, slot} pairs
+    return (x[0] < y[0]) - (x[0] > y[0]);
+}
+
+// Top entries of a per-slot table as {count, slot} pairs, returns how many
+static size_t profile_top(const uint64_t *table, uint64_t (*top)[2], size_t max)
+{
+    size_t n = 0;
+    for (size_t slot = 0; slot < MEMORY_SIZE / 2; slot++) {
+        if (!table[slot])
+            continue;
+        if (n < max) {
+            top[n][0] = table[slot];
+            top[n][1] = slot;
+            n++;
+            if (n == max)
+                qsort(top, n, sizeof(top[0]), count_desc);
+        } else if (table[slot] > top[max - 1][0]) {
+            top[max - 1][0] = table[slot];
+            top[max - 1][1] = slot;
+            qsort(top, n, sizeof(top[0]), count_desc);
+        }
+    }
+    qsort(top, n, sizeof(top[0]), count_desc);
+    return n;
+}
+
+void profile_report(CPU *cpu, FILE *f)
+{
+    Profile *p = cpu->profile;
+    uint64_t total = 0;
+    for (int i = 0; i < 16; i++)
+        total += p->op_count[i];
+
+    fprintf(f, "\n=== Profile: %llu instructions ===\n", (unsigned long long)total);
+
+    fprintf(f, "Opcodes:\n");
+    for (int i = 0; i < 16; i++) {
+        if (p->op_count[i])
+            fprintf(f, "  %-8s %12llu  %5.1f%%\n", op_names[i],
+                    (unsigned long long)p->op_count[i], 100.0 * (double)p->op_count[i] / (double)total);
+    }
+    fprintf(f, "EXT sub-opcodes:\n");
+    for (int i = 0; i < 8; i++) {
+        if (p->ext_count[i])
+            fprintf(f, "  %-8s %12llu  %5.1f%%\n", ext_names[i],
+                    (unsigned long long)p->ext_count[i], 100.0 * (double)p->ext_count[i] / (double)total);
+    }
+    fprintf(f, "EXT2 sub-opcodes:\n");
+    for (int i = 0; i < 8; i++) {
+        if (p->ext2_count[i])
+            fprintf(f, "  %-8s %12llu  %5.1f%%\n", ext2_names[i],
+                    (unsigned long long)p->ext2_count[i], 100.0 * (double)p->ext2_count[i] / (double)total);
+    }
+
+    uint64_t top[PROFILE_TOP][2];
+    char label[64], text[32];
+
+    fprintf(f, "Hot spots:\n");
+    size_t n = profile_top(p->pc_count, top, PROFILE_TOP);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t pc = (uint32_t)top[i][1] * 2;
+        profile_label(p, pc, label, sizeof(label));
+        disasm(mem_r16(cpu, pc), text, sizeof(text));
+        fprintf(f, "  0x%05X %-20s %-18s %12llu  %5.1f%%\n", pc, label, text,
+                (unsigned long long)top[i][0], 100.0 * (double)top[i][0] / (double)total);
+    }
+
+    fprintf(f, "Branches (taken / not taken):\n");
+    for (size_t slot = 0; slot < MEMORY_SIZE / 2; slot++) {
+        uint8_t op = mem_r8(cpu, (uint32_t)slot * 2 + 1) >> 4;
+        if (!p->pc_count[slot] || (op != OP_JZ && op != OP_JNZ && op != OP_FUSE))
+            continue;
+        uint32_t pc = (uint32_t)slot * 2;
+        const char *name = op == OP_FUSE ? fuse_names[(mem_r16(cpu, pc) >> 9) & 0x7] : op_names[op];
+        profile_label(p, pc, label, sizeof(label));
+        fprintf(f, "  0x%05X %-20s %-4s %12llu / %llu\n", pc, label, name,
+                (unsigned long long)p->taken[slot],
+                (unsigned long long)(p->pc_count[slot] - p->taken[slot]));
+    }
+
+    fprintf(f, "Call targets:\n");
+    n = profile_top(p->calls, top, PROFILE_TOP);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t pc = (uint32_t)top[i][1] * 2;
+        profile_label(p, pc, label, sizeof(label));
+        fprintf(f, "  0x%05X %-20s %12llu\n", pc, label, (unsigned long long)top[i][0]);
+    }
+    fprintf(f, "=================\n");
+}
+
+#else
+
+#define PROFILE(stmt) \
+    do {              \
+    } while (0)
+
+#endif
+
+#define VM_HUGE_PAGE ((size_t)2 << 20) // transparent huge page size on x86-64 and arm64
+
+static inline size_t vm_round_up(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+// Guest memory followed by the CPU struct itself, see cpu_create()
+#define VM_MAPPING_SIZE vm_round_up((size_t)MEMORY_SIZE + sizeof(CPU), VM_HUGE_PAGE)
+
+// Ask for huge pages on [p, p + size), a no-op where THP is off or unsupported
+static void vm_advise_huge(void *p, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#else
+    (void)p;
+    (void)size;
+#endif
+}
+
+/*
+    An anonymous mapping of size bytes (a multiple of VM_HUGE_PAGE) that
+    starts on a huge page boundary, so the kernel can back it with 2 MiB
+    pages: the whole 1 MiB guest space then costs one TLB entry instead of
+    256. size + VM_HUGE_PAGE is reserved and the misaligned ends unmapped.
+*/
+static uint8_t *vm_map_huge(size_t size)
+{
+    uint8_t *p = mmap(NULL, size + VM_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    uint8_t *start = (uint8_t *)vm_round_up((uintptr_t)p, VM_HUGE_PAGE);
+    if (start > p)
+        munmap(p, (size_t)(start - p));
+    munmap(start + size, (size_t)(p + VM_HUGE_PAGE - start));
+    vm_advise_huge(start, size);
+    return start;
+}
+
+static void cpu_init(CPU *cpu, uint8_t *mem)
+{
+    cpu->mem = mem;
+    cpu->pc = 0x0000;
+    cpu->sp = MEMORY_SIZE - 2; // Top of memory, aligned for 16-bit
+    cpu->flags = 0;
+    cpu->flag_res = 1; // Z = 0, S = 0
+    cpu->SR[SEG_SS] = SEG_SS_INITIAL;
+    cpu->halted = false;
+    cpu->faulted = false;
+    cpu->budget = INT64_MAX;
+    cpu->out.cap = OUTPUT_BUFFER_SIZE;
+    cpu->out.fd = STDOUT_FILENO;
+    cpu->in.stream = stdin;
+}
+
+/*
+    Guest memory and the CPU live in one anonymous mapping. The kernel hands
+    out zero pages on first touch, so creating a VM is a single mmap() no
+    matter how big MEMORY_SIZE is, and resident memory only grows with what
+    the guest actually touches (in huge pages where the kernel gives them
+    out). cpu->mem is page aligned, which also lets cpu_load_image() map
+    images straight into it.
+*/
+CPU *cpu_create(void)
+{
+    uint8_t *mem = vm_map_huge(VM_MAPPING_SIZE);
+    if (!mem)
+        return NULL;
+
+    CPU *cpu = (CPU *)(mem + MEMORY_SIZE);
+    cpu_init(cpu, mem);
+    cpu->mapping = VM_MAPPING_SIZE;
+    return cpu;
+}
+
+void cpu_destroy(CPU *cpu)
+{
+    if (cpu) {
+        cpu_record_finish(cpu);
+        cpu_flush_output(cpu);
+        free(cpu->out.buf);
+        in_release(&cpu->in);
+        jit_destroy(cpu->jit);
+        verified_release(cpu->verified);
+        bus_destroy(cpu->bus);
+        vm_zfree(cpu->icache, ICACHE_SIZE);
+        if (cpu->mapping)
+            munmap(cpu->mem, cpu->mapping);
+    }
+}
+
+/*
+    A batch of VMs meant to run side by side, e.g. on one Scheduler. On
+    their own, every CPU struct sits at the same offset past its own 1 MiB
+    memory, so siblings all compete for the same few cache sets; here the
+    structs are one array (a hot line each, see struct CPU) and the guest
+    memories are back to back in one huge-page-aligned mapping, followed by
+    that array.
+
+    cpu_destroy() on an arena CPU releases everything but its memory and
+    struct, arena_destroy() does the rest.
+*/
+typedef struct {
+    CPU *cpus;
+    size_t count;
+    uint8_t *base;
+    size_t size;
+} CpuArena;
+
+CpuArena *arena_create(size_t count)
+{
+    CpuArena *arena = calloc(1, sizeof(CpuArena));
+    if (!arena || count == 0) {
+        free(arena);
+        return NULL;
+    }
+
+    size_t mem = count * (size_t)MEMORY_SIZE;
+    arena->size = vm_round_up(mem + count * sizeof(CPU), VM_HUGE_PAGE);
+    arena->base = vm_map_huge(arena->size);
+    if (!arena->base) {
+        free(arena);
+        return NULL;
+    }
+
+    arena->count = count;
+    arena->cpus = (CPU *)(arena->base + mem);
+    for (size_t i = 0; i < count; i++)
+        cpu_init(&arena->cpus[i], arena->base + i * (size_t)MEMORY_SIZE);
+    return arena;
+}
+
+void arena_destroy(CpuArena *arena)
+{
+    if (arena) {
+        for (size_t i = 0; i < arena->count; i++)
+            cpu_destroy(&arena->cpus[i]);
+        munmap(arena->base, arena->size);
+        free(arena);
+    }
+}
+
+void stack_push16(CPU *cpu, uint16_t value)
+{
+    cpu->sp -= 2;
+    cpu_store16(cpu, cpu->sp, value);
+}
+
+uint16_t stack_pop16(CPU *cpu)
+{
+    uint16_t value = mem_r16(cpu, cpu->sp);
+    cpu->sp += 2;
+    return value;
+}
+
+// C and O for a pending FlagOp; base holds the already materialized bits
+static inline uint8_t lazy_carry_overflow(uint8_t op, uint16_t a, uint16_t b, uint8_t base)
+{
+    uint16_t result;
+
+    switch (op) {
+        case FLAGOP_ADD:
+            result = (uint16_t)(a + b);
+            return ((uint32_t)a + b > 0xFFFF ? FLAG_CARRY : 0) |
+                   ((~(a ^ b) & (a ^ result) & 0x8000) ? FLAG_OVERFLOW : 0);
+        case FLAGOP_SUB:
+            result = (uint16_t)(a - b);
+            return (a < b ? FLAG_CARRY : 0) |
+                   (((a ^ b) & (a ^ result) & 0x8000) ? FLAG_OVERFLOW : 0);
+        case FLAGOP_CMP:
+            return (a < b ? FLAG_CARRY : 0) | (base & FLAG_OVERFLOW);
+        default:
+            return base & (FLAG_CARRY | FLAG_OVERFLOW);
+    }
+}
+
+// Materialize FLAGS as the guest sees it
+uint8_t cpu_get_flags(CPU *cpu)
+{
+    return (cpu->flag_res == 0 ? FLAG_ZERO : 0) |
+           ((cpu->flag_res & 0x8000) ? FLAG_SIGN : 0) |
+           lazy_carry_overflow(cpu->flag_op, cpu->flag_a, cpu->flag_b, cpu->flags);
+}
+
+/*
+    Replace FLAGS wholesale. Z and S are both derived from one result, so the
+    (unreachable) Z=1 S=1 combination comes back as Z=1 S=0.
+*/
+void cpu_set_flags(CPU *cpu, uint8_t flags)
+{
+    cpu->flags = flags & (FLAG_CARRY | FLAG_OVERFLOW);
+    cpu->flag_op = FLAGOP_NONE;
+    cpu->flag_res = (flags & FLAG_ZERO) ? 0 : (flags & FLAG_SIGN) ? 0x8000 : 1;
+}
+
+void set_flag(CPU *cpu, uint8_t flag, bool value)
+{
+    uint8_t flags = cpu_get_flags(cpu);
+    cpu_set_flags(cpu, value ? (flags | flag) : (flags & ~flag));
+}
+
+bool get_flag(CPU *cpu, uint8_t flag)
+{
+    return (cpu_get_flags(cpu) & flag) != 0;
+}
+
+void update_flags(CPU *cpu, uint16_t result)
+{
+    cpu->flag_res = result;
+}
+
+// ADD/SUB overwrite C and O, so the pending record can simply be replaced
+static inline void record_flags(CPU *cpu, FlagOp op, uint16_t a, uint16_t b)
+{
+    cpu->flag_op = op;
+    cpu->flag_a = a;
+    cpu->flag_b = b;
+}
+
+// CMP keeps O, so a pending ADD/SUB has to be materialized first
+static inline void record_cmp(CPU *cpu, uint16_t a, uint16_t b)
+{
+    if (cpu->flag_op == FLAGOP_ADD || cpu->flag_op == FLAGOP_SUB)
+        cpu->flags = lazy_carry_overflow(cpu->flag_op, cpu->flag_a, cpu->flag_b, cpu->flags);
+    record_flags(cpu, FLAGOP_CMP, a, b);
+}
+
+/*
+    Result of an OP_EXT2 op, *co gets its C/O bits. The callers store them
+    with FLAGOP_NONE since none of these ops keeps the old C or O.
+*/
+static inline uint16_t ext2_eval(uint8_t op, uint16_t a, uint16_t b, uint8_t *co)
+{
+    uint32_t product = (uint32_t)a * b;
+    unsigned count = b & 0xF;
+
+    *co = 0;
+    switch (op) {
+        case EXT2_MUL:
+        case EXT2_MULH:
+            if (product > 0xFFFF)
+                *co = FLAG_CARRY | FLAG_OVERFLOW;
+            return op == EXT2_MUL ? (uint16_t)product : (uint16_t)(product >> 16);
+        case EXT2_DIV:
+            return b ? a / b : 0xFFFF;
+        case EXT2_MOD:
+            return b ? a % b : a;
+        case EXT2_SHL:
+            if (count && ((a >> (16 - count)) & 1))
+                *co = FLAG_CARRY;
+            return (uint16_t)(a << count);
+        case EXT2_SHR:
+            if (count && ((a >> (count - 1)) & 1))
+                *co = FLAG_CARRY;
+            return a >> count;
+        default: // EXT2_SAR
+            if (count && ((a >> (count - 1)) & 1))
+                *co = FLAG_CARRY;
+            return (uint16_t)((int16_t)a >> count);
+    }
+}
+
+/*
+    Block ops run on host memcpy/memset/memcmp/memchr, which are vectorized,
+    over each piece of a range that doesn't cross the MEMORY_SIZE wrap.
+*/
+
+// Bytes from addr up to the wrap, at most len
+static inline uint32_t mem_span(uint32_t addr, uint32_t len)
+{
+    uint32_t room = MEMORY_SIZE - (addr & ADDR_MASK);
+    return len < room ? len : room;
+}
+
+static void mem_fill(CPU *cpu, uint32_t dst, uint8_t value, uint32_t len)
+{
+    while (len) {
+        uint32_t n = mem_span(dst, len);
+        memset(cpu->mem + (dst & ADDR_MASK), value, n);
+        icache_invalidate(cpu, dst, n);
+        dst += n;
+        len -= n;
+    }
+}
+
+// Host bytes into guest memory at dst, the caller invalidates
+static void mem_write(CPU *cpu, uint32_t dst, const void *src, uint32_t len)
+{
+    const uint8_t *p = src;
+    while (len) {
+        uint32_t n = mem_span(dst, len);
+        memcpy(cpu->mem + (dst & ADDR_MASK), p, n);
+        p += n;
+        dst += n;
+        len -= n;
+    }
+}
+
+static void mem_copy(CPU *cpu, uint32_t dst, uint32_t src, uint32_t len)
+{
+    if (mem_span(dst, len) == len && mem_span(src, len) == len) {
+        memmove(cpu->mem + (dst & ADDR_MASK), cpu->mem + (src & ADDR_MASK), len);
+    } else if (((dst - src) & ADDR_MASK) < len) {
+        // dst overlaps the tail of src around the wrap: copy backwards
+        for (uint32_t i = len; i-- > 0;)
+            mem_w8(cpu, dst + i, mem_r8(cpu, src + i));
+    } else {
+        for (uint32_t i = 0; i < len; i++)
+            mem_w8(cpu, dst + i, mem_r8(cpu, src + i));
+    }
+    for (uint32_t done = 0; done < len;) {
+        uint32_t n = mem_span(dst + done, len - done);
+        icache_invalidate(cpu, dst + done, n);
+        done += n;
+    }
+}
+
+// Offset of the first differing byte, len if there is none
+static uint32_t mem_compare(CPU *cpu, uint32_t a, uint32_t b, uint32_t len)
+{
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t n = mem_span(b + done, mem_span(a + done, len - done));
+        const uint8_t *pa = cpu->mem + ((a + done) & ADDR_MASK);
+        const uint8_t *pb = cpu->mem + ((b + done) & ADDR_MASK);
+        if (memcmp(pa, pb, n) != 0) {
+            while (*pa == *pb)
+                pa++, pb++, done++;
+            return done;
+        }
+        done += n;
+    }
+    return len;
+}
+
+static uint32_t mem_strlen(CPU *cpu, uint32_t addr, uint32_t max)
+{
+    uint32_t done = 0;
+    while (done < max) {
+        uint32_t n = mem_span(addr + done, max - done);
+        const uint8_t *p = cpu->mem + ((addr + done) & ADDR_MASK);
+        const uint8_t *nul = memchr(p, 0, n);
+        if (nul)
+            return done + (uint32_t)(nul - p);
+        done += n;
+    }
+    return max;
+}
+
+// Guest bytes [addr, addr + len) to the guest's output, wrapping like mem_r8()
+static void mem_print(CPU *cpu, uint32_t addr, uint32_t len)
+{
+    while (len) {
+        uint32_t n = mem_span(addr, len);
+        out_write(&cpu->out, (const char *)cpu->mem + (addr & ADDR_MASK), n);
+        addr += n;
+        len -= n;
+    }
+}
+
+static void cpu_block_op(CPU *cpu, uint8_t op, uint8_t reg1, uint8_t reg2)
+{
+    uint32_t a = seg_addr(cpu, SEG_ES, cpu->regs[reg1]);
+    uint32_t b = seg_addr(cpu, SEG_DS, cpu->regs[reg2]);
+    uint32_t len = cpu->regs[BLOCK_COUNT_REG];
+
+    switch (op) {
+        case BLOCK_COPY:
+            mem_copy(cpu, a, b, len);
+            cpu->counters.bytes_loaded += len;
+            cpu->counters.bytes_stored += len;
+            break;
+        case BLOCK_FILL:
+            mem_fill(cpu, a, cpu->regs[reg2] & 0xFF, len);
+            cpu->counters.bytes_stored += len;
+            break;
+        case BLOCK_CMP: {
+            uint32_t i = mem_compare(cpu, a, b, len);
+            uint8_t x = i < len ? mem_r8(cpu, a + i) : 0;
+            uint8_t y = i < len ? mem_r8(cpu, b + i) : 0;
+            record_cmp(cpu, x, y);
+            update_flags(cpu, (uint16_t)(x - y));
+            cpu->counters.bytes_loaded += 2 * (uint64_t)(i < len ? i + 1 : len); // through the difference
+            break;
+        }
+        case BLOCK_STRLEN: {
+            uint32_t n = mem_strlen(cpu, b, 0xFFFF);
+            cpu->regs[reg1] = (uint16_t)n;
+            update_flags(cpu, cpu->regs[reg1]);
+            cpu->counters.bytes_loaded += n < 0xFFFF ? n + 1 : n; // and the NUL
+            break;
+        }
+        case BLOCK_SETSEG:
+            cpu->SR[reg2 & 3] = cpu->regs[reg1];
+            if ((reg2 & 3) == SEG_SS)
+                cpu->sp = seg_addr(cpu, SEG_SS, 0xFFFE);
+            break;
+        case BLOCK_GETSEG:
+            cpu->regs[reg1] = cpu->SR[reg2 & 3];
+            break;
+        default:
+            out_printf(&cpu->out, "Unknown block opcode: 0x%X\n", op);
+            cpu_flush_output(cpu);
+            cpu->halted = true;
+            cpu->faulted = true;
+            break;
+    }
+}
+
+/*
+ * =====================================
+ *              DEVICE BUS
+ * =====================================
+ */
+
+/*
+    Devices are opt-in windows of word registers in the 16-bit data space,
+    attached with cpu_attach_device(). Only EXT_LOAD/EXT_STORE go through the
+    bus; instruction fetch, the stack and block ops always see plain memory,
+    and so does any access while no device is attached.
+
+    Every device drives the same descriptor queue: the guest fills 8-byte
+    descriptors {cmd, addr, len, arg} in a power-of-two ring in guest memory
+    and then writes HEAD. That one doorbell store runs every descriptor from
+    TAIL up to HEAD, so a batch costs one bus exit (and for the console one
+    writev()) rather than one per byte. A finished descriptor has DESC_DONE,
+    plus DESC_ERROR on failure, or'ed into cmd and the bytes moved in len.
+
+    Devices only see the 16-bit data space: the ring, its descriptors and the
+    buffers they point at wrap from 0xFFFF to 0, through the DEV_ADDR_MASK
+    helpers below, instead of running on into memory past 64 KiB.
+*/
+
+#define BUS_MAX_DEVICES 8
+#define DEVICE_WINDOW 0x20   // bytes of register space per device
+#define DEV_ADDR_MASK 0xFFFF // what devices address, see above
+
+// Register offsets every device shares
+enum {
+    DEV_RING = 0x0,   // ring address
+    DEV_SIZE = 0x2,   // ring entries, a power of two
+    DEV_HEAD = 0x4,   // free-running count the guest has queued, writing it rings the doorbell
+    DEV_TAIL = 0x6,   // free-running count the device has finished (read-only)
+    DEV_ERRORS = 0x8, // failed descriptors since the last write to it
+    DEV_REGS = 0xA,   // first device-specific register
+};
+
+#define DESC_SIZE 8
+#define DESC_DONE 0x8000
+#define DESC_ERROR 0x4000
+
+#define DEV_CONSOLE_BASE 0xFF00
+#define DEV_TIMER_BASE 0xFF20
+#define DEV_BLOCK_BASE 0xFF40
+#define DEV_DMA_BASE 0xFF60
+
+typedef enum {
+    CON_DATA = DEV_REGS, // write: one character out, read: one character in (0xFFFF at EOF)
+} ConsoleReg;
+
+typedef enum {
+    CON_WRITE = 0x1, // len bytes from addr to the output channel
+    CON_READ = 0x2,  // up to len bytes of input to addr
+} ConsoleCmd;
+
+typedef enum {
+    TIMER_LO = DEV_REGS,     // microseconds since the device was created, reading it latches HI
+    TIMER_HI = DEV_REGS + 2, // upper half as of the last TIMER_LO read
+} TimerReg;
+
+typedef enum {
+    TIMER_STAMP = 0x1, // the current 32-bit count, little-endian, to addr (len >= 4)
+} TimerCmd;
+
+typedef enum {
+    BLK_SECTORS = DEV_REGS, // disk size in BLK_SECTOR_SIZE sectors (read-only)
+} BlockReg;
+
+typedef enum {
+    BLK_READ = 0x1,  // len bytes from sector arg to addr
+    BLK_WRITE = 0x2, // len bytes from addr to sector arg
+} BlockCmd;
+
+#define BLK_SECTOR_SIZE 512
+
+typedef enum {
+    DMA_COPY = 0x1, // len bytes from arg to addr, overlap-safe
+    DMA_FILL = 0x2, // len copies of the low byte of arg to addr
+} DmaCmd;
+
+typedef struct Device Device;
+
+struct Device {
+    const char *name;
+    uint16_t base;
+    // Device-specific registers, offset >= DEV_REGS; either may be NULL
+    uint16_t (*read)(CPU *cpu, Device *dev, uint16_t offset);
+    void (*write)(CPU *cpu, Device *dev, uint16_t offset, uint16_t value);
+    // Run one descriptor, returns the bytes moved or -1 on failure
+    int32_t (*run)(CPU *cpu, Device *dev, uint16_t cmd, uint16_t addr, uint16_t len, uint16_t arg);
+    void (*destroy)(Device *dev);
+    uint16_t ring;
+    uint16_t size;
+    uint16_t head;
+    uint16_t tail;
+    uint16_t errors;
+};
+
+struct DeviceBus {
+    Device *devices[BUS_MAX_DEVICES];
+    size_t count;
+};
+
+// Whether the word at addr (a full address) touches a window; devices only ever sit below 64 KiB
+static inline bool mmio_hit(CPU *cpu, uint32_t addr)
+{
+    return addr - cpu->mmio_base < cpu->mmio_size ||
+           ((addr + 1) & ADDR_MASK) - cpu->mmio_base < cpu->mmio_size;
+}
+
+static Device *bus_find(CPU *cpu, uint16_t addr)
+{
+    for (size_t i = 0; i < cpu->bus->count; i++) {
+        Device *dev = cpu->bus->devices[i];
+        if ((uint16_t)(addr - dev->base) < DEVICE_WINDOW)
+            return dev;
+    }
+    return NULL;
+}
+
+// Bytes from addr up to the devices' 0xFFFF wrap, at most len
+static inline uint32_t dev_span(uint32_t addr, uint32_t len)
+{
+    uint32_t room = DEV_ADDR_MASK + 1 - (addr & DEV_ADDR_MASK);
+    return len < room ? len : room;
+}
+
+static uint16_t dev_r16(CPU *cpu, uint32_t addr)
+{
+    return (uint16_t)(mem_r8(cpu, addr & DEV_ADDR_MASK) | mem_r8(cpu, (addr + 1) & DEV_ADDR_MASK) << 8);
+}
+
+static void dev_w16(CPU *cpu, uint32_t addr, uint16_t value)
+{
+    addr &= DEV_ADDR_MASK;
+    if (addr != DEV_ADDR_MASK) {
+        cpu_store16(cpu, addr, value);
+        return;
+    }
+    mem_w8(cpu, addr, value & 0xFF);
+    mem_w8(cpu, 0, value >> 8);
+    icache_invalidate(cpu, addr, 1);
+    icache_invalidate(cpu, 0, 1);
+}
+
+static void device_doorbell(CPU *cpu, Device *dev)
+{
+    uint16_t pending = dev->head - dev->tail;
+    if (dev->size == 0 || pending > dev->size) {
+        // Nothing to run it on, or HEAD lapped the ring: drop the batch
+        dev->errors += pending;
+        dev->tail = dev->head;
+        return;
+    }
+
+    for (; dev->tail != dev->head; dev->tail++) {
+        uint32_t desc = dev->ring + (uint32_t)(dev->tail & (dev->size - 1)) * DESC_SIZE;
+        uint16_t cmd = dev_r16(cpu, desc);
+        uint16_t addr = dev_r16(cpu, desc + 2);
+        uint16_t len = dev_r16(cpu, desc + 4);
+        uint16_t arg = dev_r16(cpu, desc + 6);
+
+        int32_t moved = dev->run ? dev->run(cpu, dev, cmd, addr, len, arg) : -1;
+        if (moved < 0) {
+            dev->errors++;
+            dev_w16(cpu, desc, cmd | DESC_DONE | DESC_ERROR);
+            dev_w16(cpu, desc + 4, 0);
+        } else {
+            dev_w16(cpu, desc, cmd | DESC_DONE);
+            dev_w16(cpu, desc + 4, (uint16_t)moved);
+        }
+    }
+}
+
+static uint16_t bus_read(CPU *cpu, uint16_t addr)
+{
+    Device *dev = bus_find(cpu, addr);
+    if (!dev)
+        // A gap between windows is still RAM, but not a word that runs into one
+        return bus_find(cpu, addr + 1) ? 0xFFFF : mem_r16(cpu, addr);
+
+    uint16_t offset = (addr - dev->base) & ~1;
+    switch (offset) {
+        case DEV_RING:
+            return dev->ring;
+        case DEV_SIZE:
+            return dev->size;
+        case DEV_HEAD:
+            return dev->head;
+        case DEV_TAIL:
+            return dev->tail;
+        case DEV_ERRORS:
+            return dev->errors;
+    }
+    return dev->read ? dev->read(cpu, dev, offset) : 0xFFFF;
+}
+
+static void bus_write(CPU *cpu, uint16_t addr, uint16_t value)
+{
+    Device *dev = bus_find(cpu, addr);
+    if (!dev) {
+        if (!bus_find(cpu, addr + 1))
+            cpu_store16(cpu, addr, value);
+        return;
+    }
+
+    uint16_t offset = (addr - dev->base) & ~1;
+    switch (offset) {
+        case DEV_RING:
+            dev->ring = value;
+            dev->head = dev->tail = 0;
+            break;
+        case DEV_SIZE:
+            // Not a power of two: the queue is off until a valid size is set
+            dev->size = (value & (value - 1)) ? 0 : value;
+            dev->head = dev->tail = 0;
+            break;
+        case DEV_HEAD:
+            dev->head = value;
+            device_doorbell(cpu, dev);
+            break;
+        case DEV_TAIL:
+            break;
+        case DEV_ERRORS:
+            dev->errors = 0;
+            break;
+        default:
+            if (dev->write)
+                dev->write(cpu, dev, offset, value);
+            break;
+    }
+}
+
+/*
+    Attach dev at dev->base. The CPU owns it from then on, it is destroyed
+    with the CPU. Compiled JIT blocks assumed no devices, so they are dropped.
+*/
+bool cpu_attach_device(CPU *cpu, Device *dev)
+{
+    if (!cpu->bus && (cpu->bus = calloc(1, sizeof(DeviceBus))) == NULL)
+        return false;
+
+    DeviceBus *bus = cpu->bus;
+    if (bus->count == BUS_MAX_DEVICES) {
+        fprintf(stderr, "Device %s: bus is full\n", dev->name);
+        return false;
+    }
+    if ((uint32_t)dev->base + DEVICE_WINDOW > 0x10000) {
+        fprintf(stderr, "Device %s: window at 0x%04X runs past 0xFFFF\n", dev->name, dev->base);
+        return false;
+    }
+    for (size_t i = 0; i < bus->count; i++) {
+        if ((uint16_t)(dev->base - bus->devices[i]->base) < DEVICE_WINDOW ||
+            (uint16_t)(bus->devices[i]->base - dev->base) < DEVICE_WINDOW) {
+            fprintf(stderr, "Device %s overlaps %s at 0x%04X\n", dev->name,
+                    bus->devices[i]->name, bus->devices[i]->base);
+            return false;
+        }
+    }
+    bus->devices[bus->count++] = dev;
+
+    uint32_t low = 0xFFFF, high = 0;
+    for (size_t i = 0; i < bus->count; i++) {
+        if (bus->devices[i]->base < low)
+            low = bus->devices[i]->base;
+        if ((uint32_t)bus->devices[i]->base + DEVICE_WINDOW > high)
+            high = (uint32_t)bus->devices[i]->base + DEVICE_WINDOW;
+    }
+    cpu->mmio_base = (uint16_t)low;
+    cpu->mmio_size = high - low;
+
+    if (cpu->jit)
+        jit_reset(cpu->jit);
+    return true;
+}
+
+static void bus_destroy(DeviceBus *bus)
+{
+    if (!bus)
+        return;
+    for (size_t i = 0; i < bus->count; i++)
+        bus->devices[i]->destroy(bus->devices[i]);
+    free(bus);
+}
+
+static void device_free(Device *dev)
+{
+    free(dev);
+}
+
+static Device *device_alloc(size_t size, const char *name, uint16_t base)
+{
+    Device *dev = calloc(1, size);
+    if (dev) {
+        dev->name = name;
+        dev->base = base;
+        dev->destroy = device_free;
+    }
+    return dev;
+}
+
+// ---- console: the VM's own output channel and input stream ----
+
+static uint16_t console_read(CPU *cpu, Device *dev, uint16_t offset)
+{
+    (void)dev;
+    if (offset != CON_DATA)
+        return 0xFFFF;
+    if (!cpu->in.data)
+        cpu_flush_output(cpu); // prompts have to be visible before we block
+    int c = in_getc(&cpu->in);
+    if (c == EOF)
+        return 0xFFFF;
+    cpu->counters.io_in++;
+    return (uint16_t)c;
+}
+
+static void console_write(CPU *cpu, Device *dev, uint16_t offset, uint16_t value)
+{
+    (void)dev;
+    if (offset == CON_DATA) {
+        out_char(&cpu->out, (char)value);
+        cpu->counters.io_out++;
+    }
+}
+
+static int32_t console_run(CPU *cpu, Device *dev, uint16_t cmd, uint16_t addr, uint16_t len, uint16_t arg)
+{
+    (void)dev;
+    (void)arg;
+    uint32_t done = 0;
+
+    switch (cmd) {
+        case CON_WRITE:
+            while (done < len) {
+                uint32_t n = dev_span(addr + done, len - done);
+                mem_print(cpu, (addr + done) & DEV_ADDR_MASK, n);
+                done += n;
+            }
+            cpu->counters.io_out += len;
+            return len;
+        case CON_READ:
+            if (!cpu->in.data)
+                cpu_flush_output(cpu);
+            while (done < len) {
+                uint32_t at = (addr + done) & DEV_ADDR_MASK, n = dev_span(at, len - done);
+                size_t got = in_read(&cpu->in, cpu->mem + at, n);
+                icache_invalidate(cpu, at, (uint32_t)got);
+                done += (uint32_t)got;
+                if (got < n)
+                    break; // EOF or error: a short read
+            }
+            cpu->counters.io_in += done;
+            return (int32_t)done;
+    }
+    return -1;
+}
+
+Device *device_console_create(uint16_t base)
+{
+    Device *dev = device_alloc(sizeof(Device), "console", base);
+    if (dev) {
+        dev->read = console_read;
+        dev->write = console_write;
+        dev->run = console_run;
+    }
+    return dev;
+}
+
+// ---- timer: a free-running microsecond counter ----
+
+typedef struct {
+    Device dev;
+    uint64_t start_ns;
+    uint16_t latch; // TIMER_HI
+} TimerDevice;
+
+static uint64_t timer_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t timer_count(TimerDevice *t)
+{
+    return (uint32_t)((timer_now_ns() - t->start_ns) / 1000);
+}
+
+static uint16_t timer_read(CPU *cpu, Device *dev, uint16_t offset)
+{
+    (void)cpu;
+    TimerDevice *t = (TimerDevice *)dev;
+
+    switch (offset) {
+        case TIMER_LO: {
+            uint32_t count = timer_count(t);
+            t->latch = count >> 16;
+            return count & 0xFFFF;
+        }
+        case TIMER_HI:
+            return t->latch;
+    }
+    return 0xFFFF;
+}
+
+static int32_t timer_run(CPU *cpu, Device *dev, uint16_t cmd, uint16_t addr, uint16_t len, uint16_t arg)
+{
+    (void)arg;
+    if (cmd != TIMER_STAMP || len < 4)
+        return -1;
+
+    uint32_t count = timer_count((TimerDevice *)dev);
+    dev_w16(cpu, addr, count & 0xFFFF);
+    dev_w16(cpu, (uint32_t)addr + 2, count >> 16);
+    return 4;
+}
+
+Device *device_timer_create(uint16_t base)
+{
+    TimerDevice *t = (TimerDevice *)device_alloc(sizeof(TimerDevice), "timer", base);
+    if (t) {
+        t->dev.read = timer_read;
+        t->dev.run = timer_run;
+        t->start_ns = timer_now_ns();
+    }
+    return t ? &t->dev : NULL;
+}
+
+// ---- block device: a fixed-size host file in BLK_SECTOR_SIZE sectors ----
+
+typedef struct {
+    Device dev;
+    int fd;
+    off_t size;
+} BlockDevice;
+
+static uint16_t block_read(CPU *cpu, Device *dev, uint16_t offset)
+{
+    (void)cpu;
+    BlockDevice *b = (BlockDevice *)dev;
+    if (offset != BLK_SECTORS)
+        return 0xFFFF;
+    off_t sectors = b->size / BLK_SECTOR_SIZE;
+    return sectors > 0xFFFF ? 0xFFFF : (uint16_t)sectors;
+}
+
+static int32_t block_run(CPU *cpu, Device *dev, uint16_t cmd, uint16_t addr, uint16_t len, uint16_t arg)
+{
+    BlockDevice *b = (BlockDevice *)dev;
+    off_t pos = (off_t)arg * BLK_SECTOR_SIZE;
+    uint32_t done = 0;
+
+    if ((cmd != BLK_READ && cmd != BLK_WRITE) || pos + len > b->size)
+        return -1;
+
+    while (done < len) {
+        uint32_t at = (addr + done) & DEV_ADDR_MASK, n = dev_span(at, len - done);
+        ssize_t got = cmd == BLK_READ ? pread(b->fd, cpu->mem + at, n, pos + done)
+                                      : pwrite(b->fd, cpu->mem + at, n, pos + done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        if (cmd == BLK_READ)
+            icache_invalidate(cpu, at, (uint32_t)got);
+        done += (uint32_t)got;
+    }
+    return (int32_t)done;
+}
+
+static void block_destroy(Device *dev)
+{
+    close(((BlockDevice *)dev)->fd);
+    free(dev);
+}
+
+// The file is opened read-write and keeps its size, guest writes go straight to it
+Device *device_block_open(uint16_t base, const char *path)
+{
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open disk %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    BlockDevice *b = (BlockDevice *)device_alloc(sizeof(BlockDevice), "block", base);
+    if (!b) {
+        close(fd);
+        return NULL;
+    }
+    b->dev.read = block_read;
+    b->dev.run = block_run;
+    b->dev.destroy = block_destroy;
+    b->fd = fd;
+    b->size = st.st_size;
+    return &b->dev;
+}
+
+// ---- DMA engine: guest-to-guest copies and fills off the instruction stream ----
+
+// mem_copy() with both ranges wrapping at 0xFFFF instead
+static void dma_copy(CPU *cpu, uint16_t dst, uint16_t src, uint16_t len)
+{
+    if (dev_span(dst, len) == len && dev_span(src, len) == len) {
+        mem_copy(cpu, dst, src, len);
+        return;
+    }
+    // dst overlapping the tail of src has to be copied backwards
+    bool backwards = (uint16_t)(dst - src) < len;
+    for (uint32_t k = 0; k < len; k++) {
+        uint32_t i = backwards ? len - 1u - k : k;
+        mem_w8(cpu, (dst + i) & DEV_ADDR_MASK, mem_r8(cpu, (src + i) & DEV_ADDR_MASK));
+    }
+    for (uint32_t done = 0; done < len;) {
+        uint32_t n = dev_span(dst + done, len - done);
+        icache_invalidate(cpu, (dst + done) & DEV_ADDR_MASK, n);
+        done += n;
+    }
+}
+
+static int32_t dma_run(CPU *cpu, Device *dev, uint16_t cmd, uint16_t addr, uint16_t len, uint16_t arg)
+{
+    (void)dev;
+    switch (cmd) {
+        case DMA_COPY:
+            dma_copy(cpu, addr, arg, len);
+            return len;
+        case DMA_FILL:
+            for (uint32_t done = 0; done < len;) {
+                uint32_t n = dev_span(addr + done, len - done);
+                mem_fill(cpu, (addr + done) & DEV_ADDR_MASK, arg & 0xFF, n);
+                done += n;
+            }
+            return len;
+    }
+    return -1;
+}
+
+Device *device_dma_create(uint16_t base)
+{
+    Device *dev = device_alloc(sizeof(Device), "dma", base);
+    if (dev)
+        dev->run = dma_run;
+    return dev;
+}
+
+uint16_t fetch_instruction(CPU *cpu)
+{
+    uint16_t instr = mem_r16(cpu, cpu->pc);
+    cpu->pc += 2;
+    return instr;
+}
+
+// fetch_instruction(), in verified code pc and pc + 1 are inside the code so it can't wrap
+static inline uint16_t cpu_fetch(CPU *cpu, bool verified)
+{
+#if VM_LITTLE_ENDIAN
+    if (verified) {
+        uint16_t instr;
+        memcpy(&instr, cpu->mem + cpu->pc, sizeof(instr));
+        cpu->pc += 2;
+        return instr;
+    }
+#endif
+    return fetch_instruction(cpu);
+}
+
+// Register jump and call target, CS is 0 throughout verified code
+static inline uint32_t cpu_code_addr(const CPU *cpu, bool verified, uint16_t offset)
+{
+    return verified ? offset : seg_addr(cpu, SEG_CS, offset);
+}
+
+// After a guest write: whether the code is still verified (see icache_invalidate())
+static inline bool cpu_intact(const CPU *cpu, bool verified)
+{
+    return !verified || cpu->verified;
+}
+
+// After a jump through a register or a RET: whether it landed on verified code
+static inline bool cpu_landed(const CPU *cpu, bool verified)
+{
+    return !verified || (cpu->verified && verified_start(cpu->verified, cpu->pc));
+}
+
+/*
+    One instruction. With verified set pc is known to be an instruction
+    cpu_verify() reached (see cpu_run_verified()): the fetch can't wrap,
+    every opcode is one of the cases, relative jumps stay in the code and CS
+    is 0. Jumps through a register and RET still land wherever the register
+    or the stack says, so those check the target and return false if it
+    wasn't reached, as do HALT, parking on input and anything that may have
+    written the code; the caller then leaves the unchecked loop.
+*/
+static inline __attribute__((always_inline)) bool cpu_exec(CPU *cpu, bool verified)
+{
+    if (!verified && cpu->halted)
+        return false;
+
+    uint16_t instr = cpu_fetch(cpu, verified);
+    uint8_t opcode = (instr >> 12) & 0xF;
+    uint8_t dst = (instr >> 9) & 0x7;
+    uint8_t src = (instr >> 6) & 0x7;
+    uint16_t imm9 = instr & 0x1FF;
+
+    PROFILE(profile_instr(cpu->profile, cpu->pc - 2, instr));
+
+    switch (opcode) {
+        case OP_HALT:
+            cpu->halted = true;
+            out_printf(&cpu->out, "CPU Stopped at PC: 0x%05X\n", cpu->pc - 2);
+            cpu_flush_output(cpu);
+            return false;
+
+        case OP_NOP:
+            break;
+
+        case OP_MOV:
+            cpu->regs[dst] = cpu->regs[src];
+            update_flags(cpu, cpu->regs[dst]);
+            break;
+
+        case OP_MOVI:
+            // Sign-extend 9-bit immediate
+            cpu->regs[dst] = (imm9 & 0x100) ? (imm9 | 0xFE00) : imm9;
+            update_flags(cpu, cpu->regs[dst]);
+            break;
+
+        case OP_CMP: {
+            // Compare: SUB but don't store result
+            uint32_t result = (uint32_t)cpu->regs[dst] - (uint32_t)cpu->regs[src];
+            record_cmp(cpu, cpu->regs[dst], cpu->regs[src]);
+            update_flags(cpu, result & 0xFFFF);
+            break;
+        }
+
+        case OP_JMP:
+            // Jump to address in register
+            cpu->pc = cpu_code_addr(cpu, verified, cpu->regs[dst]);
+            cpu->counters.branches++;
+            return cpu_landed(cpu, verified);
+
+        case OP_JZ:
+            // Jump if zero flag is set (Z only needs the last result)
+            if (cpu->flag_res == 0) {
+                PROFILE(cpu->profile->taken[((cpu->pc - 2) & ADDR_MASK) >> 1]++);
+                cpu->pc = cpu_code_addr(cpu, verified, cpu->regs[dst]);
+                cpu->counters.branches++;
+                return cpu_landed(cpu, verified);
+            }
+            break;
+
+        case OP_JNZ:
+            // Jump if NOT zero
+            if (cpu->flag_res != 0) {
+                PROFILE(cpu->profile->taken[((cpu->pc - 2) & ADDR_MASK) >> 1]++);
+                cpu->pc = cpu_code_addr(cpu, verified, cpu->regs[dst]);
+                cpu->counters.branches++;
+                return cpu_landed(cpu, verified);
+            }
+            break;
+
+        case OP_PUSH:
+            stack_push16(cpu, cpu->regs[dst]);
+            return cpu_intact(cpu, verified);
+
+        case OP_POP:
+            cpu->regs[dst] = stack_pop16(cpu);
+            update_flags(cpu, cpu->regs[dst]);
+            break;
+
+        case OP_CALL:
+            // Push return address (next instruction)
+            stack_push16(cpu, cpu->pc & 0xFFFF); // Low 16 bits
+            stack_push16(cpu, cpu->pc >> 16);    // High bits
+            cpu->pc = cpu_code_addr(cpu, verified, cpu->regs[dst]);
+            cpu->counters.calls++;
+            PROFILE(cpu->profile->calls[cpu->pc >> 1]++);
+            return cpu_landed(cpu, verified);
+
+        case OP_STDOUT: {
+            if (dst == 0) {
+                // String follows immediately after this instruction. Strings
+                // are bounded and wrap like every other access: past the top
+                // of guest memory may be another VM's, see arena_create()
+                uint32_t len = mem_strlen(cpu, cpu->pc, STDOUT_STRING_MAX);
+                mem_print(cpu, cpu->pc, len);
+                cpu->counters.io_out += len;
+                cpu->pc += len + 1; // Skip string + null terminator
+                // Align to 2-byte boundary
+                if (cpu->pc & 1)
+                    cpu->pc++;
+            } else if (dst == 1) {
+                // Print register value as number
+                cpu->counters.io_out += out_int16(&cpu->out, (int16_t)cpu->regs[src]);
+            } else if (dst == 2) {
+                // Print string from memory address stored in SRC register
+                uint32_t addr = seg_addr(cpu, SEG_DS, cpu->regs[src]);
+                uint32_t len = mem_strlen(cpu, addr, STDOUT_STRING_MAX);
+                mem_print(cpu, addr, len);
+                cpu->counters.io_out += len;
+            } else if (dst == 3) {
+                out_char(&cpu->out, (char)(cpu->regs[src] & 0xFF));
+                cpu->counters.io_out++;
+            }
+
+            break;
+        }
+
+        case OP_STDIN: {
+            if (!in_ready(&cpu->in)) {
+                // Park on this instruction, cpu_run_for() says RUN_WAITING
+                cpu->pc -= 2;
+                cpu->waiting = true;
+                return false;
+            }
+
+            // dst field: 0 = read string into memory address in src register
+            //            1 = read number into src register
+            // src field: register to store in
+
+            // Prompts have to be visible before we block on input
+            if (!cpu->in.data)
+                cpu_flush_output(cpu);
+
+            if (dst == 0) {
+                uint32_t addr = seg_addr(cpu, SEG_DS, cpu->regs[src]);
+                char buf[STDIN_LINE_MAX + 1];
+                const char *line;
+                size_t len;
+
+                if (in_line(&cpu->in, buf, &line, &len)) {
+                    // trim the newline, the copy is NUL-terminated in guest memory
+                    if (len > 0 && line[len - 1] == '\n')
+                        len--;
+                    mem_write(cpu, addr, line, (uint32_t)len);
+                    mem_w8(cpu, addr + len, 0);
+                    icache_invalidate(cpu, addr, (uint32_t)len + 1);
+                    cpu->counters.io_in += len;
+                    return cpu_intact(cpu, verified);
+                }
+            } else {
+                uint16_t value;
+                if (in_number(&cpu->in, &value)) {
+                    cpu->regs[src] = value;
+                    update_flags(cpu, cpu->regs[src]);
+                    cpu->counters.io_in += 2;
+                }
+            }
+            break;
+        }
+
+        case OP_EXT: {
+            uint8_t ext_op = dst;              // Bits 9-11 = extended opcode
+            uint8_t reg1 = src;                // Bits 6-8 = first register
+            uint8_t reg2 = (instr >> 3) & 0x7; // Bits 3-5 = second register
+
+            switch (ext_op) {
+                case EXT_ADD: {
+                    uint32_t result = (uint32_t)cpu->regs[reg1] + (uint32_t)cpu->regs[reg2];
+                    record_flags(cpu, FLAGOP_ADD, cpu->regs[reg1], cpu->regs[reg2]);
+                    cpu->regs[reg1] = result & 0xFFFF;
+                    update_flags(cpu, cpu->regs[reg1]);
+                    break;
+                }
+
+                case EXT_SUB: {
+                    uint32_t result = (uint32_t)cpu->regs[reg1] - (uint32_t)cpu->regs[reg2];
+                    record_flags(cpu, FLAGOP_SUB, cpu->regs[reg1], cpu->regs[reg2]);
+                    cpu->regs[reg1] = result & 0xFFFF;
+                    update_flags(cpu, cpu->regs[reg1]);
+                    break;
+                }
+
+                case EXT_AND:
+                    cpu->regs[reg1] &= cpu->regs[reg2];
+                    update_flags(cpu, cpu->regs[reg1]);
+                    break;
+
+                case EXT_OR:
+                    cpu->regs[reg1] |= cpu->regs[reg2];
+                    update_flags(cpu, cpu->regs[reg1]);
+                    break;
+
+                case EXT_XOR:
+                    cpu->regs[reg1] ^= cpu->regs[reg2];
+                    update_flags(cpu, cpu->regs[reg1]);
+                    break;
+
+                case EXT_RET: {
+                    uint32_t high = stack_pop16(cpu) & (ADDR_MASK >> 16);
+                    uint32_t low = stack_pop16(cpu);
+                    cpu->pc = (high << 16) | low;
+                    cpu->counters.returns++;
+                    return cpu_landed(cpu, verified);
+                }
+
+                case EXT_LOAD: {
+                    uint32_t addr = seg_addr(cpu, SEG_DS, cpu->regs[reg2]);
+                    cpu->counters.bytes_loaded += 2;
+                    if (mmio_hit(cpu, addr)) {
+                        cpu->regs[reg1] = bus_read(cpu, (uint16_t)addr);
+                        update_flags(cpu, cpu->regs[reg1]);
+                        return cpu_intact(cpu, verified); // a device may have written memory
+                    }
+                    cpu->regs[reg1] = mem_r16(cpu, addr);
+                    update_flags(cpu, cpu->regs[reg1]);
+                    break;
+                }
+
+                case EXT_STORE: {
+                    uint32_t addr = seg_addr(cpu, SEG_DS, cpu->regs[reg1]);
+                    if (mmio_hit(cpu, addr))
+                        bus_write(cpu, (uint16_t)addr, cpu->regs[reg2]);
+                    else
+                        cpu_store16(cpu, addr, cpu->regs[reg2]);
+                    cpu->counters.bytes_stored += 2;
+                    return cpu_intact(cpu, verified);
+                }
+
+                default:
+                    if (verified)
+                        __builtin_unreachable();
+                    out_printf(&cpu->out, "Unknown extended opcode: 0x%X\n", ext_op);
+                    cpu_flush_output(cpu);
+                    cpu->halted = true;
+                    cpu->faulted = true;
+                    break;
+            }
+            break;
+        }
+
+        case OP_EXT2: {
+            uint8_t ext2_op = dst;
+            uint8_t reg1 = src;
+            uint8_t reg2 = (instr >> 3) & 0x7;
+
+            if (ext2_op == EXT2_BLOCK) {
+                cpu_block_op(cpu, instr & 0x7, reg1, reg2);
+                return cpu_intact(cpu, verified);
+            }
+            cpu->regs[reg1] = ext2_eval(ext2_op, cpu->regs[reg1], cpu->regs[reg2], &cpu->flags);
+            cpu->flag_op = FLAGOP_NONE;
+            update_flags(cpu, cpu->regs[reg1]);
+            break;
+        }
+
+        case OP_FUSE: {
+            uint8_t fuse_op = dst;
+            uint8_t reg1 = src;
+            uint8_t reg2 = (instr >> 3) & 0x7;
+            uint8_t reg3 = instr & 0x7;
+            uint8_t target = reg3;
+            bool taken;
+
+            switch (fuse_op) {
+                case FUSE_DJNZ: {
+                    uint16_t a = cpu->regs[reg1];
+                    record_flags(cpu, FLAGOP_SUB, a, 1);
+                    cpu->regs[reg1] = (uint16_t)(a - 1);
+                    update_flags(cpu, cpu->regs[reg1]);
+                    taken = cpu->flag_res != 0;
+                    target = reg2;
+                    break;
+                }
+
+                case FUSE_SJNZ: {
+                    uint16_t a = cpu->regs[reg1], b = cpu->regs[reg2];
+                    record_flags(cpu, FLAGOP_SUB, a, b);
+                    cpu->regs[reg1] = (uint16_t)(a - b);
+                    update_flags(cpu, cpu->regs[reg1]);
+                    taken = cpu->flag_res != 0;
+                    break;
+                }
+
+                case FUSE_CJZ:
+                case FUSE_CJNZ: {
+                    uint16_t a = cpu->regs[reg1], b = cpu->regs[reg2];
+                    record_cmp(cpu, a, b);
+                    update_flags(cpu, (uint16_t)(a - b));
+                    taken = (cpu->flag_res == 0) == (fuse_op == FUSE_CJZ);
+                    break;
+                }
+
+                case FUSE_MOVIW:
+                    cpu->regs[reg1] = cpu_fetch(cpu, verified); // the literal word
+                    update_flags(cpu, cpu->regs[reg1]);
+                    return true;
+
+                default: {
+                    // FUSE_JMPR / FUSE_JZR / FUSE_JNZR, word displacement from the next instruction
+                    int16_t disp = (int16_t)((imm9 & 0x100) ? (imm9 | 0xFE00) : imm9);
+                    taken = fuse_op == FUSE_JMPR || (cpu->flag_res == 0) == (fuse_op == FUSE_JZR);
+                    if (taken) {
+                        PROFILE(cpu->profile->taken[((cpu->pc - 2) & ADDR_MASK) >> 1]++);
+                        cpu->pc = cpu->pc + (uint32_t)(disp * 2);
+                        if (!verified)
+                            cpu->pc &= ADDR_MASK;
+                        cpu->counters.branches++;
+                    }
+                    return true;
+                }
+            }
+
+            if (taken) {
+                PROFILE(cpu->profile->taken[((cpu->pc - 2) & ADDR_MASK) >> 1]++);
+                cpu->pc = cpu_code_addr(cpu, verified, cpu->regs[target]);
+                cpu->counters.branches++;
+                return cpu_landed(cpu, verified);
+            }
+            break;
+        }
+
+        default:
+            if (verified)
+                __builtin_unreachable();
+            out_printf(&cpu->out, "Unknown opcode: 0x%X at PC=0x%05X\n", opcode, cpu->pc - 2);
+            cpu_flush_output(cpu);
+            cpu->halted = true;
+            cpu->faulted = true;
+            return false;
+    }
+    return true;
+}
+
+void cpu_step(CPU *cpu)
+{
+    cpu_exec(cpu, false);
+}
+
+/*
+ * =====================================
+ *          BYTECODE VERIFIER
+ * =====================================
+ */
+
+/*
+    cpu_verify() walks the loaded code, [code_lo, code_hi), from pc along
+    every path and proves for each instruction it reaches that:
+
+      - it is a known operation (block ops 6 and 7 aren't), and its MOVIW
+        literal or inline STDOUT string ends inside the code and isn't
+        itself reached as an instruction;
+      - fall-through and relative jumps land on another instruction inside
+        the code, and jumps and calls through a register go to a constant
+        that does. Values are followed through MOV/MOVI/MOVIW and
+        ADD/SUB/AND/OR/XOR of constants; after a CALL only what the callee
+        (or anything it calls) writes is forgotten;
+      - PUSH and POP balance: every path into an instruction has the same
+        stack depth, POP never takes what its subroutine didn't push and
+        RET runs with nothing left pushed, so it pops its CALL's return
+        address;
+      - nothing moves CS, and SS (which starts a new, empty stack) only
+        moves where nothing is pushed yet.
+
+    The walk starts from the registers as they are, so verify once they are
+    set up. A jump through a register is looked up in the result at run time
+    anyway, that only decides which code gets walked. Code that passes runs
+    on cpu_run_verified(); computed jumps, unbalanced stacks and code shared
+    between a subroutine and its caller keep the checked path.
+*/
+typedef struct {
+    uint32_t instructions; // reached
+    uint32_t subroutines;
+    uint32_t max_stack;    // bytes, VERIFY_UNBOUNDED if it can recurse
+    uint32_t pc;           // the instruction that failed
+    char error[96];        // empty if it verified
+} VerifyReport;
+
+#define VERIFY_NONE UINT32_MAX
+#define VERIFY_UNBOUNDED UINT32_MAX
+
+typedef struct {
+    uint32_t sub;          // subroutine it is part of (0 is the entry's code), VERIFY_NONE = not reached
+    int32_t depth;         // words pushed since the subroutine's entry
+    uint8_t known;         // registers with a known value
+    uint16_t regs[NUMS_R];
+} VerifyState;
+
+typedef struct {
+    uint32_t entry;
+    uint8_t writes; // registers it, or anything it calls, may write
+    uint8_t mark;   // verify_bound(): 1 on the path, 2 done
+    int32_t depth;  // most words it pushes itself
+    uint32_t bound; // most words pushed below its entry, VERIFY_UNBOUNDED if it recurses
+} VerifySub;
+
+typedef struct {
+    CPU *cpu;
+    uint32_t lo;
+    uint32_t hi;
+    size_t slots;
+    VerifyState *at; // per 2-byte slot
+    uint32_t *queue; // slots waiting to be (re)visited, a ring with each at most once
+    uint8_t *queued;
+    uint8_t *operand; // per slot: part of a reached MOVIW literal or STDOUT string
+    size_t head;
+    size_t count;
+    uint32_t *sub_at; // per slot: index + 1 of the subroutine entered there, 0 = none
+    VerifySub *subs;
+    size_t nsubs;
+    size_t cap;
+    bool changed; // a writes set grew this pass, which may forget more after a CALL
+    VerifyReport *report;
+} Verifier;
+
+static bool verify_fail(Verifier *v, uint32_t pc, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(v->report->error, sizeof(v->report->error), fmt, ap);
+    va_end(ap);
+    v->report->pc = pc;
+    return false;
+}
+
+// reg = value, or something not known statically; writes collects what was set
+static inline void verify_set(VerifyState *s, uint8_t *writes, uint8_t reg, bool known, uint16_t value)
+{
+    *writes |= 1 << reg;
+    s->regs[reg] = value;
+    s->known = known ? s->known | (1 << reg) : s->known & ~(1 << reg);
+}
+
+static inline bool verify_known(const VerifyState *s, uint8_t reg)
+{
+    return (s->known >> reg) & 1;
+}
+
+// Merge s into the state at to, queueing it if that forgot something
+static bool verify_flow(Verifier *v, uint32_t from, uint32_t to, const VerifyState *s)
+{
+    if (to < v->lo || to + 2 > v->hi || (to & 1))
+        return verify_fail(v, from, "goes to 0x%05X, outside the code", to);
+
+    size_t slot = (to - v->lo) >> 1;
+    VerifyState *t = &v->at[slot];
+    if (t->sub == VERIFY_NONE) {
+        *t = *s;
+    } else {
+        if (t->sub != s->sub)
+            return verify_fail(v, from, "0x%05X is reached from two subroutines", to);
+        if (t->depth != s->depth)
+            return verify_fail(v, from, "0x%05X is reached with %d and with %d words pushed", to,
+                               t->depth, s->depth);
+        uint8_t known = t->known & s->known;
+        for (uint8_t r = 0; r < NUMS_R; r++)
+            if (t->regs[r] != s->regs[r])
+                known &= ~(1 << r);
+        if (known == t->known)
+            return true;
+        t->known = known;
+    }
+
+    if (!v->queued[slot]) {
+        v->queued[slot] = 1;
+        v->queue[(v->head + v->count) % v->slots] = (uint32_t)slot;
+        v->count++;
+    }
+    return true;
+}
+
+// Subroutine entered at entry, created on its first CALL
+static uint32_t verify_sub(Verifier *v, uint32_t entry)
+{
+    uint32_t *at = &v->sub_at[(entry - v->lo) >> 1];
+    if (*at)
+        return *at - 1;
+    if (v->nsubs == v->cap) {
+        size_t cap = v->cap * 2;
+        VerifySub *subs = realloc(v->subs, cap * sizeof(VerifySub));
+        if (!subs)
+            return VERIFY_NONE;
+        v->subs = subs;
+        v->cap = cap;
+    }
+    v->subs[v->nsubs] = (VerifySub){.entry = entry};
+    *at = (uint32_t)++v->nsubs;
+    return *at - 1;
+}
+
+static inline void verify_writes(Verifier *v, uint32_t sub, uint8_t writes)
+{
+    uint8_t *w = &v->subs[sub].writes;
+    if ((*w | writes) != *w) {
+        *w |= writes;
+        v->changed = true;
+    }
+}
+
+// Register jump or call target, which has to be a known constant
+static bool verify_target(Verifier *v, uint32_t pc, const VerifyState *s, uint8_t reg, uint32_t *to)
+{
+    if (!verify_known(s, reg))
+        return verify_fail(v, pc, "jumps through R%u, which doesn't hold a known address", reg);
+    *to = s->regs[reg]; // CS is 0
+    return true;
+}
+
+static bool verify_step(Verifier *v, uint32_t pc)
+{
+    CPU *cpu = v->cpu;
+    VerifyState s = v->at[(pc - v->lo) >> 1];
+    uint16_t instr = mem_r16(cpu, pc);
+    uint8_t opcode = (instr >> 12) & 0xF;
+    uint8_t dst = (instr >> 9) & 0x7;
+    uint8_t src = (instr >> 6) & 0x7;
+    uint8_t reg2 = (instr >> 3) & 0x7;
+    uint8_t reg3 = instr & 0x7;
+    uint16_t imm9 = instr & 0x1FF;
+    uint16_t simm9 = (imm9 & 0x100) ? (imm9 | 0xFE00) : imm9;
+    uint8_t writes = 0;
+    uint32_t next = pc + 2;
+    uint32_t target = VERIFY_NONE;
+    bool falls = true;
+    bool call = false;
+
+    switch (opcode) {
+        case OP_HALT:
+            falls = false;
+            break;
+
+        case OP_NOP:
+        case OP_CMP:
+            break;
+
+        case OP_MOV:
+            verify_set(&s, &writes, dst, verify_known(&s, src), s.regs[src]);
+            break;
+
+        case OP_MOVI:
+            verify_set(&s, &writes, dst, true, simm9);
+            break;
+
+        case OP_JMP:
+            falls = false;
+            // fall through
+        case OP_JZ:
+        case OP_JNZ:
+            if (!verify_target(v, pc, &s, dst, &target))
+                return false;
+            break;
+
+        case OP_PUSH:
+            s.depth++;
+            break;
+
+        case OP_POP:
+            if (s.depth == 0)
+                return verify_fail(v, pc, "POP with nothing pushed");
+            s.depth--;
+            verify_set(&s, &writes, dst, false, 0);
+            break;
+
+        case OP_CALL:
+            if (!verify_target(v, pc, &s, dst, &target))
+                return false;
+            call = true;
+            break;
+
+        case OP_STDOUT:
+            if (dst == 0) {
+                uint32_t end = next;
+                while (end < v->hi && end - next < STDOUT_STRING_MAX && cpu->mem[end])
+                    end++;
+                if (end >= v->hi || cpu->mem[end])
+                    return verify_fail(v, pc, "string runs past the end of the code");
+                next = (end + 2) & ~1u; // past the NUL, aligned
+                memset(v->operand + ((pc + 2 - v->lo) >> 1), 1, (next - pc - 2) >> 1);
+            }
+            break;
+
+        case OP_STDIN:
+            if (dst != 0)
+                verify_set(&s, &writes, src, false, 0);
+            break;
+
+        case OP_EXT: {
+            uint16_t a = s.regs[src], b = s.regs[reg2], r = 0;
+            switch (dst) {
+                case EXT_RET:
+                    if (s.sub == 0)
+                        return verify_fail(v, pc, "RET outside a subroutine");
+                    if (s.depth != 0)
+                        return verify_fail(v, pc, "RET with %d word%s still pushed", s.depth, s.depth == 1 ? "" : "s");
+                    falls = false;
+                    break;
+                case EXT_STORE:
+                    break;
+                case EXT_LOAD:
+                    verify_set(&s, &writes, src, false, 0);
+                    break;
+                default:
+                    r = dst == EXT_ADD ? a + b : dst == EXT_SUB ? a - b : dst == EXT_AND ? a & b : dst == EXT_OR ? a | b : a ^ b;
+                    verify_set(&s, &writes, src, verify_known(&s, src) && verify_known(&s, reg2), r);
+                    break;
+            }
+            break;
+        }
+
+        case OP_EXT2:
+            if (dst != EXT2_BLOCK) {
+                verify_set(&s, &writes, src, false, 0);
+                break;
+            }
+            switch (reg3) {
+                case BLOCK_COPY:
+                case BLOCK_FILL:
+                case BLOCK_CMP:
+                    break;
+                case BLOCK_STRLEN:
+                case BLOCK_GETSEG:
+                    verify_set(&s, &writes, src, false, 0);
+                    break;
+                case BLOCK_SETSEG:
+                    if ((reg2 & 3) == SEG_CS)
+                        return verify_fail(v, pc, "SETSEG moves CS");
+                    if ((reg2 & 3) == SEG_SS && (s.sub != 0 || s.depth != 0))
+                        return verify_fail(v, pc, "SETSEG moves SS under a pushed word or return address");
+                    break;
+                default:
+                    return verify_fail(v, pc, "unknown block op %u", reg3);
+            }
+            break;
+
+        case OP_FUSE:
+            switch (dst) {
+                case FUSE_DJNZ:
+                    verify_set(&s, &writes, src, verify_known(&s, src), s.regs[src] - 1);
+                    reg3 = reg2;
+                    break;
+                case FUSE_SJNZ:
+                    verify_set(&s, &writes, src, verify_known(&s, src) && verify_known(&s, reg2),
+                               s.regs[src] - s.regs[reg2]);
+                    break;
+                case FUSE_MOVIW:
+                    if (next + 2 > v->hi)
+                        return verify_fail(v, pc, "MOVIW literal runs past the end of the code");
+                    verify_set(&s, &writes, src, true, mem_r16(cpu, next));
+                    v->operand[(next - v->lo) >> 1] = 1;
+                    next += 2;
+                    break;
+                default: // FUSE_JMPR / FUSE_JZR / FUSE_JNZR
+                    target = next + (uint32_t)((int16_t)simm9 * 2);
+                    falls = dst != FUSE_JMPR;
+                    break;
+            }
+            if (dst <= FUSE_CJNZ && !verify_target(v, pc, &s, reg3, &target)) // after the arithmetic, like cpu_step()
+                return false;
+            break;
+    }
+
+    verify_writes(v, s.sub, writes);
+
+    if (call) {
+        if (target < v->lo || target + 2 > v->hi || (target & 1))
+            return verify_fail(v, pc, "calls 0x%05X, outside the code", target);
+        uint32_t callee = verify_sub(v, target);
+        if (callee == VERIFY_NONE)
+            return verify_fail(v, pc, "out of memory");
+        verify_writes(v, s.sub, v->subs[callee].writes);
+
+        VerifyState entry = s;
+        entry.sub = callee;
+        entry.depth = 0;
+        if (!verify_flow(v, pc, target, &entry))
+            return false;
+        s.known &= ~v->subs[callee].writes;
+        return verify_flow(v, pc, next, &s);
+    }
+    if (target != VERIFY_NONE && !verify_flow(v, pc, target, &s))
+        return false;
+    return !falls || verify_flow(v, pc, next, &s);
+}
+
+// One walk from the entry with the subroutines' writes sets as they are
+static bool verify_pass(Verifier *v)
+{
+    for (size_t i = 0; i < v->slots; i++)
+        v->at[i].sub = VERIFY_NONE;
+    memset(v->queued, 0, v->slots);
+    v->head = v->count = 0;
+    v->changed = false;
+
+    VerifyState entry = {.sub = 0, .known = 0xFF};
+    memcpy(entry.regs, v->cpu->regs, sizeof(entry.regs));
+    if (!verify_flow(v, v->cpu->pc, v->cpu->pc, &entry))
+        return false;
+
+    while (v->count) {
+        uint32_t slot = v->queue[v->head];
+        v->head = (v->head + 1) % v->slots;
+        v->count--;
+        v->queued[slot] = 0;
+        if (!verify_step(v, v->lo + slot * 2))
+            return false;
+    }
+    return true;
+}
+
+// Most words pushed below sub's entry, CALL return addresses included
+static uint32_t verify_bound(Verifier *v, uint32_t sub)
+{
+    VerifySub *s = &v->subs[sub];
+    if (s->mark)
+        return s->mark == 1 ? VERIFY_UNBOUNDED : s->bound;
+    s->mark = 1;
+
+    uint32_t bound = (uint32_t)s->depth;
+    for (size_t i = 0; i < v->slots && bound != VERIFY_UNBOUNDED; i++) {
+        const VerifyState *at = &v->at[i];
+        if (at->sub != sub)
+            continue;
+        uint16_t instr = mem_r16(v->cpu, v->lo + (uint32_t)i * 2);
+        if ((instr >> 12) != OP_CALL)
+            continue;
+        uint32_t callee = v->sub_at[(at->regs[(instr >> 9) & 0x7] - v->lo) >> 1] - 1;
+        uint32_t b = verify_bound(v, callee);
+        if (b == VERIFY_UNBOUNDED)
+            bound = VERIFY_UNBOUNDED;
+        else if ((uint32_t)at->depth + 2 + b > bound)
+            bound = (uint32_t)at->depth + 2 + b;
+    }
+
+    s = &v->subs[sub];
+    s->mark = 2;
+    s->bound = bound;
+    return bound;
+}
+
+/*
+    Verify the code cpu_load_image() put in [cpu->code_lo, cpu->code_hi),
+    starting at cpu->pc, and keep the result for cpu_run_verified(). False
+    if it doesn't verify, the VM then keeps running checked; report (may be
+    NULL) says what was found or what failed.
+*/
+bool cpu_verify(CPU *cpu, VerifyReport *report)
+{
+    VerifyReport scratch;
+    if (!report)
+        report = &scratch;
+    memset(report, 0, sizeof(*report));
+    report->pc = cpu->pc;
+
+    verified_release(cpu->verified);
+    cpu->verified = NULL;
+
+    cpu->verify_pending = false;
+
+    Verifier v = {.cpu = cpu, .lo = cpu->code_lo, .hi = cpu->code_hi, .report = report};
+    if (v.lo >= v.hi)
+        return verify_fail(&v, cpu->pc, "no code loaded");
+    if (v.lo & 1)
+        return verify_fail(&v, v.lo, "code starts at an odd address");
+    if (cpu->SR[SEG_CS])
+        return verify_fail(&v, cpu->pc, "CS isn't 0");
+    if (cpu->pc < v.lo || cpu->pc + 2 > v.hi || (cpu->pc & 1))
+        return verify_fail(&v, cpu->pc, "the entry point isn't in the code");
+
+    v.slots = (v.hi - v.lo + 1) / 2;
+    v.cap = 16;
+    v.at = malloc(v.slots * sizeof(VerifyState));
+    v.queue = malloc(v.slots * sizeof(uint32_t));
+    v.queued = malloc(v.slots);
+    v.operand = calloc(v.slots, 1);
+    v.sub_at = calloc(v.slots, sizeof(uint32_t));
+    v.subs = malloc(v.cap * sizeof(VerifySub));
+    bool ok = v.at && v.queue && v.queued && v.operand && v.sub_at && v.subs;
+    if (!ok) {
+        verify_fail(&v, cpu->pc, "out of memory");
+    } else {
+        v.subs[0] = (VerifySub){.entry = cpu->pc}; // the entry's own code, never called
+        v.nsubs = 1;
+        // Each extra pass only runs if a subroutine turned out to write more
+        while ((ok = verify_pass(&v)) && v.changed)
+            ;
+    }
+
+    // After the walk, so it doesn't matter which of the two was reached first
+    for (size_t i = 0; ok && i < v.slots; i++)
+        if (v.operand[i] && v.at[i].sub != VERIFY_NONE)
+            ok = verify_fail(&v, v.lo + (uint32_t)i * 2, "a jump lands inside a MOVIW literal or string");
+
+    Verified *result = NULL;
+    if (ok) {
+        for (size_t i = 0; i < v.slots; i++) {
+            const VerifyState *at = &v.at[i];
+            if (at->sub == VERIFY_NONE)
+                continue;
+            report->instructions++;
+            if (at->depth > v.subs[at->sub].depth)
+                v.subs[at->sub].depth = at->depth;
+        }
+        for (size_t i = 1; i < v.nsubs; i++)
+            report->subroutines += v.at[(v.subs[i].entry - v.lo) >> 1].sub == i;
+        uint32_t words = verify_bound(&v, 0);
+        report->max_stack = words == VERIFY_UNBOUNDED ? VERIFY_UNBOUNDED : words * 2;
+
+        result = calloc(1, sizeof(Verified));
+        if (result) {
+            atomic_init(&result->refs, 1);
+            result->lo = v.lo;
+            result->hi = v.hi;
+            for (size_t i = 0; i < v.slots; i++) {
+                uint32_t pc = v.lo + (uint32_t)i * 2;
+                if (v.at[i].sub != VERIFY_NONE)
+                    result->starts[pc >> 3] |= 1 << (pc & 7);
+            }
+        } else {
+            ok = verify_fail(&v, cpu->pc, "out of memory");
+        }
+    }
+
+    free(v.at);
+    free(v.queue);
+    free(v.queued);
+    free(v.operand);
+    free(v.sub_at);
+    free(v.subs);
+    cpu->verified = result;
+    return ok;
+}
+
+/*
+    cpu_run() on verified code: no halted check, fetch wrap or unknown
+    opcode per instruction. It hands back to the checked loop when
+    cpu_exec() says pc may have left the code it proved, which for a
+    program that passed only happens if it writes over itself or reaches a
+    return address it stored by hand.
+*/
+static void cpu_run_verified(CPU *cpu)
+{
+    if (cpu->halted || cpu->SR[SEG_CS] || cpu->pc > ADDR_MASK || !verified_start(cpu->verified, cpu->pc))
+        return;
+
+    while (cpu->budget > 0) {
+        if (!cpu_exec(cpu, true)) {
+            cpu->budget -= !cpu->waiting;
+            break;
+        }
+        cpu->budget--;
+    }
+}
+
+/*
+ * =====================================
+ *           EXECUTION TRACE
+ * =====================================
+ */
+
+/*
+    --trace=FILE records every instruction into FILE: a ring of fixed-size
+    blocks mapped MAP_SHARED, so what was written survives the VM crashing or
+    being killed. Tracing runs on the switch engine (like --profile) but
+    cpu_run() only checks for it once per slice. All fields little-endian:
+
+        header  "VMTR", u32 version, u32 block size, u32 blocks,
+                u64 blocks started, u32 guest memory size
+        block   u64 seq (records before it), u32 pc, u16 regs[8], u8 flags,
+                u8 pad, u16 used (bytes, header included), then the records
+
+    A block header is the state before its first record, and every record is
+    a delta against the one before it:
+
+        u8      tag: TRACE_JUMP | TRACE_FLAGS | TRACE_REGS | TRACE_REG | reg
+        varint  zigzag pc - (previous pc + 2), with TRACE_JUMP
+        u16     the instruction word
+        u8      flags after it, with TRACE_FLAGS
+        u8      mask of changed registers, with TRACE_REGS
+        varint  zigzag new - old per changed register (just reg with TRACE_REG)
+
+    Records never straddle blocks, so a reader can start at any of them;
+    asm_parser/cmd/vmtrace turns the file back into a disassembly.
+*/
+
+#define TRACE_MAGIC "VMTR"
+#define TRACE_VERSION 1
+#define TRACE_BLOCK 4096      // also the header's size, blocks start page aligned
+#define TRACE_BLOCK_HEADER 32
+#define TRACE_RECORD_MAX 40   // tag, pc (4 bytes at VM_MEMORY_BITS 28), instr, flags, mask, 8 x 3-byte values
+
+enum {
+    TRACE_JUMP = 0x80,
+    TRACE_FLAGS = 0x40,
+    TRACE_REGS = 0x20,
+    TRACE_REG = 0x10, // one register, its number in the low 3 bits
+};
+
+typedef struct Trace {
+    int fd;
+    uint8_t *map;
+    size_t size;
+    uint32_t nblocks;
+    uint64_t started; // blocks so far, the current one is started - 1
+    uint8_t *block;   // NULL until the first record
+    uint32_t used;
+    uint64_t seq;
+    uint32_t pc; // state as of the last record
+    uint16_t regs[NUMS_R];
+    uint8_t flags;
+} Trace;
+
+static inline void trace_put16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void trace_put32(uint8_t *p, uint32_t v)
+{
+    trace_put16(p, (uint16_t)v);
+    trace_put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static inline void trace_put64(uint8_t *p, uint64_t v)
+{
+    trace_put32(p, (uint32_t)v);
+    trace_put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint8_t *trace_varint(uint8_t *p, int32_t v)
+{
+    uint32_t z = ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+    while (z >= 0x80) {
+        *p++ = (uint8_t)(z | 0x80);
+        z >>= 7;
+    }
+    *p++ = (uint8_t)z;
+    return p;
+}
+
+// Ring of size bytes (rounded to whole blocks, at least one) in a new file at path
+Trace *trace_open(const char *path, size_t size)
+{
+    Trace *t = calloc(1, sizeof(Trace));
+    if (!t)
+        return NULL;
+
+    t->nblocks = (uint32_t)(size / TRACE_BLOCK ? size / TRACE_BLOCK : 1);
+    t->size = (size_t)(t->nblocks + 1) * TRACE_BLOCK;
+    t->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (t->fd < 0 || ftruncate(t->fd, (off_t)t->size) < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        if (t->fd >= 0)
+            close(t->fd);
+        free(t);
+        return NULL;
+    }
+
+    t->map = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+    if (t->map == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        close(t->fd);
+        free(t);
+        return NULL;
+    }
+
+    memcpy(t->map, TRACE_MAGIC, 4);
+    trace_put32(t->map + 4, TRACE_VERSION);
+    trace_put32(t->map + 8, TRACE_BLOCK);
+    trace_put32(t->map + 12, t->nblocks);
+    trace_put64(t->map + 16, 0);
+    trace_put32(t->map + 24, MEMORY_SIZE);
+    return t;
+}
+
+void trace_close(Trace *t)
+{
+    if (t) {
+        munmap(t->map, t->size);
+        close(t->fd);
+        free(t);
+    }
+}
+
+static void trace_next_block(Trace *t)
+{
+    uint8_t *b = t->map + TRACE_BLOCK + (size_t)(t->started % t->nblocks) * TRACE_BLOCK;
+    trace_put64(b, t->seq);
+    trace_put32(b + 8, t->pc);
+    for (int i = 0; i < NUMS_R; i++)
+        trace_put16(b + 12 + i * 2, t->regs[i]);
+    b[28] = t->flags;
+    b[29] = 0;
+    trace_put16(b + 30, TRACE_BLOCK_HEADER);
+
+    t->block = b;
+    t->used = TRACE_BLOCK_HEADER;
+    trace_put64(t->map + 16, ++t->started);
+}
+
+// Append a record for instr at pc, regs and flags being the state after it
+static void trace_record(Trace *t, uint32_t pc, uint16_t instr, const uint16_t *regs, uint8_t flags)
+{
+    if (t->used > TRACE_BLOCK - TRACE_RECORD_MAX)
+        trace_next_block(t);
+
+    uint8_t *tag = t->block + t->used;
+    uint8_t *p = tag + 1;
+    uint8_t bits = 0;
+
+    uint32_t skip = (pc - t->pc - 2) & ADDR_MASK;
+    if (skip) {
+        bits |= TRACE_JUMP;
+        p = trace_varint(p, skip > ADDR_MASK / 2 ? (int32_t)skip - MEMORY_SIZE : (int32_t)skip);
+    }
+
+    trace_put16(p, instr);
+    p += 2;
+
+    if (flags != t->flags) {
+        bits |= TRACE_FLAGS;
+        *p++ = flags;
+        t->flags = flags;
+    }
+
+    unsigned mask = 0;
+    for (int i = 0; i < NUMS_R; i++)
+        mask |= (unsigned)(regs[i] != t->regs[i]) << i;
+    if (mask & (mask - 1)) {
+        bits |= TRACE_REGS;
+        *p++ = (uint8_t)mask;
+    } else if (mask) {
+        bits |= TRACE_REG | (uint8_t)__builtin_ctz(mask);
+    }
+    for (; mask; mask &= mask - 1) {
+        int i = __builtin_ctz(mask);
+        p = trace_varint(p, (int16_t)(regs[i] - t->regs[i]));
+        t->regs[i] = regs[i];
+    }
+
+    *tag = bits;
+    t->used = (uint32_t)(p - t->block);
+    trace_put16(t->block + 30, (uint16_t)t->used);
+    t->pc = pc;
+    t->seq++;
+}
+
+// cpu_run() with every executed instruction recorded in cpu->trace
+static void cpu_run_traced(CPU *cpu)
+{
+    Trace *t = cpu->trace;
+    if (!t->block) {
+        t->pc = (cpu->pc - 2) & ADDR_MASK;
+        memcpy(t->regs, cpu->regs, sizeof(t->regs));
+        t->flags = cpu_get_flags(cpu);
+        trace_next_block(t);
+    }
+
+    while (!cpu->halted && !cpu->waiting && cpu->budget > 0) {
+        uint32_t pc = cpu->pc;
+        uint16_t instr = mem_r16(cpu, pc);
+        cpu_step(cpu);
+        if (cpu->waiting)
+            break; // parked, the instruction runs again later
+        trace_record(t, pc, instr, cpu->regs, cpu_get_flags(cpu));
+        cpu->budget--;
+    }
+}
+
+// Runs until HALT, the guest parks on input or cpu->budget runs out, see cpu_run_for()
+void cpu_run(CPU *cpu)
+{
+    if (cpu->trace) {
+        cpu_run_traced(cpu);
+        return;
+    }
+
+    if (cpu->verified)
+        cpu_run_verified(cpu);
+    while (!cpu->halted && !cpu->waiting && cpu->budget > 0) {
+        cpu_exec(cpu, false);
+        cpu->budget -= !cpu->waiting;
+    }
+}
+
+/*
+ * =====================================
+ *       THREADED DISPATCH ENGINE
+ * =====================================
+ */
+
+// Handler indices stored in DecodedInstr.handler
+enum {
+    H_DECODE = 0, // slot not decoded yet (a fresh cache starts here)
+    H_SLOW,       // HALT, I/O, unknown: handed to cpu_step()
+    H_NOP,
+    H_MOV,
+    H_MOVI,
+    H_CMP,
+    H_JMP,
+    H_JZ,
+    H_JNZ,
+    H_PUSH,
+    H_POP,
+    H_CALL,
+    H_RET,
+    H_LOAD,
+    H_STORE,
+    H_ADD,
+    H_SUB,
+    H_AND,
+    H_OR,
+    H_XOR,
+    H_DJNZ,
+    H_SJNZ,
+    H_CJZ,
+    H_CJNZ,
+    H_JMPR,
+    H_JZR,
+    H_JNZR,
+    H_MOVIW,
+    H_MUL,
+    H_MULH,
+    H_DIV,
+    H_MOD,
+    H_SHL,
+    H_SHR,
+    H_SAR,
+    NUM_HANDLERS,
+};
+
+static const uint8_t op_handler[16] = {
+    [OP_HALT] = H_SLOW,
+    [OP_NOP] = H_NOP,
+    [OP_MOV] = H_MOV,
+    [OP_MOVI] = H_MOVI,
+    [OP_CMP] = H_CMP,
+    [OP_JMP] = H_JMP,
+    [OP_JZ] = H_JZ,
+    [OP_JNZ] = H_JNZ,
+    [OP_PUSH] = H_PUSH,
+    [OP_POP] = H_POP,
+    [OP_CALL] = H_CALL,
+    [OP_STDOUT] = H_SLOW,
+    [OP_STDIN] = H_SLOW,
+    [OP_EXT] = H_DECODE, // resolved through ext_handler[]
+    [OP_EXT2] = H_DECODE, // resolved through ext2_handler[]
+    [OP_FUSE] = H_DECODE, // resolved through fuse_handler[]
+};
+
+static const uint8_t ext_handler[8] = {
+    [EXT_RET] = H_RET,
+    [EXT_LOAD] = H_LOAD,
+    [EXT_STORE] = H_STORE,
+    [EXT_ADD] = H_ADD,
+    [EXT_SUB] = H_SUB,
+    [EXT_AND] = H_AND,
+    [EXT_OR] = H_OR,
+    [EXT_XOR] = H_XOR,
+};
+
+static const uint8_t ext2_handler[8] = {
+    [EXT2_MUL] = H_MUL,
+    [EXT2_MULH] = H_MULH,
+    [EXT2_DIV] = H_DIV,
+    [EXT2_MOD] = H_MOD,
+    [EXT2_SHL] = H_SHL,
+    [EXT2_SHR] = H_SHR,
+    [EXT2_SAR] = H_SAR,
+    [EXT2_BLOCK] = H_SLOW, // the call is cheap next to the copy
+};
+
+static const uint8_t fuse_handler[8] = {
+    [FUSE_DJNZ] = H_DJNZ,
+    [FUSE_SJNZ] = H_SJNZ,
+    [FUSE_CJZ] = H_CJZ,
+    [FUSE_CJNZ] = H_CJNZ,
+    [FUSE_JMPR] = H_JMPR,
+    [FUSE_JZR] = H_JZR,
+    [FUSE_JNZR] = H_JNZR,
+    [FUSE_MOVIW] = H_MOVIW,
+};
+
+static void decode_instr(DecodedInstr *d, uint16_t instr)
+{
+    uint8_t opcode = (instr >> 12) & 0xF;
+    uint16_t imm9 = instr & 0x1FF;
+
+    if (opcode == OP_EXT || opcode == OP_EXT2 || opcode == OP_FUSE) {
+        const uint8_t *table = opcode == OP_EXT ? ext_handler : opcode == OP_EXT2 ? ext2_handler : fuse_handler;
+        d->handler = table[(instr >> 9) & 0x7];
+        d->a = (instr >> 6) & 0x7;
+        d->b = (instr >> 3) & 0x7;
+        if (opcode == OP_FUSE) {
+            uint8_t fuse_op = (instr >> 9) & 0x7;
+            if (fuse_op >= FUSE_JMPR && fuse_op <= FUSE_JNZR)
+                d->imm = (uint16_t)(((imm9 & 0x100) ? (imm9 | 0xFE00) : imm9) * 2);
+            else
+                d->imm = instr & 0x7;
+            return;
+        }
+    } else {
+        d->handler = op_handler[opcode];
+        d->a = (instr >> 9) & 0x7;
+        d->b = (instr >> 6) & 0x7;
+    }
+    d->imm = (imm9 & 0x100) ? (imm9 | 0xFE00) : imm9;
+}
+
+/*
+    Same semantics as cpu_run(), but dispatches through a label table indexed
+    by the handler of the pre-decoded instruction at pc, and keeps
+    pc/sp/regs/flags in locals. Slots are decoded lazily on first execution
+    and invalidated by guest stores (see cpu_store16()), so self-modifying
+    code still works. The CPU struct is only written back when we leave the
+    loop or hand an instruction to cpu_step() (HALT, I/O and unknown
+    opcodes), so both engines produce identical results.
+*/
+void cpu_run_threaded(CPU *cpu)
+{
+#if VM_HAS_COMPUTED_GOTO
+    static void *const handlers[NUM_HANDLERS] = {
+        [H_DECODE] = &&h_decode,
+        [H_SLOW] = &&h_slow,
+        [H_NOP] = &&h_nop,
+        [H_MOV] = &&h_mov,
+        [H_MOVI] = &&h_movi,
+        [H_CMP] = &&h_cmp,
+        [H_JMP] = &&h_jmp,
+        [H_JZ] = &&h_jz,
+        [H_JNZ] = &&h_jnz,
+        [H_PUSH] = &&h_push,
+        [H_POP] = &&h_pop,
+        [H_CALL] = &&h_call,
+        [H_RET] = &&h_ret,
+        [H_LOAD] = &&h_load,
+        [H_STORE] = &&h_store,
+        [H_ADD] = &&h_add,
+        [H_SUB] = &&h_sub,
+        [H_AND] = &&h_and,
+        [H_OR] = &&h_or,
+        [H_XOR] = &&h_xor,
+        [H_DJNZ] = &&h_djnz,
+        [H_SJNZ] = &&h_sjnz,
+        [H_CJZ] = &&h_cjz,
+        [H_CJNZ] = &&h_cjnz,
+        [H_JMPR] = &&h_jmpr,
+        [H_JZR] = &&h_jzr,
+        [H_JNZR] = &&h_jnzr,
+        [H_MOVIW] = &&h_moviw,
+        [H_MUL] = &&h_mul,
+        [H_MULH] = &&h_mulh,
+        [H_DIV] = &&h_div,
+        [H_MOD] = &&h_mod,
+        [H_SHL] = &&h_shl,
+        [H_SHR] = &&h_shr,
+        [H_SAR] = &&h_sar,
+    };
+
+    if (cpu->halted || cpu->budget <= 0)
+        return;
+
+    if (!cpu->icache) {
+        cpu->icache = vm_zalloc(ICACHE_SIZE);
+        if (!cpu->icache) {
+            cpu_run(cpu);
+            return;
+        }
+    }
+
+    DecodedInstr *const icache = cpu->icache;
+    DecodedInstr *d;
+    uint16_t regs[NUMS_R];
+    uint32_t pc, sp;
+    uint32_t block; // pc the current straight-line run started at
+    int64_t left;   // cpu->budget
+    uint16_t flag_res, flag_a, flag_b;
+    uint8_t flags, flag_op;
+    uint32_t cs, ds; // segment bases, only cpu_step() changes them
+    GuestCounters tally; // added to cpu->counters on SPILL()
+
+#define SPILL()                                          \
+    do {                                                 \
+        memcpy(cpu->regs, regs, sizeof(regs));           \
+        cpu->pc = pc;                                    \
+        cpu->sp = sp;                                    \
+        cpu->flags = flags;                              \
+        cpu->flag_op = flag_op;                          \
+        cpu->flag_res = flag_res;                        \
+        cpu->flag_a = flag_a;                            \
+        cpu->flag_b = flag_b;                            \
+        cpu->budget = left;                              \
+        counters_add(&cpu->counters, &tally);            \
+    } while (0)
+
+#define RELOAD()                                         \
+    do {                                                 \
+        memcpy(regs, cpu->regs, sizeof(regs));           \
+        pc = cpu->pc;                                    \
+        sp = cpu->sp;                                    \
+        flags = cpu->flags;                              \
+        flag_op = cpu->flag_op;                          \
+        flag_res = cpu->flag_res;                        \
+        flag_a = cpu->flag_a;                            \
+        flag_b = cpu->flag_b;                            \
+        left = cpu->budget;                              \
+        cs = (uint32_t)cpu->SR[SEG_CS] << SEG_SHIFT;     \
+        ds = (uint32_t)cpu->SR[SEG_DS] << SEG_SHIFT;     \
+        tally = (GuestCounters){0};                      \
+    } while (0)
+
+    // Odd PCs would alias the even slot, so they take the cpu_step() path
+#define DISPATCH()                                       \
+    do {                                                 \
+        if (pc & 1)                                      \
+            goto h_unaligned;                            \
+        d = &icache[(pc & ADDR_MASK) >> 1];              \
+        pc += 2;                                         \
+        goto *handlers[d->handler];                      \
+    } while (0)
+
+/*
+    The budget is charged per straight-line run rather than per instruction:
+    a branch (or a trip through cpu_step()) pays for the run up to and
+    including itself, and only then checks whether to leave.
+*/
+#define CHARGE() left -= (int64_t)((pc - block) >> 1)
+
+#define NEXT_BLOCK()       \
+    do {                   \
+        block = pc;        \
+        if (left <= 0)     \
+            goto h_out;    \
+        DISPATCH();        \
+    } while (0)
+
+// Same as update_flags() / record_flags() / record_cmp(), on the local copy
+#define SET_ZS(v) flag_res = (v)
+
+#define RECORD(op, x, y) \
+    do {                 \
+        flag_op = (op);  \
+        flag_a = (x);    \
+        flag_b = (y);    \
+    } while (0)
+
+#define RECORD_CMP(x, y)                                                 \
+    do {                                                                 \
+        if (flag_op == FLAGOP_ADD || flag_op == FLAGOP_SUB)              \
+            flags = lazy_carry_overflow(flag_op, flag_a, flag_b, flags); \
+        RECORD(FLAGOP_CMP, x, y);                                        \
+    } while (0)
+
+    RELOAD();
+    block = pc;
+    DISPATCH();
+
+h_decode:
+    decode_instr(d, mem_r16(cpu, pc - 2));
+    goto *handlers[d->handler];
+
+h_nop:
+    DISPATCH();
+
+h_mov:
+    regs[d->a] = regs[d->b];
+    SET_ZS(regs[d->a]);
+    DISPATCH();
+
+h_movi:
+    regs[d->a] = d->imm;
+    SET_ZS(regs[d->a]);
+    DISPATCH();
+
+h_cmp: {
+    uint16_t a = regs[d->a], b = regs[d->b];
+    uint16_t result = (uint16_t)(a - b);
+    RECORD_CMP(a, b);
+    SET_ZS(result);
+    DISPATCH();
+}
+
+h_jmp:
+    CHARGE();
+    pc = (cs + regs[d->a]) & ADDR_MASK;
+    tally.branches++;
+    NEXT_BLOCK();
+
+h_jz:
+    CHARGE();
+    if (flag_res == 0) {
+        pc = (cs + regs[d->a]) & ADDR_MASK;
+        tally.branches++;
+    }
+    NEXT_BLOCK();
+
+h_jnz:
+    CHARGE();
+    if (flag_res != 0) {
+        pc = (cs + regs[d->a]) & ADDR_MASK;
+        tally.branches++;
+    }
+    NEXT_BLOCK();
+
+h_push:
+    sp -= 2;
+    cpu_store16(cpu, sp, regs[d->a]);
+    DISPATCH();
+
+h_pop:
+    regs[d->a] = mem_r16(cpu, sp);
+    sp += 2;
+    SET_ZS(regs[d->a]);
+    DISPATCH();
+
+h_call:
+    CHARGE();
+    sp -= 2;
+    cpu_store16(cpu, sp, pc & 0xFFFF);
+    sp -= 2;
+    cpu_store16(cpu, sp, pc >> 16);
+    pc = (cs + regs[d->a]) & ADDR_MASK;
+    tally.calls++;
+    NEXT_BLOCK();
+
+h_ret: {
+    CHARGE();
+    uint32_t high = mem_r16(cpu, sp) & (ADDR_MASK >> 16);
+    sp += 2;
+    uint32_t low = mem_r16(cpu, sp);
+    sp += 2;
+    pc = (high << 16) | low;
+    tally.returns++;
+    NEXT_BLOCK();
+}
+
+h_load: {
+    uint32_t addr = (ds + regs[d->b]) & ADDR_MASK;
+    if (mmio_hit(cpu, addr))
+        goto h_slow;
+    regs[d->a] = mem_r16(cpu, addr);
+    tally.bytes_loaded += 2;
+    SET_ZS(regs[d->a]);
+    DISPATCH();
+}
+
+h_store: {
+    uint32_t addr = (ds + regs[d->a]) & ADDR_MASK;
+    if (mmio_hit(cpu, addr))
+        goto h_slow;
+    cpu_store16(cpu, addr, regs[d->b]);
+    tally.bytes_stored += 2;
+    DISPATCH();
+}
+
+h_add: {
+    uint16_t a = regs[d->a], b = regs[d->b];
+    uint32_t result = (uint32_t)a + (uint32_t)b;
+    RECORD(FLAGOP_ADD, a, b);
+    regs[d->a] = result & 0xFFFF;
+    SET_ZS(regs[d->a]);
+    DISPATCH();
+}
+
+h_sub: {
+    uint16_t a = regs[d->a], b = regs[d->b];
+    uint32_t result = (uint32_t)a - (uint32_t)b;
+    RECORD(FLAGOP_SUB, a, b);
+    regs[d->a] = result & 0xFFFF;
+    SET_ZS(regs[d->a]);
+    DISPATCH();
+}
+
+h_and:
+    regs[d->a] &= regs[d->b];
+    SET_ZS(regs[d->a]);
+    DISPATCH();
+
+h_or:
+    regs[d->a] |= regs[d->b];
+    SET_ZS(regs[d->a]);
+    DISPATCH();
+
+h_xor:
+    regs[d->a] ^= regs[d->b];
+    SET_ZS(regs[d->a]);
+    DISPATCH();
+
+h_djnz: {
+    CHARGE();
+    uint16_t a = regs[d->a];
+    RECORD(FLAGOP_SUB, a, 1);
+    regs[d->a] = (uint16_t)(a - 1);
+    SET_ZS(regs[d->a]);
+    if (flag_res != 0) {
+        pc = (cs + regs[d->b]) & ADDR_MASK;
+        tally.branches++;
+    }
+    NEXT_BLOCK();
+}
+
+h_sjnz: {
+    CHARGE();
+    uint16_t a = regs[d->a], b = regs[d->b];
+    RECORD(FLAGOP_SUB, a, b);
+    regs[d->a] = (uint16_t)(a - b);
+    SET_ZS(regs[d->a]);
+    if (flag_res != 0) {
+        pc = (cs + regs[d->imm]) & ADDR_MASK;
+        tally.branches++;
+    }
+    NEXT_BLOCK();
+}
+
+h_cjz: {
+    CHARGE();
+    uint16_t a = regs[d->a], b = regs[d->b];
+    RECORD_CMP(a, b);
+    SET_ZS((uint16_t)(a - b));
+    if (flag_res == 0) {
+        pc = (cs + regs[d->imm]) & ADDR_MASK;
+        tally.branches++;
+    }
+    NEXT_BLOCK();
+}
+
+h_cjnz: {
+    CHARGE();
+    uint16_t a = regs[d->a], b = regs[d->b];
+    RECORD_CMP(a, b);
+    SET_ZS((uint16_t)(a - b));
+    if (flag_res != 0) {
+        pc = (cs + regs[d->imm]) & ADDR_MASK;
+        tally.branches++;
+    }
+    NEXT_BLOCK();
+}
+
+h_jmpr:
+    CHARGE();
+    pc = (pc + (uint32_t)(int16_t)d->imm) & ADDR_MASK;
+    tally.branches++;
+    NEXT_BLOCK();
+
+h_jzr:
+    CHARGE();
+    if (flag_res == 0) {
+        pc = (pc + (uint32_t)(int16_t)d->imm) & ADDR_MASK;
+        tally.branches++;
+    }
+    NEXT_BLOCK();
+
+h_jnzr:
+    CHARGE();
+    if (flag_res != 0) {
+        pc = (pc + (uint32_t)(int16_t)d->imm) & ADDR_MASK;
+        tally.branches++;
+    }
+    NEXT_BLOCK();
+
+    // The literal isn't cached, so a store to it needs no extra invalidation
+h_moviw:
+    regs[d->a] = mem_r16(cpu, pc);
+    pc += 2;
+    block += 2; // one instruction, two words
+    SET_ZS(regs[d->a]);
+    DISPATCH();
+
+    // ext2_eval() is inlined with a constant op, so each handler is just its case
+#define EXT2(op)                                                      \
+    do {                                                              \
+        regs[d->a] = ext2_eval((op), regs[d->a], regs[d->b], &flags); \
+        flag_op = FLAGOP_NONE;                                        \
+        SET_ZS(regs[d->a]);                                           \
+        DISPATCH();                                                   \
+    } while (0)
+
+h_mul:
+    EXT2(EXT2_MUL);
+h_mulh:
+    EXT2(EXT2_MULH);
+h_div:
+    EXT2(EXT2_DIV);
+h_mod:
+    EXT2(EXT2_MOD);
+h_shl:
+    EXT2(EXT2_SHL);
+h_shr:
+    EXT2(EXT2_SHR);
+h_sar:
+    EXT2(EXT2_SAR);
+
+h_unaligned:
+    pc += 2;
+    // fall through
+
+    // HALT, I/O, device accesses and unknown opcodes: spill, let cpu_step() handle it, reload
+h_slow:
+    pc -= 2;
+    CHARGE();
+    SPILL();
+    cpu_step(cpu);
+    cpu->budget -= !cpu->waiting;
+    if (cpu->halted || cpu->waiting)
+        return;
+    RELOAD();
+    NEXT_BLOCK();
+
+h_out:
+    SPILL();
+    return;
+
+#undef SPILL
+#undef RELOAD
+#undef DISPATCH
+#undef CHARGE
+#undef NEXT_BLOCK
+#undef SET_ZS
+#undef RECORD
+#undef RECORD_CMP
+#undef EXT2
+#else
+    cpu_run(cpu);
+#endif
+}
+
+/*
+ * =====================================
+ *          BASIC-BLOCK JIT
+ * =====================================
+ */
+
+/*
+    x86-64 only for now; every other host runs the threaded interpreter.
+    Guest R0-R7 live zero-extended in r8d-r15d, FLAGS in esi, the CPU in
+    rdi, cpu->mem in rbx, the entry table in rbp and cpu->budget in rdx
+    (saved around MUL/DIV, which need edx). Blocks enter and leave
+    through a shared trampoline and chain to each other through the entry
+    table, so invalidating a block is just clearing its table slot.
+*/
+#if VM_HAS_JIT
+
+#define JIT_HOT_THRESHOLD 64   // backward branches before a target is compiled
+#define JIT_HOT_NEVER 0xFF     // target can't be compiled, stop counting
+#define JIT_MAX_BLOCK 64       // guest instructions per block
+#define JIT_MAX_INSN_BYTES 128 // worst case native bytes per guest instruction
+#define JIT_CODE_SIZE (1 << 20)
+#define JIT_PAGE_SHIFT 8       // granularity of the "has code" bitmap
+
+#define JIT_ENTRY_SIZE ((size_t)(MEMORY_SIZE / 2) * sizeof(void *))
+#define JIT_HOT_SIZE ((size_t)(MEMORY_SIZE / 2))
+
+#define FLAGS_ALL (FLAG_ZERO | FLAG_SIGN | FLAG_CARRY | FLAG_OVERFLOW)
+
+typedef struct {
+    uint32_t start; // guest range [start, end)
+    uint32_t end;
+} JitBlock;
+
+typedef struct JitState {
+    uint8_t *code; // RWX buffer: trampoline first, then blocks
+    size_t code_start;
+    size_t code_used;
+    void **entry; // MEMORY_SIZE / 2 native entry points, NULL = interpret
+    uint8_t *hot; // backward-branch counters, one per slot
+    JitBlock *blocks;
+    size_t nblocks;
+    size_t cap;
+    void (*enter)(CPU *cpu, void *code);
+    uint8_t *exit_stub; // jumped to with the next guest pc in eax
+    uint8_t code_pages[MEMORY_SIZE >> JIT_PAGE_SHIFT];
+} JitState;
+
+typedef struct {
+    uint8_t *p;
+} Emit;
+
+static inline void emit8(Emit *e, uint8_t b) { *e->p++ = b; }
+
+static inline void emit32(Emit *e, uint32_t v)
+{
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+
+static inline void emit64(Emit *e, uint64_t v)
+{
+    memcpy(e->p, &v, 8);
+    e->p += 8;
+}
+
+// 0F 8x rel32 (x = 4 jz, 5 jnz) to an absolute target inside the buffer
+static void emit_jcc32(Emit *e, uint8_t cc, const uint8_t *target)
+{
+    emit8(e, 0x0F);
+    emit8(e, cc);
+    emit32(e, (uint32_t)(target - (e->p + 4)));
+}
+
+// Host register number for a guest register: R0-R7 -> r8-r15
+#define HREG(r) ((r) & 7)
+
+// [rdi + disp32] addressing for a CPU field, reg field = r
+static void emit_cpu_field(Emit *e, uint8_t r, size_t offset)
+{
+    emit8(e, 0x80 | ((r & 7) << 3) | 7);
+    emit32(e, (uint32_t)offset);
+}
+
+// add qword [rdi + offset], n for a GuestCounters field (inc for 1)
+static void emit_count(Emit *e, size_t offset, uint32_t n)
+{
+    emit8(e, 0x48);
+    if (n == 1) {
+        emit8(e, 0xFF);
+        emit_cpu_field(e, 0, offset);
+        return;
+    }
+    emit8(e, 0x81);
+    emit_cpu_field(e, 0, offset);
+    emit32(e, n);
+}
+
+#define COUNTER(field) offsetof(CPU, counters.field)
+
+// eax = next guest pc; jump straight into its block or leave to the host
+static void emit_chain(JitState *jit, Emit *e)
+{
+    emit8(e, 0x48); // test rdx, rdx
+    emit8(e, 0x85);
+    emit8(e, 0xD2);
+    emit_jcc32(e, 0x8E, jit->exit_stub); // jle: out of budget
+    emit8(e, 0xA8); // test al, 1
+    emit8(e, 0x01);
+    emit_jcc32(e, 0x85, jit->exit_stub);
+    emit8(e, 0x48); // mov rcx, [rbp + rax*4]
+    emit8(e, 0x8B);
+    emit8(e, 0x4C);
+    emit8(e, 0x85);
+    emit8(e, 0x00);
+    emit8(e, 0x48); // test rcx, rcx
+    emit8(e, 0x85);
+    emit8(e, 0xC9);
+    emit_jcc32(e, 0x84, jit->exit_stub);
+    emit8(e, 0xFF); // jmp rcx
+    emit8(e, 0xE1);
+}
+
+// Copy the host flags of the last op into the guest FLAGS bits in mask
+static void emit_flags(Emit *e, uint8_t mask)
+{
+    if (!mask)
+        return;
+
+    // mov doesn't touch EFLAGS, xor would
+    emit8(e, 0xB8); // mov eax, 0
+    emit32(e, 0);
+    emit8(e, 0xB9); // mov ecx, 0
+    emit32(e, 0);
+
+    if (mask & FLAG_ZERO) {
+        emit8(e, 0x0F); // setz al
+        emit8(e, 0x94);
+        emit8(e, 0xC0);
+    }
+
+    static const struct {
+        uint8_t flag, setcc, sib;
+    } bits[] = {
+        {FLAG_SIGN, 0x98, 0x48},     // sets cl; lea eax, [rax + rcx*2]
+        {FLAG_CARRY, 0x92, 0x88},    // setc cl; lea eax, [rax + rcx*4]
+        {FLAG_OVERFLOW, 0x90, 0xC8}, // seto cl; lea eax, [rax + rcx*8]
+    };
+
+    for (size_t i = 0; i < sizeof(bits) / sizeof(bits[0]); i++) {
+        if (!(mask & bits[i].flag))
+            continue;
+        emit8(e, 0x0F);
+        emit8(e, bits[i].setcc);
+        emit8(e, 0xC1);
+        emit8(e, 0x8D);
+        emit8(e, 0x04);
+        emit8(e, bits[i].sib);
+    }
+
+    emit8(e, 0x83); // and esi, ~mask
+    emit8(e, 0xE6);
+    emit8(e, (uint8_t)~mask);
+    emit8(e, 0x09); // or esi, eax
+    emit8(e, 0xC6);
+}
+
+// test r16, r16 so a plain register write can feed emit_flags()
+static void emit_test16(Emit *e, uint8_t r)
+{
+    emit8(e, 0x66);
+    emit8(e, 0x45);
+    emit8(e, 0x85);
+    emit8(e, 0xC0 | (HREG(r) << 3) | HREG(r));
+}
+
+// and esi, ~mask for guest flags an op always clears
+static void emit_clear_flags(Emit *e, uint8_t mask)
+{
+    if (!mask)
+        return;
+    emit8(e, 0x83);
+    emit8(e, 0xE6);
+    emit8(e, (uint8_t)~mask);
+}
+
+/*
+    OP_EXT2 reg1, reg2, need = flags to produce. 16-bit MUL already sets CF/OF
+    as the guest wants; DIV/MOD test for a zero divisor instead of trapping,
+    and the shift count is masked to 4 bits, where AND leaves CF clear for a
+    zero count. Z/S always come from a test of the result.
+*/
+static void emit_ext2(Emit *e, uint8_t ext2_op, uint8_t reg1, uint8_t reg2, uint8_t need)
+{
+    uint8_t co = need & (FLAG_CARRY | FLAG_OVERFLOW);
+
+    switch (ext2_op) {
+        case EXT2_MUL:
+        case EXT2_MULH:
+            emit8(e, 0x52); // push rdx
+            emit8(e, 0x44); // mov eax, reg1_32
+            emit8(e, 0x89);
+            emit8(e, 0xC0 | (HREG(reg1) << 3));
+            emit8(e, 0x66); // mul reg2_16: dx:ax = ax * reg2
+            emit8(e, 0x41);
+            emit8(e, 0xF7);
+            emit8(e, 0xE0 | HREG(reg2));
+            emit8(e, 0x44); // movzx reg1_32, ax / dx, keeps EFLAGS
+            emit8(e, 0x0F);
+            emit8(e, 0xB7);
+            emit8(e, (ext2_op == EXT2_MUL ? 0xC0 : 0xC2) | (HREG(reg1) << 3));
+            emit8(e, 0x5A); // pop rdx, keeps EFLAGS
+            emit_flags(e, co);
+            break;
+
+        case EXT2_DIV:
+        case EXT2_MOD: {
+            emit8(e, 0x52); // push rdx
+            emit_test16(e, reg2);
+            emit8(e, 0x74); // jz zero
+            uint8_t *zero = e->p++;
+            emit8(e, 0x31); // xor edx, edx
+            emit8(e, 0xD2);
+            emit8(e, 0x44); // mov eax, reg1_32
+            emit8(e, 0x89);
+            emit8(e, 0xC0 | (HREG(reg1) << 3));
+            emit8(e, 0x66); // div reg2_16: ax = dx:ax / reg2, dx = remainder
+            emit8(e, 0x41);
+            emit8(e, 0xF7);
+            emit8(e, 0xF0 | HREG(reg2));
+            emit8(e, 0x44); // movzx reg1_32, ax / dx
+            emit8(e, 0x0F);
+            emit8(e, 0xB7);
+            emit8(e, (ext2_op == EXT2_DIV ? 0xC0 : 0xC2) | (HREG(reg1) << 3));
+            if (ext2_op == EXT2_DIV) {
+                emit8(e, 0xEB); // jmp done
+                uint8_t *done = e->p++;
+                *zero = (uint8_t)(e->p - (zero + 1));
+                emit8(e, 0x41); // mov reg1_32, 0xFFFF
+                emit8(e, 0xB8 | HREG(reg1));
+                emit32(e, 0xFFFF);
+                *done = (uint8_t)(e->p - (done + 1));
+            } else {
+                *zero = (uint8_t)(e->p - (zero + 1)); // x % 0 leaves x
+            }
+            emit8(e, 0x5A); // pop rdx
+            emit_clear_flags(e, co);
+            break;
+        }
+
+        default: {
+            static const uint8_t shift[8] = {
+                [EXT2_SHL] = 0xE0, // /4
+                [EXT2_SHR] = 0xE8, // /5
+                [EXT2_SAR] = 0xF8, // /7
+            };
+            emit8(e, 0x44); // mov ecx, reg2_32
+            emit8(e, 0x89);
+            emit8(e, 0xC1 | (HREG(reg2) << 3));
+            emit8(e, 0x83); // and ecx, 15
+            emit8(e, 0xE1);
+            emit8(e, 0x0F);
+            emit8(e, 0x66); // shl/shr/sar reg1_16, cl
+            emit8(e, 0x41);
+            emit8(e, 0xD3);
+            emit8(e, shift[ext2_op] | HREG(reg1));
+            emit_flags(e, need & FLAG_CARRY);
+            emit_clear_flags(e, need & FLAG_OVERFLOW);
+            break;
+        }
+    }
+
+    if (need & (FLAG_ZERO | FLAG_SIGN))
+        emit_test16(e, reg1);
+    emit_flags(e, need & (FLAG_ZERO | FLAG_SIGN));
+}
+
+// Leave through a constant guest pc
+static void emit_exit(JitState *jit, Emit *e, uint32_t pc)
+{
+    emit8(e, 0xB8); // mov eax, pc
+    emit32(e, pc);
+    emit_chain(jit, e);
+}
+
+#define JIT_TARGET_PC 0xFF // emit_branch() target for an already known pc
+
+/*
+    Leave through regs[target] (or target_pc for JIT_TARGET_PC) when Z matches
+    jump_if_zero, else through next_pc
+*/
+static void emit_branch(JitState *jit, Emit *e, bool jump_if_zero, uint8_t target, uint32_t target_pc,
+                        uint32_t next_pc)
+{
+    emit8(e, 0xF7); // test esi, FLAG_ZERO
+    emit8(e, 0xC6);
+    emit32(e, FLAG_ZERO);
+    // Skip the taken path: JZ when Z is clear, JNZ when it's set
+    emit8(e, jump_if_zero ? 0x74 : 0x75);
+    uint8_t *skip = e->p++;
+    emit_count(e, COUNTER(branches), 1);
+    if (target == JIT_TARGET_PC) {
+        emit_exit(jit, e, target_pc);
+    } else {
+        emit8(e, 0x44); // mov eax, target32
+        emit8(e, 0x89);
+        emit8(e, 0xC0 | (HREG(target) << 3));
+        emit_chain(jit, e);
+    }
+    *skip = (uint8_t)(e->p - (skip + 1));
+    emit_exit(jit, e, next_pc);
+}
+
+static void jit_emit_trampoline(JitState *jit)
+{
+    Emit e = {jit->code};
+
+    // void enter(CPU *cpu /* rdi */, void *code /* rsi */)
+    jit->enter = (void (*)(CPU *, void *))(void *)e.p;
+    emit8(&e, 0x53); // push rbx
+    emit8(&e, 0x55); // push rbp
+    for (uint8_t r = 4; r < 8; r++) {
+        emit8(&e, 0x41); // push r12..r15
+        emit8(&e, 0x50 | r);
+    }
+    emit8(&e, 0x48); // mov rax, rsi
+    emit8(&e, 0x89);
+    emit8(&e, 0xF0);
+    emit8(&e, 0x48); // mov rbx, cpu->mem
+    emit8(&e, 0x8B);
+    emit_cpu_field(&e, 3, offsetof(CPU, mem));
+    emit8(&e, 0x48); // mov rbp, imm64
+    emit8(&e, 0xBD);
+    emit64(&e, (uint64_t)(uintptr_t)jit->entry);
+    for (uint8_t r = 0; r < NUMS_R; r++) {
+        emit8(&e, 0x44); // movzx r8d+r, word [rdi + regs[r]]
+        emit8(&e, 0x0F);
+        emit8(&e, 0xB7);
+        emit_cpu_field(&e, r, offsetof(CPU, regs) + r * sizeof(uint16_t));
+    }
+    emit8(&e, 0x0F); // movzx esi, byte [rdi + flags]
+    emit8(&e, 0xB6);
+    emit_cpu_field(&e, 6, offsetof(CPU, flags));
+    emit8(&e, 0x48); // mov rdx, [rdi + budget]
+    emit8(&e, 0x8B);
+    emit_cpu_field(&e, 2, offsetof(CPU, budget));
+    emit8(&e, 0xFF); // jmp rax
+    emit8(&e, 0xE0);
+
+    // Exit: eax = next guest pc
+    jit->exit_stub = e.p;
+    emit8(&e, 0x89); // mov [rdi + pc], eax
+    emit_cpu_field(&e, 0, offsetof(CPU, pc));
+    for (uint8_t r = 0; r < NUMS_R; r++) {
+        emit8(&e, 0x66); // mov word [rdi + regs[r]], r8w+r
+        emit8(&e, 0x44);
+        emit8(&e, 0x89);
+        emit_cpu_field(&e, r, offsetof(CPU, regs) + r * sizeof(uint16_t));
+    }
+    emit8(&e, 0x40); // mov byte [rdi + flags], sil
+    emit8(&e, 0x88);
+    emit_cpu_field(&e, 6, offsetof(CPU, flags));
+    emit8(&e, 0x48); // mov [rdi + budget], rdx
+    emit8(&e, 0x89);
+    emit_cpu_field(&e, 2, offsetof(CPU, budget));
+    for (uint8_t r = 7; r >= 4; r--) {
+        emit8(&e, 0x41); // pop r15..r12
+        emit8(&e, 0x58 | r);
+    }
+    emit8(&e, 0x5D); // pop rbp
+    emit8(&e, 0x5B); // pop rbx
+    emit8(&e, 0xC3); // ret
+
+    jit->code_start = jit->code_used = (size_t)(e.p - jit->code);
+}
+
+static JitState *jit_create(void)
+{
+    JitState *jit = calloc(1, sizeof(JitState));
+    if (!jit)
+        return NULL;
+
+    jit->entry = vm_zalloc(JIT_ENTRY_SIZE);
+    jit->hot = vm_zalloc(JIT_HOT_SIZE);
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!jit->entry || !jit->hot || jit->code == MAP_FAILED) {
+        if (jit->code != MAP_FAILED)
+            munmap(jit->code, JIT_CODE_SIZE);
+        vm_zfree(jit->entry, JIT_ENTRY_SIZE);
+        vm_zfree(jit->hot, JIT_HOT_SIZE);
+        free(jit);
+        return NULL;
+    }
+
+    jit_emit_trampoline(jit);
+    return jit;
+}
+
+static void jit_destroy(JitState *jit)
+{
+    if (jit) {
+        munmap(jit->code, JIT_CODE_SIZE);
+        vm_zfree(jit->entry, JIT_ENTRY_SIZE);
+        vm_zfree(jit->hot, JIT_HOT_SIZE);
+        free(jit->blocks);
+        free(jit);
+    }
+}
+
+// Drop every block; used when the code buffer fills up
+static void jit_flush(JitState *jit)
+{
+    for (size_t i = 0; i < jit->nblocks; i++)
+        jit->entry[jit->blocks[i].start >> 1] = NULL;
+    jit->nblocks = 0;
+    jit->code_used = jit->code_start;
+    memset(jit->code_pages, 0, sizeof(jit->code_pages));
+}
+
+// Forget all blocks and profile counts, e.g. after guest memory was replaced
+static void jit_reset(JitState *jit)
+{
+    jit_flush(jit);
+    vm_zreset(jit->hot, JIT_HOT_SIZE);
+}
+
+static void jit_invalidate(JitState *jit, uint32_t addr, uint32_t len)
+{
+    uint32_t lo = addr & ADDR_MASK;
+    uint32_t hi = lo + len;
+    bool has_code = false;
+
+    // Block ops write whole ranges, so look at every page they touch
+    for (uint32_t page = lo >> JIT_PAGE_SHIFT; len && page <= (hi - 1) >> JIT_PAGE_SHIFT && !has_code; page++)
+        has_code = jit->code_pages[page & ((MEMORY_SIZE >> JIT_PAGE_SHIFT) - 1)];
+    if (!has_code)
+        return;
+
+    for (size_t i = 0; i < jit->nblocks;) {
+        JitBlock *b = &jit->blocks[i];
+        if (b->start < hi && lo < b->end) {
+            jit->entry[b->start >> 1] = NULL;
+            jit->hot[b->start >> 1] = 0;
+            *b = jit->blocks[--jit->nblocks];
+        } else {
+            i++;
+        }
+    }
+}
+
+// Flags each instruction writes, used for the backward liveness pass
+static uint8_t jit_flags_written(uint16_t instr)
+{
+    switch (instr >> 12) {
+        case OP_MOV:
+        case OP_MOVI:
+            return FLAG_ZERO | FLAG_SIGN;
+        case OP_CMP:
+            return FLAG_ZERO | FLAG_SIGN | FLAG_CARRY;
+        case OP_FUSE:
+            switch ((instr >> 9) & 0x7) {
+                case FUSE_DJNZ:
+                case FUSE_SJNZ:
+                    return FLAGS_ALL;
+                case FUSE_CJZ:
+                case FUSE_CJNZ:
+                    return FLAG_ZERO | FLAG_SIGN | FLAG_CARRY; // as OP_CMP
+                case FUSE_MOVIW:
+                    return FLAG_ZERO | FLAG_SIGN;
+            }
+            return 0;
+        case OP_EXT2:
+            return FLAGS_ALL;
+        case OP_EXT:
+            switch ((instr >> 9) & 0x7) {
+                case EXT_ADD:
+                case EXT_SUB:
+                    return FLAGS_ALL;
+                case EXT_LOAD:
+                case EXT_AND:
+                case EXT_OR:
+                case EXT_XOR:
+                    return FLAG_ZERO | FLAG_SIGN;
+            }
+            return 0;
+    }
+    return 0;
+}
+
+static bool jit_can_compile(uint16_t instr)
+{
+    switch (instr >> 12) {
+        case OP_NOP:
+        case OP_MOV:
+        case OP_MOVI:
+        case OP_CMP:
+        case OP_JMP:
+        case OP_JZ:
+        case OP_JNZ:
+            return true;
+        case OP_FUSE:
+            return true;
+        case OP_EXT2:
+            return ((instr >> 9) & 0x7) <= EXT2_SAR;
+        case OP_EXT:
+            switch ((instr >> 9) & 0x7) {
+                case EXT_LOAD:
+                case EXT_ADD:
+                case EXT_SUB:
+                case EXT_AND:
+                case EXT_OR:
+                case EXT_XOR:
+                    return true;
+            }
+            return false;
+    }
+    // HALT, stack ops, I/O, EXT_STORE/RET and unknown opcodes stay interpreted
+    return false;
+}
+
+// Every OP_FUSE form except FUSE_MOVIW is a branch
+static bool jit_is_branch(uint16_t instr)
+{
+    uint8_t op = instr >> 12;
+    if (op == OP_FUSE)
+        return ((instr >> 9) & 0x7) != FUSE_MOVIW;
+    return op == OP_JMP || op == OP_JZ || op == OP_JNZ;
+}
+
+static bool jit_compile(CPU *cpu, JitState *jit, uint32_t start)
+{
+    uint16_t instrs[JIT_MAX_BLOCK];
+    uint32_t pcs[JIT_MAX_BLOCK + 1]; // pcs[n] is the pc after the block
+    uint8_t need[JIT_MAX_BLOCK];
+    size_t n = 0;
+    bool ends_in_branch = false;
+
+    // Collect the block: stop at a branch (included) or an op we can't compile
+    uint32_t pc = start;
+    while (n < JIT_MAX_BLOCK && pc + 2 <= MEMORY_SIZE) {
+        uint16_t instr = mem_r16(cpu, pc);
+        bool wide = (instr >> 12) == OP_FUSE && ((instr >> 9) & 0x7) == FUSE_MOVIW;
+        // With devices attached a load might hit the bus, leave it to cpu_step()
+        bool bus_load = cpu->mmio_size && (instr >> 12) == OP_EXT && ((instr >> 9) & 0x7) == EXT_LOAD;
+        if (!jit_can_compile(instr) || bus_load || (wide && pc + 4 > MEMORY_SIZE))
+            break;
+        pcs[n] = pc;
+        instrs[n++] = instr;
+        pc += wide ? 4 : 2;
+        if (jit_is_branch(instr)) {
+            ends_in_branch = true;
+            break;
+        }
+    }
+    pcs[n] = pc;
+    if (n == 0)
+        return false;
+
+    // Only the last writer of each flag before an exit has to produce it
+    uint8_t live = FLAGS_ALL;
+    for (size_t i = n; i-- > 0;) {
+        uint8_t written = jit_flags_written(instrs[i]);
+        need[i] = written & live;
+        live &= ~written;
+        if (jit_is_branch(instrs[i]))
+            live |= FLAGS_ALL; // both outcomes leave the block
+    }
+
+    if (JIT_CODE_SIZE - jit->code_used < (n + 2) * JIT_MAX_INSN_BYTES)
+        jit_flush(jit);
+    if (jit->nblocks == jit->cap) {
+        size_t cap = jit->cap ? jit->cap * 2 : 64;
+        JitBlock *blocks = realloc(jit->blocks, cap * sizeof(JitBlock));
+        if (!blocks)
+            return false;
+        jit->blocks = blocks;
+        jit->cap = cap;
+    }
+
+    uint8_t *native = jit->code + jit->code_used;
+    Emit e = {native};
+
+    // The whole block is charged on entry, emit_chain() checks before moving on
+    emit8(&e, 0x48); // sub rdx, n
+    emit8(&e, 0x83);
+    emit8(&e, 0xEA);
+    emit8(&e, (uint8_t)n);
+
+    // Blocks have no side exits, so their loads can be counted up front too
+    uint32_t loads = 0;
+    for (size_t i = 0; i < n; i++)
+        loads += (instrs[i] >> 12) == OP_EXT && ((instrs[i] >> 9) & 0x7) == EXT_LOAD;
+    if (loads)
+        emit_count(&e, COUNTER(bytes_loaded), 2 * loads);
+
+    for (size_t i = 0; i < n; i++) {
+        uint16_t instr = instrs[i];
+        uint8_t op = instr >> 12;
+        uint8_t dst = (instr >> 9) & 0x7;
+        uint8_t src = (instr >> 6) & 0x7;
+        uint32_t next_pc = pcs[i + 1] & ADDR_MASK;
+
+        switch (op) {
+            case OP_NOP:
+                break;
+
+            case OP_MOV:
+                emit8(&e, 0x45); // mov dst32, src32
+                emit8(&e, 0x89);
+                emit8(&e, 0xC0 | (HREG(src) << 3) | HREG(dst));
+                if (need[i])
+                    emit_test16(&e, dst);
+                emit_flags(&e, need[i]);
+                break;
+
+            case OP_MOVI: {
+                uint16_t imm9 = instr & 0x1FF;
+                uint16_t value = (imm9 & 0x100) ? (imm9 | 0xFE00) : imm9;
+                emit8(&e, 0x41); // mov dst32, imm32
+                emit8(&e, 0xB8 | HREG(dst));
+                emit32(&e, value);
+                if (need[i])
+                    emit_test16(&e, dst);
+                emit_flags(&e, need[i]);
+                break;
+            }
+
+            case OP_CMP:
+                emit8(&e, 0x66); // cmp dst16, src16
+                emit8(&e, 0x45);
+                emit8(&e, 0x39);
+                emit8(&e, 0xC0 | (HREG(src) << 3) | HREG(dst));
+                emit_flags(&e, need[i]);
+                break;
+
+            case OP_JMP:
+                emit_count(&e, COUNTER(branches), 1);
+                emit8(&e, 0x44); // mov eax, dst32
+                emit8(&e, 0x89);
+                emit8(&e, 0xC0 | (HREG(dst) << 3));
+                emit_chain(jit, &e);
+                break;
+
+            case OP_JZ:
+            case OP_JNZ:
+                emit_branch(jit, &e, op == OP_JZ, dst, 0, next_pc);
+                break;
+
+            case OP_FUSE: {
+                uint8_t reg1 = src;
+                uint8_t reg2 = (instr >> 3) & 0x7;
+                uint8_t target = instr & 0x7;
+
+                if (dst == FUSE_MOVIW) {
+                    emit8(&e, 0x41); // mov reg1_32, literal
+                    emit8(&e, 0xB8 | HREG(reg1));
+                    emit32(&e, mem_r16(cpu, pcs[i] + 2));
+                    if (need[i])
+                        emit_test16(&e, reg1);
+                    emit_flags(&e, need[i]);
+                    break;
+                }
+                if (dst >= FUSE_JMPR) {
+                    uint16_t imm9 = instr & 0x1FF;
+                    int16_t disp = (int16_t)((imm9 & 0x100) ? (imm9 | 0xFE00) : imm9);
+                    uint32_t target_pc = (next_pc + (uint32_t)(disp * 2)) & ADDR_MASK;
+                    if (dst == FUSE_JMPR) {
+                        emit_count(&e, COUNTER(branches), 1);
+                        emit_exit(jit, &e, target_pc);
+                    } else {
+                        emit_branch(jit, &e, dst == FUSE_JZR, JIT_TARGET_PC, target_pc, next_pc);
+                    }
+                    break;
+                }
+                if (dst == FUSE_DJNZ) {
+                    emit8(&e, 0x66); // sub reg1_16, 1
+                    emit8(&e, 0x41);
+                    emit8(&e, 0x83);
+                    emit8(&e, 0xE8 | HREG(reg1));
+                    emit8(&e, 0x01);
+                    target = reg2;
+                } else {
+                    emit8(&e, 0x66); // sub/cmp reg1_16, reg2_16
+                    emit8(&e, 0x45);
+                    emit8(&e, dst == FUSE_SJNZ ? 0x29 : 0x39);
+                    emit8(&e, 0xC0 | (HREG(reg2) << 3) | HREG(reg1));
+                }
+                emit_flags(&e, need[i]);
+                emit_branch(jit, &e, dst == FUSE_CJZ, target, 0, next_pc);
+                break;
+            }
+
+            case OP_EXT2:
+                emit_ext2(&e, dst, src, (instr >> 3) & 0x7, need[i]);
+                break;
+
+            case OP_EXT: {
+                uint8_t ext_op = dst;
+                uint8_t reg1 = src;
+                uint8_t reg2 = (instr >> 3) & 0x7;
+                static const uint8_t alu[8] = {
+                    [EXT_ADD] = 0x01,
+                    [EXT_SUB] = 0x29,
+                    [EXT_AND] = 0x21,
+                    [EXT_OR] = 0x09,
+                    [EXT_XOR] = 0x31,
+                };
+
+                if (ext_op == EXT_LOAD) {
+                    // 16-bit addresses never reach the ADDR_MASK wrap
+                    emit8(&e, 0x41); // movzx eax, reg2_16
+                    emit8(&e, 0x0F);
+                    emit8(&e, 0xB7);
+                    emit8(&e, 0xC0 | HREG(reg2));
+                    emit8(&e, 0x44); // movzx reg1_32, word [rbx + rax]
+                    emit8(&e, 0x0F);
+                    emit8(&e, 0xB7);
+                    emit8(&e, 0x04 | (HREG(reg1) << 3));
+                    emit8(&e, 0x03);
+                    if (need[i])
+                        emit_test16(&e, reg1);
+                } else {
+                    emit8(&e, 0x66); // op reg1_16, reg2_16
+                    emit8(&e, 0x45);
+                    emit8(&e, alu[ext_op]);
+                    emit8(&e, 0xC0 | (HREG(reg2) << 3) | HREG(reg1));
+                }
+                emit_flags(&e, need[i]);
+                break;
+            }
+        }
+    }
+
+    if (!ends_in_branch)
+        emit_exit(jit, &e, pc & ADDR_MASK); // the first uncompiled instruction
+
+    jit->code_used += (size_t)(e.p - native);
+    jit->blocks[jit->nblocks++] = (JitBlock){start, pc};
+    for (uint32_t page = start >> JIT_PAGE_SHIFT; page <= (pc - 1) >> JIT_PAGE_SHIFT; page++)
+        jit->code_pages[page & ((MEMORY_SIZE >> JIT_PAGE_SHIFT) - 1)] = 1;
+    jit->entry[start >> 1] = native;
+    return true;
+}
+
+#else
+
+static void jit_destroy(JitState *jit) { (void)jit; }
+
+static void jit_reset(JitState *jit) { (void)jit; }
+
+static void jit_invalidate(JitState *jit, uint32_t addr, uint32_t len)
+{
+    (void)jit;
+    (void)addr;
+    (void)len;
+}
+
+#endif
+
+#if VM_HAS_JIT
+// One more visit to target; compiles it once hot unless it already has a block
+static inline void jit_count(CPU *cpu, JitState *jit, uint32_t target)
+{
+    if ((target & 1) || jit->entry[target >> 1])
+        return;
+    uint8_t *hot = &jit->hot[target >> 1];
+    if (*hot != JIT_HOT_NEVER && ++*hot >= JIT_HOT_THRESHOLD)
+        *hot = jit_compile(cpu, jit, target) ? 0 : JIT_HOT_NEVER;
+}
+#endif
+
+/*
+    Interprets with cpu_step() and counts taken backward branches and exits
+    from native code; once a target is hot its block is compiled and later visits run natively until
+    they reach something the JIT leaves to the interpreter.
+*/
+void cpu_run_jit(CPU *cpu)
+{
+#if VM_HAS_JIT
+    if (cpu->halted || cpu->budget <= 0)
+        return;
+
+    if (!cpu->jit && !(cpu->jit = jit_create())) {
+        cpu_run_threaded(cpu);
+        return;
+    }
+
+    JitState *jit = cpu->jit;
+    while (!cpu->halted && !cpu->waiting && cpu->budget > 0) {
+        uint32_t pc = cpu->pc;
+
+        // Compiled code addresses memory with plain 16-bit offsets
+        if (cpu_segmented(cpu)) {
+            cpu_run_threaded(cpu);
+            return;
+        }
+
+        if (!(pc & 1) && pc <= ADDR_MASK && jit->entry[pc >> 1]) {
+            // Native code keeps FLAGS fully materialized in a host register
+            cpu->flags = cpu_get_flags(cpu);
+            jit->enter(cpu, jit->entry[pc >> 1]);
+            cpu_set_flags(cpu, cpu->flags);
+
+            // Frequent side exits (a not-taken fused branch, say) get their own block
+            jit_count(cpu, jit, cpu->pc);
+            continue;
+        }
+
+        uint8_t opcode = mem_r8(cpu, pc + 1) >> 4;
+        cpu_step(cpu);
+        cpu->budget -= !cpu->waiting;
+
+        if ((opcode == OP_JMP || opcode == OP_JZ || opcode == OP_JNZ || opcode == OP_FUSE) &&
+            cpu->pc <= pc)
+            jit_count(cpu, jit, cpu->pc);
+    }
+#else
+    cpu_run_threaded(cpu);
+#endif
+}
+
+// Credit the instructions cpu->budget was charged for since the last call
+static void counters_settle(CPU *cpu)
+{
+    cpu->counters.instructions += (uint64_t)(cpu->budget_start - cpu->budget);
+    cpu->budget_start = cpu->budget;
+}
+
+/*
+    Run at most about max_instructions, then return so the caller can do
+    something else with the thread; calling it again carries on where it
+    stopped. The budget is checked per basic block (the switch engine checks
+    every instruction), so a slice may overrun it by the rest of a block.
+*/
+RunStatus cpu_run_for(CPU *cpu, Engine engine, uint64_t max_instructions)
+{
+    PROFILE(engine = ENGINE_SWITCH);
+    if (cpu->trace)
+        engine = ENGINE_SWITCH;
+    cpu->budget = max_instructions > INT64_MAX ? INT64_MAX : (int64_t)max_instructions;
+    cpu->budget_start = cpu->budget;
+    cpu->waiting = false;
+
+    // Only the switch engine has a verified path, and only from the entry point
+    if (cpu->verify_pending) {
+        if (engine == ENGINE_SWITCH && !cpu->trace)
+            cpu_verify(cpu, NULL);
+        cpu->verify_pending = false;
+    }
+
+    switch (engine) {
+        case ENGINE_THREADED:
+            cpu_run_threaded(cpu);
             break;
+        case ENGINE_JIT:
+            cpu_run_jit(cpu);
+            break;
+        case ENGINE_SWITCH:
+        default:
+            cpu_run(cpu);
+            break;
+    }
+    counters_settle(cpu);
+
+    if (cpu->halted)
+        return RUN_HALTED;
+    return cpu->waiting ? RUN_WAITING : RUN_BUDGET;
+}
+
+// Run to HALT, or until the guest parks on polled input
+void cpu_execute(CPU *cpu, Engine engine)
+{
+    cpu_run_for(cpu, engine, UINT64_MAX);
+}
+
+/*
+    Guest work since the VM was created, wiped, reset to or cloned from a
+    snapshot, or since cpu_reset_counters(). Exact between runs; from an
+    output sink or a device, i.e. in the middle of one, it is up to date to
+    the current instruction. Only reads the CPU, but none of this is
+    atomic: call it from the thread running the VM, or once that run has
+    returned, never from another thread while it's going.
+*/
+GuestCounters cpu_get_counters(const CPU *cpu)
+{
+    GuestCounters c = cpu->counters;
+    c.instructions += (uint64_t)(cpu->budget_start - cpu->budget);
+    return c;
+}
+
+void cpu_reset_counters(CPU *cpu)
+{
+    counters_settle(cpu);
+    cpu->counters = (GuestCounters){0};
+}
+
+void cpu_dump(CPU *cpu)
+{
+    printf("\n=== CPU State ===\n");
+    printf("PC: 0x%05X  SP: 0x%05X\n", cpu->pc, cpu->sp);
+    printf("Flags: Z=%d S=%d C=%d O=%d\n",
+           get_flag(cpu, FLAG_ZERO),
+           get_flag(cpu, FLAG_SIGN),
+           get_flag(cpu, FLAG_CARRY),
+           get_flag(cpu, FLAG_OVERFLOW));
+
+    printf("Registers:\n");
+    for (int i = 0; i < NUMS_R; i++) {
+        printf("  R%d: 0x%04X (%d)\n", i, cpu->regs[i], (int16_t)cpu->regs[i]);
+    }
+    printf("=================\n\n");
+}
+
+/*
+ * =====================================
+ *            IMAGE LOADER
+ * =====================================
+ */
+
+#define IMAGE_MAGIC "cbin" // optional 4-byte header of a raw image, see asm_parser/README.md
+#define IMAGE_ENTRY UINT32_MAX // cpu_load_image(): the image's own entry point
+
+/*
+    Sectioned image, all fields little-endian:
+
+        header   "VMIM", u16 version, u16 nsections, u32 entry,
+                 u32 symbol table offset, u32 relocation table offset (0 = none)
+        sections nsections x {u8 type, 3 pad, u32 addr, u32 size, u32 file offset}
+        symbols  u32 count, count x {u32 addr, u8 length, name}
+        relocs   u32 count, count x u32 (addr | kind << 28)
+
+    CODE and DATA are copied (or mapped) from the file, BSS is only zeroed.
+    Addresses are as assembled; loading at another address adds the
+    difference to every section, the entry point and each relocation.
+*/
+#define IMAGE_SECTIONED_MAGIC "VMIM"
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER_SIZE 20
+#define IMAGE_SECTION_SIZE 16
+
+typedef enum {
+    SECTION_CODE = 1,
+    SECTION_DATA = 2,
+    SECTION_BSS = 3,
+} SectionType;
+
+typedef enum {
+    RELOC_WORD = 0, // a 16-bit absolute address (the MOVIW literal)
+    RELOC_IMM9 = 1, // the imm9 field of a MOVI, has to stay in range
+} RelocKind;
+
+static inline uint32_t image_u32(const uint8_t *p)
+{
+    return (uint32_t)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
 
-        case OP_STDOUT: {
-            if (dst == 0) {
-                // String follows immediately after this instruction
-                char *str = (char *)(cpu->mem + cpu->pc);
-                printf("%s", str);
-                cpu->pc += strlen(str) + 1; // Skip string + null terminator
-                // Align to 2-byte boundary
-                if (cpu->pc & 1)
-                    cpu->pc++;
-            } else if (dst == 1) {
-                // Print register value as number
-                printf("%d", (int16_t)cpu->regs[src]);
-            } else if (dst == 2) {
-                // Print string from memory address stored in SRC register
-                uint32_t addr = cpu->regs[src] & ADDR_MASK;
-                char *str = (char *)(cpu->mem + addr);
-                printf("%s", str);
-            } else if (dst == 3) {
-                printf("%c", (char)(cpu->regs[src] & 0xFF));
-            }
+static inline uint16_t image_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
 
-            break;
+/*
+    Put len bytes at file offset off into guest memory at addr. Where both
+    are page aligned, whole pages are mapped copy-on-write over guest memory
+    so they are only read in when the guest touches them; the rest is copied,
+    wrapping around the top of memory like mem_w8().
+*/
+static void image_place(CPU *cpu, int fd, const uint8_t *image, size_t off, size_t len, uint32_t addr)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapped = 0;
+    if (addr % page == 0 && off % page == 0 && addr + len <= MEMORY_SIZE) {
+        size_t whole = len - len % page;
+        if (whole && mmap(cpu->mem + addr, whole, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_FIXED, fd, (off_t)off) != MAP_FAILED)
+            mapped = whole;
+    }
+
+    size_t rest = len - mapped;
+    uint32_t at = (addr + (uint32_t)mapped) & ADDR_MASK;
+    size_t first = rest < (size_t)(MEMORY_SIZE - at) ? rest : (size_t)(MEMORY_SIZE - at);
+    memcpy(cpu->mem + at, image + off + mapped, first);
+    memcpy(cpu->mem, image + off + mapped + first, rest - first);
+    icache_invalidate(cpu, addr, (uint32_t)len);
+}
+
+// Zero [addr, addr + len) without committing pages that already read as zero
+static void image_zero(CPU *cpu, uint32_t addr, uint32_t len)
+{
+    while (len) {
+        uint32_t n = mem_span(addr, len < 4096 ? len : 4096);
+        uint8_t *p = cpu->mem + (addr & ADDR_MASK);
+        if (p[0] != 0 || memcmp(p, p + 1, n - 1) != 0) {
+            memset(p, 0, n);
+            icache_invalidate(cpu, addr, n);
         }
+        addr += n;
+        len -= n;
+    }
+}
 
-        case OP_STDIN: {
-            // dst field: 0 = read string into memory address in src register
-            //            1 = read number into src register
-            // src field: register to store in
+// Offset and count of a table, false if it runs past the end of the file
+static bool image_table(const uint8_t *image, size_t size, uint32_t off, size_t entry_min,
+                        uint32_t *count)
+{
+    if (off == 0) {
+        *count = 0;
+        return true;
+    }
+    if (off > size || size - off < 4)
+        return false;
+    *count = image_u32(image + off);
+    return *count <= (size - off - 4) / entry_min;
+}
 
-            if (dst == 0) {
-                uint32_t addr = cpu->regs[src] & ADDR_MASK;
-                char buf[256];
-
-                if (fgets(buf, sizeof(buf), stdin)) {
-                    // trim the newline
-                    size_t len = strlen(buf);
-                    if (len > 0 && buf[len - 1] == '\n') {
-                        buf[len - 1] = '\0';
-                    }
+/*
+    The word an image holds at assembled address addr, from the last CODE or
+    DATA section covering it (sections are placed in order). False if none
+    does, a relocation has nothing to patch there.
+*/
+static bool image_word(const uint8_t *image, uint16_t nsections, uint32_t addr, uint16_t *word)
+{
+    for (uint16_t i = nsections; i-- > 0;) {
+        const uint8_t *s = image + IMAGE_HEADER_SIZE + (size_t)i * IMAGE_SECTION_SIZE;
+        uint32_t start = image_u32(s + 4), len = image_u32(s + 8);
+        if (addr < start || addr - start + 2 > len)
+            continue;
+        if (s[0] == SECTION_BSS)
+            return false;
+        *word = image_u16(image + image_u32(s + 12) + (addr - start));
+        return true;
+    }
+    return false;
+}
 
-                    // Copying to memory
-                    strcpy((char *)(cpu->mem + addr), buf);
-                }
-            } else {
-                int value;
-                if (scanf("%d", &value) == 1) {
-                    cpu->regs[src] = (uint16_t)value;
-                    update_flags(cpu, cpu->regs[src]);
-                }
+// The assembled value in a RELOC_IMM9 MOVI
+static inline int32_t reloc_imm9(uint16_t instr)
+{
+    return (int16_t)((instr & 0x100) ? (instr | 0xFE00) : (instr & 0x1FF));
+}
 
-                int c;
-                while ((c = getchar()) != '\n' && c != EOF)
-                    ;
-            }
-            break;
+// Whether a kind relocation of word still fits its field once moved up by load_addr
+static bool reloc_fits(uint32_t kind, uint16_t word, uint32_t load_addr)
+{
+    if (kind == RELOC_WORD)
+        return word + load_addr <= 0xFFFF;
+    int32_t value = reloc_imm9(word) + (int32_t)load_addr;
+    return value >= -256 && value <= 255;
+}
+
+static bool image_load_sectioned(CPU *cpu, const char *path, int fd, const uint8_t *image,
+                                 size_t size, uint32_t load_addr, uint32_t *entry)
+{
+    if (size < IMAGE_HEADER_SIZE || image_u16(image + 4) != IMAGE_VERSION) {
+        fprintf(stderr, "%s: unsupported image version\n", path);
+        return false;
+    }
+
+    uint16_t nsections = image_u16(image + 6);
+    uint32_t symtab = image_u32(image + 12);
+    uint32_t reltab = image_u32(image + 16);
+    uint32_t nsymbols, nrelocs;
+    if (size < IMAGE_HEADER_SIZE + (size_t)nsections * IMAGE_SECTION_SIZE ||
+        !image_table(image, size, symtab, 5, &nsymbols) ||
+        !image_table(image, size, reltab, 4, &nrelocs)) {
+        fprintf(stderr, "%s: truncated image\n", path);
+        return false;
+    }
+
+    // Check everything before touching guest memory
+    for (uint16_t i = 0; i < nsections; i++) {
+        const uint8_t *s = image + IMAGE_HEADER_SIZE + (size_t)i * IMAGE_SECTION_SIZE;
+        uint32_t addr = image_u32(s + 4), len = image_u32(s + 8), off = image_u32(s + 12);
+        if (s[0] < SECTION_CODE || s[0] > SECTION_BSS) {
+            fprintf(stderr, "%s: section %u has unknown type %u\n", path, i, s[0]);
+            return false;
+        }
+        if (len > MEMORY_SIZE || addr > ADDR_MASK) {
+            fprintf(stderr, "%s: section %u doesn't fit guest memory\n", path, i);
+            return false;
         }
+        if (s[0] != SECTION_BSS && (off > size || size - off < len)) {
+            fprintf(stderr, "%s: section %u runs past the end of the file\n", path, i);
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < nrelocs; i++) {
+        uint32_t r = image_u32(image + reltab + 4 + (size_t)i * 4);
+        uint16_t word;
+        if (r >> 28 > RELOC_IMM9) {
+            fprintf(stderr, "%s: relocation %u has unknown kind %u\n", path, i, r >> 28);
+            return false;
+        }
+        if (!image_word(image, nsections, r & ADDR_MASK, &word)) {
+            fprintf(stderr, "%s: relocation %u at 0x%05X isn't in a CODE or DATA section\n", path, i,
+                    r & ADDR_MASK);
+            return false;
+        }
+        if (!reloc_fits(r >> 28, word, load_addr)) {
+            fprintf(stderr, "%s: address at 0x%05X doesn't fit %s once loaded at 0x%05X\n", path,
+                    r & ADDR_MASK, r >> 28 == RELOC_WORD ? "16 bits" : "MOVI", load_addr);
+            return false;
+        }
+    }
 
-        case OP_EXT: {
-            uint8_t ext_op = dst;              // Bits 9-11 = extended opcode
-            uint8_t reg1 = src;                // Bits 6-8 = first register
-            uint8_t reg2 = (instr >> 3) & 0x7; // Bits 3-5 = second register
+    // The code is everything from the first CODE section to the end of the last
+    uint32_t code_lo = MEMORY_SIZE, code_hi = 0;
+    for (uint16_t i = 0; i < nsections; i++) {
+        const uint8_t *s = image + IMAGE_HEADER_SIZE + (size_t)i * IMAGE_SECTION_SIZE;
+        uint32_t addr = (image_u32(s + 4) + load_addr) & ADDR_MASK;
+        uint32_t len = image_u32(s + 8);
+        if (s[0] == SECTION_BSS)
+            image_zero(cpu, addr, len);
+        else
+            image_place(cpu, fd, image, image_u32(s + 12), len, addr);
+        if (s[0] == SECTION_CODE && len) {
+            code_lo = addr < code_lo ? addr : code_lo;
+            code_hi = addr + len > code_hi ? addr + len : code_hi; // past MEMORY_SIZE if it wraps
+        }
+    }
+    cpu->code_lo = code_hi <= MEMORY_SIZE ? code_lo : 0;
+    cpu->code_hi = code_hi <= MEMORY_SIZE ? code_hi : 0;
 
-            switch (ext_op) {
-                case EXT_ADD: {
-                    uint32_t result = (uint32_t)cpu->regs[reg1] + (uint32_t)cpu->regs[reg2];
-                    set_flag(cpu, FLAG_CARRY, result > 0xFFFF);
+    // All checked above, so these can't fail halfway
+    for (uint32_t i = 0; i < nrelocs; i++) {
+        uint32_t r = image_u32(image + reltab + 4 + (size_t)i * 4);
+        uint32_t at = ((r & ADDR_MASK) + load_addr) & ADDR_MASK;
+        uint16_t word = mem_r16(cpu, at);
+        if (r >> 28 == RELOC_WORD) {
+            cpu_store16(cpu, at, (uint16_t)(word + load_addr));
+            continue;
+        }
+        int32_t value = reloc_imm9(word) + (int32_t)load_addr;
+        cpu_store16(cpu, at, (uint16_t)((word & ~0x1FF) | (value & 0x1FF)));
+    }
 
-                    bool r1_sign = (cpu->regs[reg1] & 0x8000) != 0;
-                    bool r2_sign = (cpu->regs[reg2] & 0x8000) != 0;
-                    bool res_sign = (result & 0x8000) != 0;
-                    bool overflow = (r1_sign == r2_sign) && (r1_sign != res_sign);
-                    set_flag(cpu, FLAG_OVERFLOW, overflow);
+#ifdef VM_PROFILE
+    if (cpu->profile) {
+        const uint8_t *p = image + symtab + 4;
+        const uint8_t *end = image + size;
+        for (uint32_t i = 0; i < nsymbols && end - p >= 5 && end - (p + 5) >= p[4]; i++) {
+            char name[256];
+            memcpy(name, p + 5, p[4]);
+            name[p[4]] = '\0';
+            profile_add_symbol(cpu->profile, name, image_u32(p) + load_addr);
+            p += 5 + p[4];
+        }
+        profile_sort_symbols(cpu->profile);
+    }
+#else
+    (void)nsymbols;
+#endif
 
-                    cpu->regs[reg1] = result & 0xFFFF;
-                    update_flags(cpu, cpu->regs[reg1]);
-                    break;
-                }
+    *entry = (image_u32(image + 8) + load_addr) & ADDR_MASK;
+    return true;
+}
 
-                case EXT_SUB: {
-                    uint32_t result = (uint32_t)cpu->regs[reg1] - (uint32_t)cpu->regs[reg2];
-                    set_flag(cpu, FLAG_CARRY, cpu->regs[reg1] < cpu->regs[reg2]);
+/*
+    Load an image at load_addr and start execution at entry (IMAGE_ENTRY:
+    the image's own entry point, load_addr for a raw one). Both formats the
+    assembler writes are understood: the sectioned one above and the raw
+    little-endian instruction stream (asld -raw). The file is mmapped rather
+    than read into a buffer, so startup only pays for the pages the guest
+    goes on to touch. The first switch engine run verifies the code (see
+    cpu_verify()), an image that fails still runs, checked. Returns false
+    (with a message on stderr) if it can't be loaded.
+*/
+bool cpu_load_image(CPU *cpu, const char *path, uint32_t load_addr, uint32_t entry)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        close(fd);
+        fprintf(stderr, "%s: empty image\n", path);
+        return false;
+    }
+
+    const uint8_t *image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    madvise((void *)image, size, MADV_SEQUENTIAL);
+    load_addr &= ADDR_MASK;
+
+    bool ok = true;
+    uint32_t image_entry = load_addr;
+    if (size >= 4 && memcmp(image, IMAGE_SECTIONED_MAGIC, 4) == 0) {
+        ok = image_load_sectioned(cpu, path, fd, image, size, load_addr, &image_entry);
+    } else {
+        size_t off = size >= 4 && memcmp(image, IMAGE_MAGIC, 4) == 0 ? 4 : 0;
+        if (size - off > MEMORY_SIZE) {
+            fprintf(stderr, "%s: image is %zu bytes, guest memory is %d\n", path, size - off,
+                    MEMORY_SIZE);
+            ok = false;
+        } else {
+            image_place(cpu, fd, image, off, size - off, load_addr);
+            bool wraps = load_addr + (size - off) > MEMORY_SIZE;
+            cpu->code_lo = wraps ? 0 : load_addr;
+            cpu->code_hi = wraps ? 0 : load_addr + (uint32_t)(size - off);
+        }
+    }
+
+    munmap((void *)image, size);
+    close(fd);
+    if (!ok)
+        return false;
+
+    cpu->pc = (entry == IMAGE_ENTRY ? image_entry : entry) & ADDR_MASK;
+    cpu->halted = false;
+    cpu->faulted = false;
+    verified_release(cpu->verified);
+    cpu->verified = NULL;
+    cpu->verify_pending = true;
+    return true;
+}
+
+/*
+ * =====================================
+ *        SNAPSHOTS & VM POOLING
+ * =====================================
+ */
+
+/*
+    A frozen, fully-initialized VM. Guest memory lives in a memfd that every
+    clone maps MAP_PRIVATE, so clones share the snapshot's pages until they
+    write to them.
+*/
+typedef struct {
+    CPU state; // registers, pc, sp, SR and flags; the pointers are unused
+    int memfd; // guest memory contents, -1 if it lives in copy instead
+    uint8_t *copy;
+} Snapshot;
+
+Snapshot *cpu_snapshot(CPU *cpu)
+{
+    Snapshot *snap = aligned_alloc(alignof(Snapshot), sizeof(Snapshot)); // CPU is cache line aligned
+    if (!snap)
+        return NULL;
+    memset(snap, 0, sizeof(Snapshot));
+
+    snap->state = *cpu;
+    snap->state.mem = NULL;
+    snap->state.icache = NULL;
+    snap->state.jit = NULL;
+    snap->state.verified = verified_retain(cpu->verified); // it describes the memory saved below
+    memset(&snap->state.out, 0, sizeof(snap->state.out));
+    memset(&snap->state.in, 0, sizeof(snap->state.in));
+    snap->state.bus = NULL;
+#ifdef VM_PROFILE
+    snap->state.profile = NULL;
+#endif
+    snap->state.counters = (GuestCounters){0}; // a clone counts its own work
+    snap->state.budget_start = snap->state.budget;
+
+    snap->memfd = memfd_create("vm-snapshot", MFD_CLOEXEC);
+    if (snap->memfd >= 0 && ftruncate(snap->memfd, MEMORY_SIZE) == 0) {
+        // All-zero pages stay holes in the memfd (reading untouched guest
+        // pages only maps the kernel's zero page, it doesn't commit them)
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        bool ok = true;
+
+        for (size_t off = 0; ok && off < MEMORY_SIZE; off += page) {
+            const uint8_t *p = cpu->mem + off;
+            if (p[0] == 0 && memcmp(p, p + 1, page - 1) == 0)
+                continue;
+            ok = pwrite(snap->memfd, p, page, (off_t)off) == (ssize_t)page;
+        }
+        if (ok)
+            return snap;
+    }
+
+    // No memfd (or writing it failed): keep a private copy instead
+    if (snap->memfd >= 0)
+        close(snap->memfd);
+    snap->memfd = -1;
+    snap->copy = malloc(MEMORY_SIZE);
+    if (!snap->copy) {
+        verified_release(snap->state.verified);
+        free(snap);
+        return NULL;
+    }
+    memcpy(snap->copy, cpu->mem, MEMORY_SIZE);
+    return snap;
+}
+
+void snapshot_destroy(Snapshot *snap)
+{
+    if (snap) {
+        if (snap->memfd >= 0)
+            close(snap->memfd);
+        verified_release(snap->state.verified);
+        free(snap->copy);
+        free(snap);
+    }
+}
+
+// Copy architectural state and what was verified about it, keeping the instance's
+// memory, caches, streams and devices
+static void cpu_restore_state(CPU *cpu, const CPU *state)
+{
+    uint8_t *mem = cpu->mem;
+    DecodedInstr *icache = cpu->icache;
+    JitState *jit = cpu->jit;
+    OutputChannel out = cpu->out;
+    InputChannel in = cpu->in;
+    DeviceBus *bus = cpu->bus;
+    uint16_t mmio_base = cpu->mmio_base;
+    uint32_t mmio_size = cpu->mmio_size;
+    Trace *trace = cpu->trace;
+    size_t mapping = cpu->mapping;
+    Verified *verified = cpu->verified;
+#ifdef VM_PROFILE
+    Profile *profile = cpu->profile;
+#endif
+
+    *cpu = *state;
+    cpu->verified = verified_retain(state->verified);
+    verified_release(verified);
+#ifdef VM_PROFILE
+    cpu->profile = profile;
+#endif
+    cpu->mem = mem;
+    cpu->icache = icache;
+    cpu->jit = jit;
+    cpu->out = out;
+    cpu->in = in;
+    cpu->bus = bus;
+    cpu->mmio_base = mmio_base;
+    cpu->mmio_size = mmio_size;
+    cpu->trace = trace;
+    cpu->mapping = mapping;
+}
+
+/*
+    Rewind an existing VM to the snapshot. Guest memory is remapped over the
+    old pages (dropping whatever the guest dirtied), and the decode cache and
+    JIT are cleared since they describe the old contents.
+*/
+bool cpu_reset(CPU *cpu, const Snapshot *snap)
+{
+    if (snap->memfd >= 0) {
+        if (mmap(cpu->mem, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                 snap->memfd, 0) == MAP_FAILED)
+            return false;
+    } else {
+        memcpy(cpu->mem, snap->copy, MEMORY_SIZE);
+    }
+
+    vm_zreset(cpu->icache, ICACHE_SIZE);
+    if (cpu->jit)
+        jit_reset(cpu->jit);
+
+    cpu_restore_state(cpu, &snap->state);
+    return true;
+}
+
+// Back to what cpu_create() returns, reusing the same mappings
+bool cpu_wipe(CPU *cpu)
+{
+    if (mmap(cpu->mem, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+        return false;
+    vm_advise_huge(cpu->mem, MEMORY_SIZE);
+
+    vm_zreset(cpu->icache, ICACHE_SIZE);
+    if (cpu->jit)
+        jit_reset(cpu->jit);
+
+    CPU fresh = {
+        .sp = MEMORY_SIZE - 2,
+        .flag_res = 1,
+        .SR[SEG_SS] = SEG_SS_INITIAL,
+    };
+    cpu_restore_state(cpu, &fresh);
+    return true;
+}
+
+// A new VM sharing the snapshot's memory copy-on-write
+CPU *cpu_clone(const Snapshot *snap)
+{
+    CPU *cpu = cpu_create();
+    if (cpu && !cpu_reset(cpu, snap)) {
+        cpu_destroy(cpu);
+        return NULL;
+    }
+    return cpu;
+}
+
+/*
+    Recycles CPUs for one snapshot: a released VM is rewound with
+    cpu_reset() on the next acquire instead of going through
+    cpu_destroy()/cpu_create().
+*/
+typedef struct {
+    const Snapshot *snap;
+    CPU **idle;
+    size_t count;
+    size_t cap;
+} CpuPool;
+
+CpuPool *pool_create(const Snapshot *snap)
+{
+    CpuPool *pool = calloc(1, sizeof(CpuPool));
+    if (pool)
+        pool->snap = snap;
+    return pool;
+}
+
+CPU *pool_acquire(CpuPool *pool)
+{
+    while (pool->count > 0) {
+        CPU *cpu = pool->idle[--pool->count];
+        if (cpu_reset(cpu, pool->snap))
+            return cpu;
+        cpu_destroy(cpu);
+    }
+    return cpu_clone(pool->snap);
+}
+
+void pool_release(CpuPool *pool, CPU *cpu)
+{
+    if (pool->count == pool->cap) {
+        size_t cap = pool->cap ? pool->cap * 2 : 16;
+        CPU **idle = realloc(pool->idle, cap * sizeof(CPU *));
+        if (!idle) {
+            cpu_destroy(cpu);
+            return;
+        }
+        pool->idle = idle;
+        pool->cap = cap;
+    }
+    pool->idle[pool->count++] = cpu;
+}
+
+void pool_destroy(CpuPool *pool)
+{
+    if (pool) {
+        for (size_t i = 0; i < pool->count; i++)
+            cpu_destroy(pool->idle[i]);
+        free(pool->idle);
+        free(pool);
+    }
+}
+
+/*
+ * =====================================
+ *              SCHEDULER
+ * =====================================
+ */
+
+/*
+    Multiplexes many VMs on the calling thread, round-robin, one
+    cpu_run_for() slice per turn. A VM parked on input keeps its turn but
+    only re-polls its stream; once a whole round makes no progress the
+    scheduler sleeps in poll() on all of their inputs instead of spinning.
+    The caller keeps ownership of the CPUs, halted ones leave the rotation.
+*/
+typedef struct {
+    CPU **cpus;
+    struct pollfd *fds; // scratch for sched_wait(), cap entries
+    size_t count;
+    size_t cap;
+    Engine engine;
+    uint64_t slice; // instructions per turn
+} Scheduler;
+
+Scheduler *sched_create(Engine engine, uint64_t slice)
+{
+    Scheduler *s = calloc(1, sizeof(Scheduler));
+    if (s) {
+        s->engine = engine;
+        s->slice = slice == 0 ? 1 : slice > INT64_MAX ? INT64_MAX : slice;
+    }
+    return s;
+}
+
+bool sched_add(Scheduler *s, CPU *cpu)
+{
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 16;
+        CPU **cpus = realloc(s->cpus, cap * sizeof(CPU *));
+        if (!cpus)
+            return false;
+        s->cpus = cpus;
+        struct pollfd *fds = realloc(s->fds, cap * sizeof(struct pollfd));
+        if (!fds)
+            return false;
+        s->fds = fds;
+        s->cap = cap;
+    }
+    s->cpus[s->count++] = cpu;
+    return true;
+}
+
+// Every VM is parked on input: block until one of their streams is readable
+static void sched_wait(Scheduler *s)
+{
+    for (size_t i = 0; i < s->count; i++)
+        s->fds[i] = (struct pollfd){.fd = fileno(s->cpus[i]->in.stream), .events = POLLIN};
+    while (poll(s->fds, s->count, -1) < 0 && errno == EINTR)
+        ;
+}
+
+// One turn for every VM; returns how many are still running
+size_t sched_round(Scheduler *s)
+{
+    bool progress = false;
+
+    for (size_t i = 0; i < s->count;) {
+        CPU *cpu = s->cpus[i];
+        RunStatus status = cpu_run_for(cpu, s->engine, s->slice);
+
+        if (status == RUN_HALTED) {
+            memmove(s->cpus + i, s->cpus + i + 1, (s->count - i - 1) * sizeof(CPU *));
+            s->count--;
+            progress = true;
+            continue;
+        }
+        // Parked right away, or after running part of its slice
+        if (status != RUN_WAITING || cpu->budget < (int64_t)s->slice)
+            progress = true;
+        i++;
+    }
+
+    if (!progress && s->count > 0)
+        sched_wait(s);
+    return s->count;
+}
+
+// Run every VM to HALT
+void sched_run(Scheduler *s)
+{
+    while (sched_round(s) > 0)
+        ;
+}
+
+void sched_destroy(Scheduler *s)
+{
+    if (s) {
+        free(s->cpus);
+        free(s->fds);
+        free(s);
+    }
+}
+
+/*
+ * =====================================
+ *            BATCH RUNNER
+ * =====================================
+ */
+
+/*
+    Runs many independent jobs (an image plus an optional input file) over a
+    pool of threads. Each worker owns a CpuArena of up to BATCH_LANES VMs and
+    a Scheduler that interleaves them, one job per lane at a time; every lane
+    keeps a snapshot of the image it last loaded, so repeated jobs for the
+    same program are a cpu_reset() away and nothing is shared on the hot
+    path. Guest output is captured per job and printed in job order once
+    everything has finished (a failed job's too, its header says why), along
+    with the GuestCounters of each job that ran to HALT if a metrics file was
+    asked for. A stop on an unknown opcode counts as a failure.
+*/
+#define BATCH_LANES 4         // VMs per worker, run side by side on its Scheduler
+#define BATCH_SLICE (1 << 16) // instructions per lane and turn
+
+typedef struct {
+    const char *image;
+    const char *input; // NULL: the guest sees an empty stdin
+    char *output;      // captured guest stdout
+    size_t output_len;
+    size_t output_cap;
+    GuestCounters counters;
+    bool ok;           // ran to OP_HALT
+    const char *error; // why it didn't, NULL if it did
+} BatchJob;
+
+/*
+    Per-worker slice of the job list, [lo, hi) packed into one word. The
+    owner takes from lo, thieves take from hi; both update with a CAS.
+*/
+typedef struct {
+    alignas(64) _Atomic uint64_t range;
+} WorkQueue;
+
+typedef struct {
+    BatchJob *jobs;
+    WorkQueue *queues;
+    size_t nworkers;
+    size_t lanes; // per worker, at most BATCH_LANES
+    Engine engine;
+    uint32_t load_addr;
+    uint32_t entry;
+} Batch;
+
+typedef struct {
+    CPU *cpu;
+    Snapshot *snap;
+    const char *snap_image;
+    BatchJob *job; // running on this lane, NULL if it's idle
+} BatchLane;
+
+typedef struct {
+    Batch *batch;
+    size_t id;
+    pthread_t thread;
+    bool started; // thread is only valid if pthread_create() succeeded
+} BatchWorker;
+
+static inline uint64_t range_pack(uint32_t lo, uint32_t hi)
+{
+    return (uint64_t)hi << 32 | lo;
+}
+
+// Take one job from either end of a queue, -1 when it's empty
+static int64_t queue_take(WorkQueue *q, bool steal)
+{
+    uint64_t r = atomic_load_explicit(&q->range, memory_order_relaxed);
+    for (;;) {
+        uint32_t lo = (uint32_t)r, hi = (uint32_t)(r >> 32);
+        if (lo >= hi)
+            return -1;
+        uint64_t next = steal ? range_pack(lo, hi - 1) : range_pack(lo + 1, hi);
+        if (atomic_compare_exchange_weak_explicit(&q->range, &r, next,
+                                                  memory_order_acq_rel, memory_order_relaxed))
+            return steal ? hi - 1 : lo;
+    }
+}
+
+static int64_t batch_next_job(Batch *batch, size_t id)
+{
+    int64_t job = queue_take(&batch->queues[id], false);
+    for (size_t i = 1; job < 0 && i < batch->nworkers; i++)
+        job = queue_take(&batch->queues[(id + i) % batch->nworkers], true);
+    return job;
+}
+
+static void batch_capture(void *ctx, const char *data, size_t len)
+{
+    BatchJob *job = ctx;
+    if (job->output_len + len > job->output_cap) {
+        size_t cap = job->output_cap ? job->output_cap : OUTPUT_BUFFER_SIZE;
+        while (cap < job->output_len + len)
+            cap *= 2;
+        char *grown = realloc(job->output, cap);
+        if (!grown)
+            return;
+        job->output = grown;
+        job->output_cap = cap;
+    }
+    memcpy(job->output + job->output_len, data, len);
+    job->output_len += len;
+}
+
+// Get job going on lane: its image loaded (or reset to), input and output hooked up
+static bool batch_lane_start(Batch *batch, BatchLane *lane, BatchJob *job)
+{
+    CPU *cpu = lane->cpu;
+    bool ready;
+
+    if (lane->snap && strcmp(lane->snap_image, job->image) == 0) {
+        ready = cpu_reset(cpu, lane->snap);
+    } else {
+        snapshot_destroy(lane->snap);
+        lane->snap = NULL;
+        ready = cpu_wipe(cpu) && cpu_load_image(cpu, job->image, batch->load_addr, batch->entry);
+        // Verified before the snapshot, so every job reset to it shares the proof
+        if (ready && batch->engine == ENGINE_SWITCH)
+            cpu_verify(cpu, NULL);
+        ready = ready && (lane->snap = cpu_snapshot(cpu)) != NULL;
+        lane->snap_image = job->image;
+    }
+    if (!ready)
+        return false;
+
+    if (job->input) {
+        if (!cpu_set_input_file(cpu, job->input))
+            return false;
+    } else {
+        cpu_set_input_buffer(cpu, "", 0);
+    }
+    cpu_set_output_sink(cpu, batch_capture, job);
+    lane->job = job;
+    return true;
+}
+
+static void batch_lane_finish(BatchLane *lane)
+{
+    CPU *cpu = lane->cpu;
+    if (lane->job) {
+        cpu_flush_output(cpu);
+        lane->job->counters = cpu_get_counters(cpu);
+        lane->job->ok = cpu->halted && !cpu->faulted;
+        if (!lane->job->ok)
+            lane->job->error = cpu->faulted ? "unknown opcode" : "didn't halt";
+        lane->job = NULL;
+    }
+    cpu_set_output_fd(cpu, STDOUT_FILENO);
+    cpu_set_input_stream(cpu, stdin);
+}
+
+static void *batch_worker(void *arg)
+{
+    BatchWorker *w = arg;
+    Batch *batch = w->batch;
+    CpuArena *arena = arena_create(batch->lanes);
+    Scheduler *sched = sched_create(batch->engine, BATCH_SLICE);
+    BatchLane lanes[BATCH_LANES] = {0};
+    bool more = arena && sched;
 
-                    bool r1_sign = (cpu->regs[reg1] & 0x8000) != 0;
-                    bool r2_sign = (cpu->regs[reg2] & 0x8000) != 0;
-                    bool res_sign = (result & 0x8000) != 0;
-                    bool overflow = (r1_sign != r2_sign) && (r1_sign != res_sign);
-                    set_flag(cpu, FLAG_OVERFLOW, overflow);
+    if (more) {
+        for (size_t l = 0; l < arena->count; l++)
+            lanes[l].cpu = &arena->cpus[l];
+    }
 
-                    cpu->regs[reg1] = result & 0xFFFF;
-                    update_flags(cpu, cpu->regs[reg1]);
+    // Fill every lane, run them all to HALT, repeat until the jobs run out
+    while (more) {
+        for (size_t l = 0; l < arena->count && more; l++) {
+            int64_t i;
+            while ((more = (i = batch_next_job(batch, w->id)) >= 0)) {
+                if (batch_lane_start(batch, &lanes[l], &batch->jobs[i]) && sched_add(sched, lanes[l].cpu))
                     break;
-                }
+                batch->jobs[i].error = "couldn't start"; // stays !ok
+                lanes[l].job = NULL;
+                batch_lane_finish(&lanes[l]);
+            }
+        }
+        sched_run(sched);
+        for (size_t l = 0; l < arena->count; l++)
+            batch_lane_finish(&lanes[l]);
+    }
 
-                case EXT_AND:
-                    cpu->regs[reg1] &= cpu->regs[reg2];
-                    update_flags(cpu, cpu->regs[reg1]);
-                    break;
+    for (size_t l = 0; l < BATCH_LANES; l++)
+        snapshot_destroy(lanes[l].snap);
+    sched_destroy(sched);
+    arena_destroy(arena);
+    return NULL;
+}
 
-                case EXT_OR:
-                    cpu->regs[reg1] |= cpu->regs[reg2];
-                    update_flags(cpu, cpu->regs[reg1]);
-                    break;
+/*
+    Job list format: one job per line, "<image.bin> [input.txt]".
+    Blank lines and lines starting with '#' are skipped.
+*/
+static BatchJob *batch_read_jobs(const char *path, size_t *count)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return NULL;
+    }
 
-                case EXT_XOR:
-                    cpu->regs[reg1] ^= cpu->regs[reg2];
-                    update_flags(cpu, cpu->regs[reg1]);
-                    break;
+    BatchJob *jobs = NULL;
+    size_t n = 0, cap = 0;
+    char line[4096];
 
-                case EXT_RET: {
-                    uint32_t high = stack_pop16(cpu) & 0xF;
-                    uint32_t low = stack_pop16(cpu);
-                    cpu->pc = (high << 16) | low;
-                    break;
-                }
+    while (fgets(line, sizeof(line), f)) {
+        char *image = strtok(line, " \t\r\n");
+        if (!image || image[0] == '#')
+            continue;
+        char *input = strtok(NULL, " \t\r\n");
 
-                case EXT_LOAD:
-                    cpu->regs[reg1] = mem_r16(cpu, cpu->regs[reg2]);
-                    update_flags(cpu, cpu->regs[reg1]);
-                    break;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            BatchJob *grown = realloc(jobs, cap * sizeof(BatchJob));
+            if (!grown)
+                break;
+            jobs = grown;
+        }
+        jobs[n++] = (BatchJob){
+            .image = strdup(image),
+            .input = input ? strdup(input) : NULL,
+        };
+    }
+    fclose(f);
 
-                case EXT_STORE:
-                    mem_w16(cpu, cpu->regs[reg1], cpu->regs[reg2]);
-                    break;
+    *count = n;
+    return jobs;
+}
 
-                default:
-                    printf("Unknown extended opcode: 0x%X\n", ext_op);
-                    cpu->halted = true;
-                    break;
-            }
-            break;
-        }
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} batch_metrics[] = {
+    {"vm_guest_instructions_total", "Guest instructions retired.", offsetof(GuestCounters, instructions)},
+    {"vm_guest_branches_total", "Taken guest jumps and branches.", offsetof(GuestCounters, branches)},
+    {"vm_guest_calls_total", "Guest CALLs.", offsetof(GuestCounters, calls)},
+    {"vm_guest_returns_total", "Guest RETs.", offsetof(GuestCounters, returns)},
+    {"vm_guest_loaded_bytes_total", "Guest memory bytes read by LOAD and block ops.", offsetof(GuestCounters, bytes_loaded)},
+    {"vm_guest_stored_bytes_total", "Guest memory bytes written by STORE and block ops.", offsetof(GuestCounters, bytes_stored)},
+    {"vm_guest_input_bytes_total", "Bytes of input the guest read.", offsetof(GuestCounters, io_in)},
+    {"vm_guest_output_bytes_total", "Bytes of output the guest printed.", offsetof(GuestCounters, io_out)},
+};
 
-        default:
-            printf("Unknown opcode: 0x%X at PC=0x%05X\n", opcode, cpu->pc - 2);
-            cpu->halted = true;
-            break;
+// A Prometheus label value: backslash, quote and newline escaped
+static void metrics_label(FILE *f, const char *s)
+{
+    for (; *s; s++) {
+        if (*s == '\\' || *s == '"')
+            fputc('\\', f);
+        if (*s == '\n')
+            fputs("\\n", f);
+        else
+            fputc(*s, f);
     }
 }
 
-void cpu_run(CPU *cpu)
+/*
+    Prometheus text exposition format, one sample per finished job and
+    counter labelled with the job number and image, e.g. for a textfile
+    collector. The job number is batch_job, Prometheus sets job itself on
+    scrape. path "-" writes to stdout after the job output.
+*/
+static bool batch_write_metrics(const char *path, const BatchJob *jobs, size_t njobs)
 {
-    while (!cpu->halted)
-        cpu_step(cpu);
+    FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    for (size_t m = 0; m < sizeof(batch_metrics) / sizeof(batch_metrics[0]); m++) {
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", batch_metrics[m].name, batch_metrics[m].help,
+                batch_metrics[m].name);
+        for (size_t i = 0; i < njobs; i++) {
+            if (!jobs[i].ok)
+                continue;
+            uint64_t value;
+            memcpy(&value, (const char *)&jobs[i].counters + batch_metrics[m].offset, sizeof(value));
+            fprintf(f, "%s{batch_job=\"%zu\",image=\"", batch_metrics[m].name, i);
+            metrics_label(f, jobs[i].image);
+            fprintf(f, "\"} %llu\n", (unsigned long long)value);
+        }
+    }
+
+    bool ok = !ferror(f);
+    if (f == stdout)
+        ok = fflush(f) == 0 && ok;
+    else
+        ok = fclose(f) == 0 && ok;
+    if (!ok)
+        fprintf(stderr, "Failed to write metrics %s\n", path);
+    return ok;
 }
 
-void cpu_dump(CPU *cpu)
+/*
+    Returns the number of jobs that failed, or -1 if the batch couldn't
+    start or metrics (see batch_write_metrics()) couldn't be written
+*/
+int batch_run(const char *list, size_t nthreads, Engine engine, uint32_t load_addr, uint32_t entry, const char *metrics)
 {
-    printf("\n=== CPU State ===\n");
-    printf("PC: 0x%05X  SP: 0x%05X\n", cpu->pc, cpu->sp);
-    printf("Flags: Z=%d S=%d C=%d O=%d\n",
-           get_flag(cpu, FLAG_ZERO),
-           get_flag(cpu, FLAG_SIGN),
-           get_flag(cpu, FLAG_CARRY),
-           get_flag(cpu, FLAG_OVERFLOW));
+    size_t njobs;
+    BatchJob *jobs = batch_read_jobs(list, &njobs);
+    if (!jobs)
+        return -1;
 
-    printf("Registers:\n");
-    for (int i = 0; i < NUMS_R; i++) {
-        printf("  R%d: 0x%04X (%d)\n", i, cpu->regs[i], (int16_t)cpu->regs[i]);
+    if (nthreads == 0)
+        nthreads = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > njobs)
+        nthreads = njobs ? njobs : 1;
+
+    Batch batch = {
+        .jobs = jobs,
+        .queues = aligned_alloc(alignof(WorkQueue), nthreads * sizeof(WorkQueue)),
+        .nworkers = nthreads,
+        .lanes = njobs / nthreads >= BATCH_LANES ? BATCH_LANES : (njobs + nthreads - 1) / nthreads,
+        .engine = engine,
+        .load_addr = load_addr,
+        .entry = entry,
+    };
+    BatchWorker *workers = calloc(nthreads, sizeof(BatchWorker));
+    if (!batch.queues || !workers) {
+        free(batch.queues);
+        free(workers);
+        free(jobs);
+        return -1;
     }
-    printf("=================\n\n");
+
+    // Contiguous slices keep runs of the same image on one worker
+    for (size_t t = 0; t < nthreads; t++) {
+        uint32_t lo = (uint32_t)(njobs * t / nthreads);
+        uint32_t hi = (uint32_t)(njobs * (t + 1) / nthreads);
+        atomic_init(&batch.queues[t].range, range_pack(lo, hi));
+    }
+
+    for (size_t t = 0; t < nthreads; t++) {
+        workers[t] = (BatchWorker){.batch = &batch, .id = t};
+        workers[t].started = pthread_create(&workers[t].thread, NULL, batch_worker, &workers[t]) == 0;
+        if (!workers[t].started)
+            batch_worker(&workers[t]); // run this share inline instead
+    }
+    for (size_t t = 0; t < nthreads; t++) {
+        if (workers[t].started)
+            pthread_join(workers[t].thread, NULL);
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < njobs; i++) {
+        if (jobs[i].ok) {
+            printf("=== job %zu: %s ===\n", i, jobs[i].image);
+        } else {
+            printf("=== job %zu: %s (failed: %s) ===\n", i, jobs[i].image, jobs[i].error);
+            failed++;
+        }
+        fwrite(jobs[i].output, 1, jobs[i].output_len, stdout);
+    }
+    if (metrics) {
+        fflush(stdout);
+        if (!batch_write_metrics(metrics, jobs, njobs))
+            failed = -1;
+    }
+    for (size_t i = 0; i < njobs; i++) {
+        free(jobs[i].output);
+        free((char *)jobs[i].image);
+        free((char *)jobs[i].input);
+    }
+
+    free(workers);
+    free(batch.queues);
+    free(jobs);
+    return failed;
 }
 
 /*
@@ -547,6 +6103,7 @@ void program_fibonacci(ProgramBuilder *pb)
     pb_movi(pb, R0, 0);
     pb_movi(pb, R1, 1);
     pb_movi(pb, R2, 23); // Safe limit for signed 16-bit (max 28657)
+    pb_movi(pb, R5, 1);
 
     // === LOOP START ===
     uint32_t loop_addr = pb->addr;
@@ -566,21 +6123,10 @@ void program_fibonacci(ProgramBuilder *pb)
     mem_w16(pb->cpu, pb->addr, make_instr(OP_MOV, R1, R3));
     pb->addr += 2;
 
-    // === CRITICAL FIX STARTS HERE ===
-
-    // 1. PRE-LOAD the Jump Address into R4
-    //    (Do this before touching flags!)
-    pb_load16(pb, R4, (uint16_t)loop_addr);
-
-    // 2. Decrement Counter (R2 = R2 - 1)
-    //    This sets the Zero Flag correctly based on R2.
-    pb_movi(pb, R5, 1);
+    // Decrement Counter (R2 = R2 - 1), the branch checks the flags SUB just set
     mem_w16(pb->cpu, pb->addr, make_ext_instr(EXT_SUB, R2, R5));
     pb->addr += 2;
-
-    // 3. Jump (Checks the flag set by step 2 immediately)
-    mem_w16(pb->cpu, pb->addr, make_instr(OP_JNZ, R4, 0));
-    pb->addr += 2;
+    pb_jnz(pb, loop_addr);
 
     pb_stdout_str(pb, "\nDone!\n");
     pb_halt(pb);
@@ -594,21 +6140,17 @@ void program_multiplication(ProgramBuilder *pb)
     pb_movi(pb, R1, 5);
     pb_movi(pb, R2, 0); // Accumulator
 
+    // Loop start goes in R4, patched in once the loop's address is known
+    uint32_t loop_literal = pb_load16_fwd(pb, R4);
+    pb_patch16(pb, loop_literal, (uint16_t)pb->addr);
+
     // === SIMPLE LOOP - No function call ===
-    uint32_t loop_addr = pb->addr;
 
     // Add R0 to accumulator
     pb_add(pb, R2, R0);
 
-    // Decrement counter
-    pb_movi(pb, R3, 1);
-    mem_w16(pb->cpu, pb->addr, make_ext_instr(EXT_SUB, R1, R3));
-    pb->addr += 2;
-
-    // Jump back if not zero
-    pb->cpu->regs[R4] = loop_addr; // Direct set
-    mem_w16(pb->cpu, pb->addr, make_instr(OP_JNZ, R4, 0));
-    pb->addr += 2;
+    // Decrement counter, jump back if not zero
+    pb_djnz(pb, R1, R4);
 
     // Print result
     pb_stdout_str(pb, "Result: ");
@@ -617,22 +6159,623 @@ void program_multiplication(ProgramBuilder *pb)
     pb_halt(pb);
 }
 
+/*
+ * =====================================
+ *              BENCHMARKS
+ * =====================================
+ */
+
+/*
+    Guest kernels for --bench. Each runs an outer loop around an inner loop,
+    with loop addresses and counters preset in registers so no MOVI sits
+    between the SUB and the JNZ that tests it:
+    R7 = 1, R6 = outer counter, R5 = inner counter, R4 = inner loop address,
+    R3 = outer loop address, R2 = inner iterations.
+    Code starts at BENCH_CODE so the memory kernel can use 1..BENCH_INNER
+    as its buffer.
+*/
+#define BENCH_CODE 0x1000
+#define BENCH_INNER 1000
+#define BENCH_OUTER 2000
+#define BENCH_RUNS 3 // best of
+
+typedef struct {
+    const char *name;
+    void (*build)(ProgramBuilder *pb);
+} BenchKernel;
+
+typedef struct {
+    uint64_t instructions;
+    uint64_t ns;
+    uint64_t cycles; // 0 where there is no cycle counter
+} BenchResult;
+
+// Outer loop head: reload counter from R2, the inner loop starts right after
+static void bench_outer_begin(ProgramBuilder *pb, Register counter)
+{
+    CPU *cpu = pb->cpu;
+    cpu->regs[R7] = 1;
+    cpu->regs[R6] = BENCH_OUTER;
+    cpu->regs[R2] = BENCH_INNER;
+    cpu->regs[R3] = pb->addr;
+    pb_emit(pb, make_instr(OP_MOV, counter, R2));
+    cpu->regs[R4] = pb->addr;
+}
+
+static void bench_inner_end(ProgramBuilder *pb)
+{
+    pb_emit(pb, make_ext_instr(EXT_SUB, R5, R7));
+    pb_emit(pb, make_instr(OP_JNZ, R4, 0));
+}
+
+static void bench_outer_end(ProgramBuilder *pb)
+{
+    pb_emit(pb, make_ext_instr(EXT_SUB, R6, R7));
+    pb_emit(pb, make_instr(OP_JNZ, R3, 0));
+    pb_halt(pb);
+}
+
+// Register moves only, so the cost is mostly fetch and dispatch
+static void bench_fetch(ProgramBuilder *pb)
+{
+    bench_outer_begin(pb, R5);
+    for (int i = 0; i < 4; i++) {
+        pb_emit(pb, make_instr(OP_MOV, R0, R1));
+        pb_emit(pb, make_instr(OP_MOV, R1, R0));
+    }
+    bench_inner_end(pb);
+    bench_outer_end(pb);
+}
+
+// Word stores and loads through the stack
+static void bench_stack(ProgramBuilder *pb)
+{
+    bench_outer_begin(pb, R5);
+    pb_emit(pb, make_instr(OP_PUSH, R0, 0));
+    pb_emit(pb, make_instr(OP_PUSH, R1, 0));
+    pb_emit(pb, make_instr(OP_POP, R0, 0));
+    pb_emit(pb, make_instr(OP_POP, R1, 0));
+    bench_inner_end(pb);
+    bench_outer_end(pb);
+}
+
+// Straight-line arithmetic and logic
+static void bench_alu(ProgramBuilder *pb)
+{
+    pb->cpu->regs[R0] = 0x1234;
+    pb->cpu->regs[R1] = 0x0F0F;
+    bench_outer_begin(pb, R5);
+    pb_add(pb, R0, R1);
+    pb_emit(pb, make_ext_instr(EXT_XOR, R1, R0));
+    pb_emit(pb, make_ext_instr(EXT_SUB, R0, R7));
+    pb_emit(pb, make_ext_instr(EXT_OR, R1, R7));
+    pb_emit(pb, make_ext_instr(EXT_AND, R0, R1));
+    pb_add(pb, R1, R0);
+    bench_inner_end(pb);
+    bench_outer_end(pb);
+}
+
+// A JZ that alternates taken / not taken, R0 toggles between 1 and 0
+static void bench_branch(ProgramBuilder *pb)
+{
+    bench_outer_begin(pb, R5);
+    pb_emit(pb, make_ext_instr(EXT_XOR, R0, R7));
+    pb_emit(pb, make_instr(OP_JZ, R1, 0));
+    pb_emit(pb, make_instr(OP_CMP, R0, R7));
+    pb_emit(pb, make_instr(OP_NOP, 0, 0));
+    pb->cpu->regs[R1] = pb->addr;
+    bench_inner_end(pb);
+    bench_outer_end(pb);
+}
+
+// OP_EXT2 arithmetic, the inner counter (never 0 in the body) is the modulus
+static void bench_muldiv(ProgramBuilder *pb)
+{
+    pb->cpu->regs[R0] = 0x1234;
+    pb->cpu->regs[R1] = 7;
+    bench_outer_begin(pb, R5);
+    pb_emit(pb, make_ext2_instr(EXT2_MUL, R0, R1));
+    pb_emit(pb, make_ext2_instr(EXT2_SHR, R0, R7));
+    pb_emit(pb, make_ext2_instr(EXT2_MOD, R0, R5));
+    pb_emit(pb, make_ext2_instr(EXT2_SHL, R1, R7));
+    pb_emit(pb, make_ext2_instr(EXT2_SAR, R1, R7));
+    pb_add(pb, R0, R7);
+    bench_inner_end(pb);
+    bench_outer_end(pb);
+}
+
+// LOAD/STORE over the buffer below BENCH_CODE, the inner counter is the pointer
+static void bench_memory(ProgramBuilder *pb)
+{
+    pb->cpu->regs[R0] = 3;
+    bench_outer_begin(pb, R5);
+    pb_emit(pb, make_ext_instr(EXT_LOAD, R1, R5));
+    pb_add(pb, R1, R0);
+    pb_emit(pb, make_ext_instr(EXT_STORE, R5, R1));
+    pb_emit(pb, make_ext_instr(EXT_LOAD, R0, R5));
+    bench_inner_end(pb);
+    bench_outer_end(pb);
+}
+
+// Recursion BENCH_INNER calls deep: f: SUB R0, 1; JZ ret; CALL f; ret: RET
+static void bench_call(ProgramBuilder *pb)
+{
+    bench_outer_begin(pb, R0);
+    pb_emit(pb, make_instr(OP_CALL, R1, 0));
+    bench_outer_end(pb);
+
+    pb->cpu->regs[R1] = pb->addr;
+    pb_emit(pb, make_ext_instr(EXT_SUB, R0, R7));
+    pb_emit(pb, make_instr(OP_JZ, R4, 0));
+    pb_emit(pb, make_instr(OP_CALL, R1, 0));
+    pb->cpu->regs[R4] = pb->addr;
+    pb_emit(pb, make_ext_instr(EXT_RET, 0, 0));
+}
+
+// One number and one newline per iteration
+static void bench_io(ProgramBuilder *pb)
+{
+    pb->cpu->regs[R0] = '\n';
+    bench_outer_begin(pb, R5);
+    pb_stdout_reg(pb, R5);
+    pb_emit(pb, make_instr(OP_STDOUT, 3, R0));
+    bench_inner_end(pb);
+    bench_outer_end(pb);
+}
+
+static const BenchKernel bench_kernels[] = {
+    {"fetch", bench_fetch},
+    {"alu", bench_alu},
+    {"branch", bench_branch},
+    {"muldiv", bench_muldiv},
+    {"memory", bench_memory},
+    {"stack", bench_stack},
+    {"call", bench_call},
+    {"io", bench_io},
+};
+
+// Rows of the table: every engine, and the switch engine on verified code
+typedef struct {
+    const char *name;
+    Engine engine;
+    bool verify;
+} BenchEngine;
+
+static const BenchEngine bench_engines[] = {
+    {"switch", ENGINE_SWITCH, false},
+    {"verified", ENGINE_SWITCH, true},
+    {"threaded", ENGINE_THREADED, false},
+    {"jit", ENGINE_JIT, false},
+};
+
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Reference cycles from the time-stamp counter, not core clock cycles
+static inline uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static CPU *bench_setup(const BenchKernel *k, int devnull, bool verify)
+{
+    CPU *cpu = cpu_create();
+    if (!cpu)
+        return NULL;
+    cpu_set_output_fd(cpu, devnull);
+
+    ProgramBuilder pb = {cpu, BENCH_CODE, false};
+    k->build(&pb);
+    if (pb.failed) {
+        cpu_destroy(cpu);
+        return NULL;
+    }
+    cpu->pc = BENCH_CODE;
+    cpu->code_lo = BENCH_CODE;
+    cpu->code_hi = pb.addr;
+
+    VerifyReport report;
+    if (verify && !cpu_verify(cpu, &report))
+        fprintf(stderr, "bench %s: 0x%05X: %s, running checked\n", k->name, report.pc, report.error);
+    return cpu;
+}
+
+// Guest instructions retired by k, every engine executes the same stream
+static uint64_t bench_count(const BenchKernel *k, int devnull)
+{
+    CPU *cpu = bench_setup(k, devnull, false);
+    if (!cpu)
+        return 0;
+
+    uint64_t n = 0;
+    while (!cpu->halted) {
+        cpu_step(cpu);
+        n++;
+    }
+    cpu_destroy(cpu);
+    return n;
+}
+
+static bool bench_time(const BenchKernel *k, const BenchEngine *e, int devnull, BenchResult *r)
+{
+    r->ns = UINT64_MAX;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        CPU *cpu = bench_setup(k, devnull, e->verify);
+        if (!cpu)
+            return false;
+
+        uint64_t c0 = bench_cycles();
+        uint64_t t0 = bench_now_ns();
+        cpu_execute(cpu, e->engine);
+        cpu_flush_output(cpu);
+        uint64_t t1 = bench_now_ns();
+        uint64_t c1 = bench_cycles();
+        cpu_destroy(cpu);
+
+        if (t1 - t0 < r->ns) {
+            r->ns = t1 - t0;
+            r->cycles = c1 - c0;
+        }
+    }
+    return true;
+}
+
+/*
+    Runs every kernel on every engine, prints a table to stdout and, if
+    csv_path is set, appends one CSV row per kernel/engine pair to it
+    (with a header when the file is new) for tracking across releases.
+*/
+int bench_run(const char *csv_path)
+{
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0) {
+        fprintf(stderr, "/dev/null: %s\n", strerror(errno));
+        return 1;
+    }
+
+    FILE *csv = NULL;
+    if (csv_path) {
+        csv = fopen(csv_path, "a");
+        if (!csv) {
+            fprintf(stderr, "%s: %s\n", csv_path, strerror(errno));
+            close(devnull);
+            return 1;
+        }
+        if (ftell(csv) == 0)
+            fprintf(csv, "kernel,engine,instructions,ns,mips,ns_per_instr,cycles_per_instr\n");
+    }
+
+    printf("%-8s %-9s %12s %10s %10s %12s\n", "kernel", "engine", "instrs", "MIPS", "ns/instr", "cycles/instr");
+
+    int status = 0;
+    for (size_t i = 0; i < sizeof(bench_kernels) / sizeof(bench_kernels[0]); i++) {
+        const BenchKernel *k = &bench_kernels[i];
+        uint64_t instructions = bench_count(k, devnull);
+
+        for (size_t j = 0; j < sizeof(bench_engines) / sizeof(bench_engines[0]); j++) {
+            const BenchEngine *e = &bench_engines[j];
+            if (e->engine == ENGINE_JIT && !VM_HAS_JIT)
+                continue; // would just be the threaded engine again
+
+            BenchResult r = {.instructions = instructions};
+            if (!instructions || !bench_time(k, e, devnull, &r)) {
+                fprintf(stderr, "bench %s/%s: failed to create CPU\n", k->name, e->name);
+                status = 1;
+                continue;
+            }
+
+            double ns = r.ns ? (double)r.ns : 1.0;
+            double mips = (double)r.instructions * 1e3 / ns;
+            double ns_per = ns / (double)r.instructions;
+            double cyc_per = (double)r.cycles / (double)r.instructions;
+
+            printf("%-8s %-9s %12llu %10.1f %10.3f %12.2f\n", k->name, e->name,
+                   (unsigned long long)r.instructions, mips, ns_per, cyc_per);
+            if (csv)
+                fprintf(csv, "%s,%s,%llu,%llu,%.1f,%.3f,%.2f\n", k->name, e->name,
+                        (unsigned long long)r.instructions, (unsigned long long)r.ns,
+                        mips, ns_per, cyc_per);
+        }
+    }
+
+    if (csv)
+        fclose(csv);
+    close(devnull);
+    return status;
+}
+
 // =====================================
 
-int main(void)
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] [program.bin]\n", prog);
+    fprintf(stderr, "  --engine=switch|threaded|jit  execution engine\n");
+    fprintf(stderr, "  --load=ADDR                   load address of program.bin (default 0)\n");
+    fprintf(stderr, "  --entry=PC                    initial PC (default: the image's entry point)\n");
+    fprintf(stderr, "  --input=FILE                  preload FILE (- for all of stdin) as guest input\n");
+    fprintf(stderr, "  --batch=JOBS                  run every \"<image.bin> [input.txt]\" line of JOBS\n");
+    fprintf(stderr, "  --threads=N                   batch worker threads (default: one per core)\n");
+    fprintf(stderr, "  --metrics=FILE                write per-job guest counters for Prometheus (- for stdout)\n");
+    fprintf(stderr, "  --bench[=CSV]                 time the built-in kernels on every engine\n");
+    fprintf(stderr, "  --devices                     attach the console, timer and DMA devices at 0xFF00\n");
+    fprintf(stderr, "  --disk=FILE                   also attach FILE as a block device (implies --devices)\n");
+    fprintf(stderr, "  --record=LOG                  log all guest input and an output digest to LOG\n");
+    fprintf(stderr, "  --replay=LOG                  rerun a --record log without I/O and check the output\n");
+    fprintf(stderr, "  --verify                      report what the load-time verifier proved about the code\n");
+    fprintf(stderr, "  --trace=FILE                  record every instruction into FILE (see vmtrace)\n");
+    fprintf(stderr, "  --trace-size=MIB              size of the --trace ring, oldest records dropped (default 16)\n");
+#ifdef VM_PROFILE
+    fprintf(stderr, "  --profile[=SYMBOLS]           print a hot-spot report to stderr at halt\n");
+#endif
+    fprintf(stderr, "Without program.bin the built-in multiplication demo runs.\n");
+}
+
+// The --verify report
+static void verify_print(CPU *cpu, FILE *f)
+{
+    VerifyReport r;
+    if (!cpu_verify(cpu, &r)) {
+        fprintf(f, "verify: 0x%05X: %s, running checked\n", r.pc, r.error);
+        return;
+    }
+    fprintf(f, "verify: %u instructions, %u subroutine%s, ", r.instructions, r.subroutines,
+            r.subroutines == 1 ? "" : "s");
+    if (r.max_stack == VERIFY_UNBOUNDED)
+        fprintf(f, "unbounded stack (recursive)\n");
+    else
+        fprintf(f, "at most %u bytes of stack\n", r.max_stack);
+}
+
+// Compare a --replay run's output with the recording's, 0 if they match
+static int replay_check(CPU *cpu, const OutputDigest *recorded)
+{
+    cpu_flush_output(cpu);
+    const OutputDigest *got = &cpu->out.digest;
+    size_t unread = cpu->in.len - cpu->in.pos;
+
+    if (recorded->bytes == UINT64_MAX) {
+        fprintf(stderr, "replay: the recording never finished, output not checked\n");
+    } else if (got->bytes != recorded->bytes || got->hash != recorded->hash) {
+        fprintf(stderr, "replay: output differs: %llu bytes, digest %016llx (recorded %llu bytes, %016llx)\n",
+                (unsigned long long)got->bytes, (unsigned long long)got->hash,
+                (unsigned long long)recorded->bytes, (unsigned long long)recorded->hash);
+        return 1;
+    }
+    if (unread) {
+        fprintf(stderr, "replay: %zu recorded input bytes were never read\n", unread);
+        return 1;
+    }
+    return 0;
+}
+
+// The --devices set, plus the block device for --disk
+static bool attach_devices(CPU *cpu, const char *disk)
+{
+    Device *devs[] = {
+        device_console_create(DEV_CONSOLE_BASE),
+        device_timer_create(DEV_TIMER_BASE),
+        device_dma_create(DEV_DMA_BASE),
+        disk ? device_block_open(DEV_BLOCK_BASE, disk) : NULL,
+    };
+    size_t count = disk ? 4 : 3;
+    bool ok = true;
+
+    for (size_t i = 0; i < count; i++) {
+        if (ok && devs[i] && cpu_attach_device(cpu, devs[i]))
+            continue;
+        ok = false;
+        if (devs[i])
+            devs[i]->destroy(devs[i]);
+    }
+    return ok;
+}
+
+// Parse a decimal or 0x-prefixed guest address
+static bool parse_addr(const char *s, uint32_t *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(s, &end, 0);
+    if (errno || *s == '\0' || *end != '\0' || value > ADDR_MASK)
+        return false;
+    *out = (uint32_t)value;
+    return true;
+}
+
+int main(int argc, char **argv)
 {
+    Engine engine = VM_DEFAULT_ENGINE;
+    const char *image = NULL;
+    uint32_t load_addr = 0;
+    uint32_t entry = 0;
+    bool has_entry = false;
+    const char *input = NULL;
+    const char *batch = NULL;
+    size_t threads = 0;
+    const char *metrics = NULL;
+    bool bench = false;
+    const char *bench_csv = NULL;
+    bool devices = false;
+    const char *disk = NULL;
+    const char *trace = NULL;
+    size_t trace_mib = 16;
+    const char *record = NULL;
+    const char *replay = NULL;
+    bool verify = false;
+#ifdef VM_PROFILE
+    bool profile = false;
+    const char *symbols = NULL;
+#endif
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--engine=switch") == 0) {
+            engine = ENGINE_SWITCH;
+        } else if (strcmp(argv[i], "--engine=threaded") == 0) {
+            engine = ENGINE_THREADED;
+        } else if (strcmp(argv[i], "--engine=jit") == 0) {
+            engine = ENGINE_JIT;
+        } else if (strncmp(argv[i], "--load=", 7) == 0) {
+            if (!parse_addr(argv[i] + 7, &load_addr)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--entry=", 8) == 0) {
+            if (!parse_addr(argv[i] + 8, &entry)) {
+                usage(argv[0]);
+                return 1;
+            }
+            has_entry = true;
+        } else if (strncmp(argv[i], "--input=", 8) == 0) {
+            input = argv[i] + 8;
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            batch = argv[i] + 8;
+        } else if (strncmp(argv[i], "--metrics=", 10) == 0) {
+            metrics = argv[i] + 10;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            char *end;
+            threads = strtoul(argv[i] + 10, &end, 10);
+            if (*end != '\0') {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else if (strncmp(argv[i], "--bench=", 8) == 0) {
+            bench = true;
+            bench_csv = argv[i] + 8;
+        } else if (strcmp(argv[i], "--devices") == 0) {
+            devices = true;
+        } else if (strncmp(argv[i], "--disk=", 7) == 0) {
+            devices = true;
+            disk = argv[i] + 7;
+        } else if (strncmp(argv[i], "--record=", 9) == 0) {
+            record = argv[i] + 9;
+        } else if (strncmp(argv[i], "--replay=", 9) == 0) {
+            replay = argv[i] + 9;
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verify = true;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            trace = argv[i] + 8;
+        } else if (strncmp(argv[i], "--trace-size=", 13) == 0) {
+            char *end;
+            trace_mib = strtoul(argv[i] + 13, &end, 10);
+            if (*end != '\0' || trace_mib == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+#ifdef VM_PROFILE
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = true;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profile = true;
+            symbols = argv[i] + 10;
+#endif
+        } else if (argv[i][0] != '-' && !image) {
+            image = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ((replay && (input || record)) || (metrics && !batch)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (bench)
+        return bench_run(bench_csv);
+
+    if (batch) {
+        int failed = batch_run(batch, threads, engine, load_addr, has_entry ? entry : IMAGE_ENTRY, metrics);
+        return failed == 0 ? 0 : 1;
+    }
+
     CPU *cpu = cpu_create();
     if (!cpu) {
         fprintf(stderr, "Failed to create CPU\n");
         return 1;
     }
-    ProgramBuilder *pb = pb_init(cpu);
 
-    // program_fibonacci(pb);
-    program_multiplication(pb);
+#ifdef VM_PROFILE
+    // Before loading, so an image's own symbol table lands in the profile too
+    if (profile) {
+        cpu->profile = profile_create();
+        if (!cpu->profile || (symbols && !profile_load_symbols(cpu->profile, symbols))) {
+            profile_destroy(cpu->profile);
+            cpu_destroy(cpu);
+            return 1;
+        }
+    }
+#endif
+
+    if (image) {
+        if (!cpu_load_image(cpu, image, load_addr, has_entry ? entry : IMAGE_ENTRY)) {
+#ifdef VM_PROFILE
+            profile_destroy(cpu->profile);
+#endif
+            cpu_destroy(cpu);
+            return 1;
+        }
+    } else {
+        ProgramBuilder *pb = pb_init(cpu);
+
+        // program_fibonacci(pb);
+        program_multiplication(pb);
+        if (pb->failed) {
+            free(pb);
+#ifdef VM_PROFILE
+            profile_destroy(cpu->profile);
+#endif
+            cpu_destroy(cpu);
+            return 1;
+        }
+        cpu->code_lo = 0;
+        cpu->code_hi = pb->addr;
+        cpu->verify_pending = true;
+        free(pb);
+    }
+
+    OutputDigest recorded;
+    if ((input && !cpu_set_input_file(cpu, input)) || (devices && !attach_devices(cpu, disk)) ||
+        (record && !cpu_record_input(cpu, record)) || (replay && !cpu_replay_input(cpu, replay, &recorded)) ||
+        (trace && !(cpu->trace = trace_open(trace, trace_mib << 20)))) {
+#ifdef VM_PROFILE
+        profile_destroy(cpu->profile);
+#endif
+        cpu_destroy(cpu);
+        return 1;
+    }
+
+    if (verify)
+        verify_print(cpu, stderr);
 
-    cpu_run(cpu);
-    free(pb);
+    cpu_execute(cpu, engine);
+
+#ifdef VM_PROFILE
+    if (cpu->profile) {
+        cpu_flush_output(cpu);
+        profile_report(cpu, stderr);
+        profile_destroy(cpu->profile);
+    }
+#endif
+    trace_close(cpu->trace);
+
+    int status = 0;
+    if (record && !cpu_record_finish(cpu)) {
+        fprintf(stderr, "Failed to write record log %s\n", record);
+        status = 1;
+    }
+    if (replay)
+        status = replay_check(cpu, &recorded);
     cpu_destroy(cpu);
-    return 0;
+    return status;
 }
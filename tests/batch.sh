@@ -0,0 +1,39 @@
+#!/bin/sh
+# --batch on every engine: a job that stops on an unknown opcode fails, its
+# output is still printed under a header saying why, and only the jobs that
+# ran to HALT get metrics. Usage: tests/batch.sh [path/to/vm]
+
+VM=${1:-bin/vm}
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+status=0
+
+# STDOUT "hi"; HALT
+printf '\000\260hi\000\000\000\000' >"$TMP/good.bin"
+# EXT2 block op 6; HALT
+printf '\006\356\000\000' >"$TMP/bad.bin"
+printf '%s\n' "$TMP/good.bin" "$TMP/bad.bin" "$TMP/good.bin" >"$TMP/jobs.txt"
+
+want="=== job 0: $TMP/good.bin ===
+hiCPU Stopped at PC: 0x00006
+=== job 1: $TMP/bad.bin (failed: unknown opcode) ===
+Unknown block opcode: 0x6
+=== job 2: $TMP/good.bin ===
+hiCPU Stopped at PC: 0x00006"
+
+for engine in switch threaded jit; do
+    got=$(timeout 10 "$VM" --engine=$engine --threads=1 --batch="$TMP/jobs.txt" --metrics="$TMP/prom")
+    rc=$?
+    if [ "$got" != "$want" ] || [ $rc -ne 1 ]; then
+        printf 'FAIL %s (exit %d):\n%s\nwant (exit 1):\n%s\n' "$engine" $rc "$got" "$want"
+        status=1
+    fi
+    jobs=$(grep '^vm_guest_instructions_total' "$TMP/prom" | sed 's/.*batch_job="\([0-9]*\)".*/\1/' | tr '\n' ' ')
+    if [ "$jobs" != "0 2 " ]; then
+        printf 'FAIL %s: metrics for jobs %s, want 0 2\n' "$engine" "$jobs"
+        status=1
+    fi
+done
+
+[ $status -eq 0 ] && echo "batch: ok"
+exit $status
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Images the load-time verifier has to reject, run on every engine: --verify
+# must say why and that it runs checked, and the run must still do what the
+# checked interpreter does with them. Usage: tests/verify.sh [path/to/vm]
+
+VM=${1:-bin/vm}
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+status=0
+
+# image NAME WORD... writes the 16-bit words little-endian as a raw image
+image() {
+    name=$1
+    shift
+    : >"$TMP/$name.bin"
+    for w in "$@"; do
+        printf "\\$(printf %03o $((w & 0xFF)))\\$(printf %03o $((w >> 8)))" >>"$TMP/$name.bin"
+    done
+}
+
+# check NAME VERIFY OUTPUT: the --verify line and the program's output
+check() {
+    for engine in switch threaded jit; do
+        got=$(timeout 10 "$VM" --verify --engine=$engine "$TMP/$1.bin" 2>&1)
+        want=$(printf '%s\n%s' "verify: $2" "$3")
+        if [ "$got" != "$want" ]; then
+            printf 'FAIL %s (%s):\n%s\nwant:\n%s\n' "$1" "$engine" "$got" "$want"
+            status=1
+        fi
+    done
+}
+
+# MOVI R1, 1; HALT
+image good 0x3201 0x0000
+check good "2 instructions, 0 subroutines, at most 0 bytes of stack" "CPU Stopped at PC: 0x00002"
+
+# STDOUT "hi"; HALT, the string isn't an instruction
+image string 0xB000 0x6968 0x0000 0x0000
+check string "2 instructions, 0 subroutines, at most 0 bytes of stack" "hiCPU Stopped at PC: 0x00006"
+
+# MOVIW R1, 0 (HALT as the literal); MOVI R5, 2; JMP R5 into the literal
+image literal 0xFE40 0x0000 0x3A02 0x5A00
+check literal "0x00002: a jump lands inside a MOVIW literal or string, running checked" \
+    "CPU Stopped at PC: 0x00002"
+
+# MOVI R5, 0x40; JMP R5 past the end of the code, into zeroed memory (HALT)
+image outside 0x3A40 0x5A00
+check outside "0x00002: goes to 0x00040, outside the code, running checked" \
+    "CPU Stopped at PC: 0x00040"
+
+# EXT2 block op 6; HALT
+image unknown 0xEE06 0x0000
+check unknown "0x00000: unknown block op 6, running checked" "Unknown block opcode: 0x6"
+
+[ $status -eq 0 ] && echo "verify: ok"
+exit $status